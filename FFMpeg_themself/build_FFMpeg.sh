@@ -2,38 +2,79 @@
 
 #Based on https://trac.ffmpeg.org/wiki/CompilationGuide/Ubuntu
 
+#Usage: FFMpeg_themself/build_FFMpeg.sh [release|debug|noasm] [march]
+#  release (default) hand-written SIMD (nasm), -O3 and LTO
+#  debug             SIMD on, no optimization, debug symbols
+#  noasm             old build without x86 SIMD, for hosts without nasm
+#  march             CPU generation the C code is compiled for:
+#                    x86-64 (any), x86-64-v2 (Nehalem+, SSE4.2), x86-64-v3 (Haswell+, AVX2),
+#                    x86-64-v4 (Skylake-X+, AVX-512) or native. The SIMD is picked at
+#                    runtime anyway, march only affects the compiler generated code.
+#                    Default x86-64-v2, the binaries must not run on an older CPU.
+PROFILE="${1:-release}"
+MARCH="${2:-x86-64-v2}"
+
 #be in root of repo #cd FFMpeg_MJPEG-transcode-VP9_C_Universe/
 if [ -d "FFMpeg_themself" ]; then
 cd "FFMpeg_themself"
+
+FLAGS=(
+  --pkg-config-flags="--static"
+  --extra-libs="-lpthread -lm"
+  --ld="g++"
+  --enable-gpl
+  --enable-nonfree
+  --enable-libx265
+  --enable-libvpx
+  --enable-shared
+  #--enable-static
+  --disable-ffplay
+  --disable-ffprobe
+  #--disable-ffmpeg
+  #--disable-swresample
+  #--disable-decoders
+  --disable-doc
+  --disable-encoders
+  --enable-encoder=libvpx-vp9
+  --enable-libvorbis
+  --enable-encoder=libvorbis,vorbis
+  --enable-libopus
+  --enable-encoder=libopus
+  --enable-encoder=libx265
+  --enable-encoder=mjpeg
+)
+case "$PROFILE" in
+  release)
+    FLAGS+=(--enable-x86asm --optflags="-O3" --enable-lto)
+    CFLAGS="-march=${MARCH}"
+    ;;
+  debug)
+    FLAGS+=(--enable-x86asm --disable-optimizations --enable-debug=3 --disable-stripping)
+    CFLAGS="-march=${MARCH}"
+    ;;
+  noasm)
+    FLAGS+=(--disable-x86asm)
+    CFLAGS=""
+    ;;
+  *)
+    echo "err unknown profile $PROFILE, use release, debug or noasm"
+    exit 1
+    ;;
+esac
+if [ "$PROFILE" != "noasm" ] && ! command -v nasm >/dev/null; then
+  echo "err nasm not found, do sudo apt install nasm (or build the noasm profile)"
+  exit 1
+fi
+
 rm -Rf FFmpeg_build bin && mkdir FFmpeg_build bin
 cd "FFmpeg_build"
 PATH="../bin:$PATH" PKG_CONFIG_PATH="${PWD}/lib/pkgconfig" ../FFmpeg/configure \
   --prefix="${PWD}" \
-  --pkg-config-flags="--static" \
-  --extra-cflags="-I${PWD}/include" \
-  --extra-ldflags="-L${PWD}/lib" \
-  --extra-libs="-lpthread -lm" \
-  --ld="g++" \
-  --enable-gpl \
-  --enable-nonfree \
   --bindir="../bin" \
-  --disable-x86asm \
-  --enable-libx265 \
-  --enable-libvpx \
-  --enable-shared \
-  #--enable-static \
-  --disable-ffplay \
-  --disable-ffprobe \
-  #--disable-ffmpeg \
-  #--disable-swresample \
-  #--disable-decoders \
-  --disable-doc \
-  --disable-encoders \
-  --enable-encoder=libvpx-vp9 \
-  --enable-libvorbis \
-  --enable-encoder=libx265 \
-  --enable-encoder=mjpeg
-PATH="../bin:$PATH" make -j16
+  --extra-cflags="-I${PWD}/include ${CFLAGS}" \
+  --extra-ldflags="-L${PWD}/lib ${CFLAGS}" \
+  "${FLAGS[@]}" || exit 1
+PATH="../bin:$PATH" make -j"$(nproc)" || exit 1
 make install
 #If you plan use ffmpeg console utility then do
 #export LD_LIBRARY_PATH="${PWD}/lib/"
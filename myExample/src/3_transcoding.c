@@ -7,34 +7,234 @@
 #include <libavutil/opt.h>
 #include <string.h>
 #include <inttypes.h>
+#include <unistd.h>
+#include <libavcodec/bsf.h>
+#include <libavutil/avstring.h>
+#include <libavutil/parseutils.h>
+#include <libavutil/pixdesc.h>
+#include "async_log.h"
+#include "async_writer.h"
 #include "video_debugging.h"
-
+#include "media_pool.h"
+#include "vp9_tuning.h"
+
+/* what happens to the first video/audio stream of the input */
+enum StreamAction {
+    STREAM_ACTION_COPY,      /* remux the packets untouched */
+    STREAM_ACTION_TRANSCODE, /* decode and encode with video_codec/audio_codec */
+    STREAM_ACTION_DROP,
+};
+
+/* What a transcoded stream has to look like. With smart_copy an input stream
+ * that already meets all of it is copied instead, unset fields match anything. */
+typedef struct StreamTarget {
+    int max_width, max_height;
+    char *pix_fmt;
+    char *profile;             /* as avcodec_profile_name(), e.g. "High", "Main" */
+    int64_t max_bit_rate;
+    int max_gop;               /* longest keyframe distance in frames */
+} StreamTarget;
+
+/*
+ * One job, from the command line and/or a config file (see parse_spec_option()
+ * for the keys). Strings and dictionaries are owned, free_spec() releases them.
+ */
 typedef struct StreamingParams {
-    //char copy_video;
-    char copy_audio;
-    char *output_extension;
-    char *muxer_opt_key;
-    char *muxer_opt_value;
+    char *input;
+    char *output;
+    char *format;              /* muxer short name, NULL = guessed from output */
+    enum StreamAction video_action;
+    enum StreamAction audio_action;
     char *video_codec;
     char *audio_codec;
-    char *codec_priv_key;
-    char *codec_priv_value;
+    AVDictionary *video_opts;  /* codec private options, e.g. x265-params */
+    AVDictionary *audio_opts;
+    AVDictionary *muxer_opts;  /* e.g. movflags for fragmented MP4 */
+    int threads;               /* per decoder/encoder, 0 = picked by the codec */
+    int smart_copy;            /* copy instead of transcoding what fits the target */
+    StreamTarget video_target;
+    StreamTarget audio_target;
+    char *decision_file;       /* one line per job with the chosen paths is appended */
 } StreamingParams;
 
 typedef struct StreamingContext {
     AVFormatContext *avfc;
-    AVCodec *video_avc;
-    AVCodec *audio_avc;
+    const AVCodec *video_avc;
+    const AVCodec *audio_avc;
     AVStream *video_avs;
     AVStream *audio_avs;
     AVCodecContext *video_avcc;
     AVCodecContext *audio_avcc;
     int video_index;
     int audio_index;
+    AVBSFContext *video_bsf;   /* copy fix-ups, output side only */
+    AVBSFContext *audio_bsf;
     char *filename;
 } StreamingContext;
 
-int fill_stream_info(AVStream *avs, AVCodec **avc, AVCodecContext **avcc) {
+/* the path picked for a stream, and why */
+typedef struct StreamDecision {
+    const char *bsf;           /* bitstream filter for a copied stream, or NULL */
+    char reason[128];
+} StreamDecision;
+
+/* packets read while probing, replayed before reading on */
+typedef struct ProbeBuffer {
+    AVPacket **packets;
+    int nb_packets;
+    int next;
+} ProbeBuffer;
+
+/* what the first seconds of the input look like */
+typedef struct InputProbe {
+    int64_t video_bit_rate;    /* from codecpar, else measured, 0 = unknown */
+    int64_t audio_bit_rate;
+    int video_gop;             /* longest keyframe distance seen, 0 = not probed */
+} InputProbe;
+
+#define PROBE_SECONDS 5
+#define PROBE_MAX_PACKETS 5000
+
+static const char *const stream_action_names[] = {
+    [STREAM_ACTION_COPY]      = "copy",
+    [STREAM_ACTION_TRANSCODE] = "transcode",
+    [STREAM_ACTION_DROP]      = "drop",
+};
+
+static int set_string(char **dst, const char *value) {
+    av_freep(dst);
+    *dst = av_strdup(value);
+    return *dst ? 0 : -1;
+}
+
+/* "copy", "none" or an encoder name */
+static int parse_codec_choice(const char *value, enum StreamAction *action, char **codec) {
+    if (!strcmp(value, "copy")) {
+        *action = STREAM_ACTION_COPY;
+    } else if (!strcmp(value, "none")) {
+        *action = STREAM_ACTION_DROP;
+    } else {
+        if (!avcodec_find_encoder_by_name(value)) {logging("unknown encoder '%s'", value); return -1;}
+        *action = STREAM_ACTION_TRANSCODE;
+        return set_string(codec, value);
+    }
+    return 0;
+}
+
+/* key=value pairs separated by ':', quote values that contain them:
+ * x265-params='keyint=60:min-keyint=60' */
+static int parse_dict_option(AVDictionary **dict, const char *key, const char *value) {
+    if (av_dict_parse_string(dict, value, "=", ":", 0) < 0) {logging("invalid %s '%s'", key, value); return -1;}
+    return 0;
+}
+
+/* "800k", "2.5M" or bits per second */
+static int parse_bit_rate(const char *value, int64_t *bit_rate) {
+    char *end;
+    double rate = strtod(value, &end);
+    if (*end == 'k' || *end == 'M')
+        rate *= *end++ == 'k' ? 1e3 : 1e6;
+    if (end == value || *end || rate <= 0) {logging("invalid bitrate '%s'", value); return -1;}
+    *bit_rate = rate;
+    return 0;
+}
+
+/* video_max_size, video_pix_fmt, ... and audio_max_bit_rate, ... */
+static int parse_target_option(StreamTarget *t, const char *key, const char *value) {
+    if (!strcmp(key, "max_size")) {
+        if (av_parse_video_size(&t->max_width, &t->max_height, value) < 0) {logging("invalid size '%s'", value); return -1;}
+        return 0;
+    }
+    if (!strcmp(key, "pix_fmt")) {
+        if (av_get_pix_fmt(value) == AV_PIX_FMT_NONE) {logging("unknown pixel format '%s'", value); return -1;}
+        return set_string(&t->pix_fmt, value);
+    }
+    if (!strcmp(key, "profile"))      return set_string(&t->profile, value);
+    if (!strcmp(key, "max_bit_rate")) return parse_bit_rate(value, &t->max_bit_rate);
+    if (!strcmp(key, "max_gop")) {
+        t->max_gop = atoi(value);
+        if (t->max_gop < 1) {logging("invalid max_gop '%s'", value); return -1;}
+        return 0;
+    }
+    return 1;
+}
+
+/* one key of the job spec, shared by the config file and the command line */
+static int parse_spec_option(StreamingParams *sp, const char *key, const char *value) {
+    int ret;
+    if (!strcmp(key, "input"))          return set_string(&sp->input, value);
+    if (!strcmp(key, "output"))         return set_string(&sp->output, value);
+    if (!strcmp(key, "format"))         return set_string(&sp->format, value);
+    if (!strcmp(key, "video"))          return parse_codec_choice(value, &sp->video_action, &sp->video_codec);
+    if (!strcmp(key, "audio"))          return parse_codec_choice(value, &sp->audio_action, &sp->audio_codec);
+    if (!strcmp(key, "video_options"))  return parse_dict_option(&sp->video_opts, key, value);
+    if (!strcmp(key, "audio_options"))  return parse_dict_option(&sp->audio_opts, key, value);
+    if (!strcmp(key, "muxer_options"))  return parse_dict_option(&sp->muxer_opts, key, value);
+    if (!strcmp(key, "decision_file"))  return set_string(&sp->decision_file, value);
+    if (!strcmp(key, "smart_copy")) {
+        sp->smart_copy = atoi(value);
+        return 0;
+    }
+    if (!strcmp(key, "threads")) {
+        sp->threads = atoi(value);
+        if (sp->threads < 0) {logging("invalid threads '%s'", value); return -1;}
+        return 0;
+    }
+    if (av_strstart(key, "video_", NULL) && (ret = parse_target_option(&sp->video_target, key + 6, value)) <= 0)
+        return ret;
+    if (av_strstart(key, "audio_", NULL) && (ret = parse_target_option(&sp->audio_target, key + 6, value)) <= 0)
+        return ret;
+    logging("unknown job option '%s'", key);
+    return -1;
+}
+
+/* "key value" per line, '#' starts a comment line */
+static int parse_spec_file(StreamingParams *sp, const char *path) {
+    char line[4096];
+    int ret = 0;
+
+    FILE *f = fopen(path, "r");
+    if (!f) {logging("cannot open job file %s", path); return -1;}
+
+    while (!ret && fgets(line, sizeof(line), f)) {
+        char *key = line + strspn(line, " \t");
+        char *value, *end;
+
+        if (*key == '#' || *key == '\n' || *key == '\r' || !*key)
+            continue;
+        value = key + strcspn(key, " \t\r\n");
+        if (*value)
+            *value++ = '\0';
+        value += strspn(value, " \t");
+        end = value + strlen(value);
+        while (end > value && (end[-1] == '\n' || end[-1] == '\r' ||
+                               end[-1] == ' ' || end[-1] == '\t'))
+            *--end = '\0';
+
+        ret = parse_spec_option(sp, key, value);
+    }
+    fclose(f);
+    if (ret) logging("in job file %s", path);
+    return ret;
+}
+
+static void free_spec(StreamingParams *sp) {
+    av_freep(&sp->input);
+    av_freep(&sp->output);
+    av_freep(&sp->format);
+    av_freep(&sp->video_codec);
+    av_freep(&sp->audio_codec);
+    av_dict_free(&sp->video_opts);
+    av_dict_free(&sp->audio_opts);
+    av_dict_free(&sp->muxer_opts);
+    av_freep(&sp->video_target.pix_fmt);
+    av_freep(&sp->video_target.profile);
+    av_freep(&sp->audio_target.pix_fmt);
+    av_freep(&sp->audio_target.profile);
+    av_freep(&sp->decision_file);
+}
+
+int fill_stream_info(AVStream *avs, const AVCodec **avc, AVCodecContext **avcc, int threads) {
     *avc = avcodec_find_decoder(avs->codecpar->codec_id);
     if (!*avc) {logging("failed to find the codec"); return -1;}
 
@@ -42,6 +242,8 @@ int fill_stream_info(AVStream *avs, AVCodec **avc, AVCodecContext **avcc) {
     if (!*avcc) {logging("failed to alloc memory for codec context"); return -1;}
 
     if (avcodec_parameters_to_context(*avcc, avs->codecpar) < 0) {logging("failed to fill codec context"); return -1;}
+    (*avcc)->thread_count = threads;
+    (*avcc)->pkt_timebase = avs->time_base;
 
     if (avcodec_open2(*avcc, *avc, NULL) < 0) {logging("failed to open codec"); return -1;}
     return 0;
@@ -57,35 +259,220 @@ int open_media(const char *in_filename, AVFormatContext **avfc) {
     return 0;
 }
 
-int prepare_decoder(StreamingContext *sc) {
+/* Find the first video and audio stream, a missing one is dropped. */
+void select_streams(StreamingContext *sc, StreamingParams *sp) {
+    sc->video_index = sc->audio_index = -1;
     for (int i = 0; i < sc->avfc->nb_streams; i++) {
-        if (sc->avfc->streams[i]->codecpar->codec_type == AVMEDIA_TYPE_VIDEO) {
+        enum AVMediaType type = sc->avfc->streams[i]->codecpar->codec_type;
+        if (type == AVMEDIA_TYPE_VIDEO && sc->video_index < 0 &&
+            !(sc->avfc->streams[i]->disposition & AV_DISPOSITION_ATTACHED_PIC)) {
             sc->video_avs = sc->avfc->streams[i];
             sc->video_index = i;
+        } else if (type == AVMEDIA_TYPE_AUDIO && sc->audio_index < 0) {
+            sc->audio_avs = sc->avfc->streams[i];
+            sc->audio_index = i;
+        } else {
+            logging("skipping stream %d, only the first audio and video streams are used", i);
+        }
+    }
+    if (sc->video_index < 0) sp->video_action = STREAM_ACTION_DROP;
+    if (sc->audio_index < 0) sp->audio_action = STREAM_ACTION_DROP;
+}
+
+static int next_packet(StreamingContext *sc, ProbeBuffer *buf, AVPacket *pkt) {
+    if (buf->next < buf->nb_packets) {
+        av_packet_move_ref(pkt, buf->packets[buf->next]);
+        av_packet_free(&buf->packets[buf->next++]);
+        return 0;
+    }
+    return av_read_frame(sc->avfc, pkt);
+}
+
+static void free_probe_buffer(ProbeBuffer *buf) {
+    for (int i = buf->next; i < buf->nb_packets; i++)
+        av_packet_free(&buf->packets[i]);
+    av_freep(&buf->packets);
+    buf->nb_packets = buf->next = 0;
+}
+
+static double stream_seconds(const AVStream *avs, int64_t first, int64_t last) {
+    return first == AV_NOPTS_VALUE ? 0 : (last - first) * av_q2d(avs->time_base);
+}
 
-            if (fill_stream_info(sc->video_avs, &sc->video_avc, &sc->video_avcc)) {return -1;}
-        } else if (sc->avfc->streams[i]->codecpar->codec_type == AVMEDIA_TYPE_AUDIO) {
+/*
+ * Read the start of the input when the targets need more than codecpar has:
+ * the longest keyframe distance (over 2 * max_gop + 1 frames) and, when the
+ * container does not know it, the bitrate (over PROBE_SECONDS). The packets
+ * are kept in buf, nothing is decoded.
+ */
+int probe_input(StreamingContext *sc, const StreamingParams *sp, ProbeBuffer *buf, InputProbe *probe) {
+    const StreamTarget *vt = &sp->video_target, *at = &sp->audio_target;
+    int smart_video = sp->smart_copy && sp->video_action == STREAM_ACTION_TRANSCODE;
+    int smart_audio = sp->smart_copy && sp->audio_action == STREAM_ACTION_TRANSCODE;
+    int need_gop = smart_video && vt->max_gop > 0;
+    int need_video_rate = smart_video && vt->max_bit_rate > 0 && !sc->video_avs->codecpar->bit_rate;
+    int need_audio_rate = smart_audio && at->max_bit_rate > 0 && !sc->audio_avs->codecpar->bit_rate;
+    int64_t first[2] = {AV_NOPTS_VALUE, AV_NOPTS_VALUE}, last[2] = {0, 0}, bytes[2] = {0, 0};
+    int video_frames = 0, since_key = 0;
+
+    probe->video_bit_rate = smart_video ? sc->video_avs->codecpar->bit_rate : 0;
+    probe->audio_bit_rate = smart_audio ? sc->audio_avs->codecpar->bit_rate : 0;
+    probe->video_gop = 0;
+
+    while ((need_gop || need_video_rate || need_audio_rate) && buf->nb_packets < PROBE_MAX_PACKETS) {
+        AVPacket *pkt = av_packet_alloc();
+        if (!pkt) {logging("failed to allocated memory for AVPacket"); return -1;}
+        if (av_read_frame(sc->avfc, pkt) < 0) {av_packet_free(&pkt); break;}
+        if (av_reallocp_array(&buf->packets, buf->nb_packets + 1, sizeof(*buf->packets)) < 0) {
+            av_packet_free(&pkt);
+            return -1;
+        }
+        buf->packets[buf->nb_packets++] = pkt;
+
+        int v = pkt->stream_index == sc->video_index;
+        if (!v && pkt->stream_index != sc->audio_index)
+            continue;
+        int64_t ts = pkt->pts != AV_NOPTS_VALUE ? pkt->pts : pkt->dts;
+        if (ts != AV_NOPTS_VALUE) {
+            if (first[v] == AV_NOPTS_VALUE) first[v] = ts;
+            last[v] = FFMAX(last[v], ts + pkt->duration);
+        }
+        bytes[v] += pkt->size;
+
+        if (v) {
+            video_frames++;
+            if (pkt->flags & AV_PKT_FLAG_KEY && since_key) {
+                probe->video_gop = FFMAX(probe->video_gop, since_key);
+                since_key = 0;
+            }
+            since_key++;
+            need_gop = need_gop && video_frames <= 2 * vt->max_gop;
+            need_video_rate = need_video_rate && stream_seconds(sc->video_avs, first[1], last[1]) < PROBE_SECONDS;
         } else {
-            logging("skipping streams other than audio and video");
+            need_audio_rate = need_audio_rate && stream_seconds(sc->audio_avs, first[0], last[0]) < PROBE_SECONDS;
         }
     }
+    // the open GOP at the end counts as well, it is at least that long
+    probe->video_gop = FFMAX(probe->video_gop, since_key);
+
+    double seconds = stream_seconds(sc->video_avs, first[1], last[1]);
+    if (!probe->video_bit_rate && seconds > 0) probe->video_bit_rate = bytes[1] * 8 / seconds;
+    seconds = sc->audio_avs ? stream_seconds(sc->audio_avs, first[0], last[0]) : 0;
+    if (!probe->audio_bit_rate && seconds > 0) probe->audio_bit_rate = bytes[0] * 8 / seconds;
+    if (buf->nb_packets)
+        logging("probed %d packets: longest GOP %d frames, video %"PRId64" bit/s, audio %"PRId64" bit/s",
+                buf->nb_packets, probe->video_gop, probe->video_bit_rate, probe->audio_bit_rate);
+    return 0;
+}
 
+/*
+ * Whether the input stream can be written as is instead of encoding it with
+ * encoder_name to target. Fills why with the first mismatch.
+ */
+static int stream_fits_target(const AVStream *avs, const char *encoder_name, const StreamTarget *t,
+                              int64_t bit_rate, int gop, const AVOutputFormat *ofmt,
+                              char *why, size_t size) {
+    const AVCodecParameters *par = avs->codecpar;
+    const AVCodec *enc = avcodec_find_encoder_by_name(encoder_name);
+    const char *profile = avcodec_profile_name(par->codec_id, par->profile);
+    const char *pix_fmt = par->codec_type == AVMEDIA_TYPE_VIDEO ? av_get_pix_fmt_name(par->format) : NULL;
+
+    if (!enc || enc->id != par->codec_id) {
+        snprintf(why, size, "%s is not %s", avcodec_get_name(par->codec_id), encoder_name);
+    } else if (avformat_query_codec(ofmt, par->codec_id, FF_COMPLIANCE_NORMAL) == 0) {
+        snprintf(why, size, "%s cannot carry %s", ofmt->name, avcodec_get_name(par->codec_id));
+    } else if (t->profile && (!profile || av_strcasecmp(profile, t->profile))) {
+        snprintf(why, size, "profile %s is not %s", profile ? profile : "unknown", t->profile);
+    } else if (t->pix_fmt && (!pix_fmt || strcmp(pix_fmt, t->pix_fmt))) {
+        snprintf(why, size, "pix_fmt %s is not %s", pix_fmt ? pix_fmt : "unknown", t->pix_fmt);
+    } else if (t->max_width && (par->width > t->max_width || par->height > t->max_height)) {
+        snprintf(why, size, "%dx%d is larger than %dx%d", par->width, par->height, t->max_width, t->max_height);
+    } else if (t->max_bit_rate && (!bit_rate || bit_rate > t->max_bit_rate)) {
+        snprintf(why, size, "bitrate %"PRId64" is not within %"PRId64, bit_rate, t->max_bit_rate);
+    } else if (t->max_gop && (!gop || gop > t->max_gop)) {
+        snprintf(why, size, "GOP of %d frames is longer than %d", gop, t->max_gop);
+    } else {
+        snprintf(why, size, "%s %s already fits the target", avcodec_get_name(par->codec_id), profile ? profile : "");
+        return 1;
+    }
     return 0;
 }
 
-int prepare_video_encoder(StreamingContext *sc, AVCodecContext *decoder_ctx, AVRational input_framerate, StreamingParams sp) {
+/*
+ * Bitstream fix-ups a copied stream needs in the output container: MP4/MKV
+ * style length-prefixed H.264/HEVC to Annex B for MPEG-TS and raw streams,
+ * ADTS AAC to an AudioSpecificConfig for containers with global headers.
+ */
+static const char *copy_bsf(const AVCodecParameters *par, const AVOutputFormat *ofmt) {
+    int length_prefixed = par->extradata_size > 0 && par->extradata[0] == 1;
+    int annexb_out = !strcmp(ofmt->name, "mpegts") || !strcmp(ofmt->name, "h264") || !strcmp(ofmt->name, "hevc");
+
+    if (par->codec_id == AV_CODEC_ID_H264 && length_prefixed && annexb_out) return "h264_mp4toannexb";
+    if (par->codec_id == AV_CODEC_ID_HEVC && length_prefixed && annexb_out) return "hevc_mp4toannexb";
+    if (par->codec_id == AV_CODEC_ID_AAC && !par->extradata_size && (ofmt->flags & AVFMT_GLOBALHEADER))
+        return "aac_adtstoasc";
+    return NULL;
+}
+
+/* copy, copy with fix-ups or transcode, for one stream */
+static void decide_stream(AVStream *avs, enum StreamAction *action, const char *encoder_name,
+                          const StreamTarget *t, int smart_copy, int64_t bit_rate, int gop,
+                          const AVOutputFormat *ofmt, StreamDecision *d) {
+    if (*action == STREAM_ACTION_TRANSCODE) {
+        if (!smart_copy)
+            snprintf(d->reason, sizeof(d->reason), "requested");
+        else if (stream_fits_target(avs, encoder_name, t, bit_rate, gop, ofmt, d->reason, sizeof(d->reason)))
+            *action = STREAM_ACTION_COPY;
+    } else if (*action == STREAM_ACTION_COPY) {
+        snprintf(d->reason, sizeof(d->reason), "requested");
+    }
+    if (*action == STREAM_ACTION_COPY)
+        d->bsf = copy_bsf(avs->codecpar, ofmt);
+}
+
+static void log_decision(const char *type, enum StreamAction action, const char *codec, const StreamDecision *d) {
+    if (action == STREAM_ACTION_DROP)
+        logging("%s: drop", type);
+    else if (action == STREAM_ACTION_TRANSCODE)
+        logging("%s: transcode to %s (%s)", type, codec, d->reason);
+    else
+        logging("%s: copy%s%s (%s)", type, d->bsf ? " + " : "", d->bsf ? d->bsf : "", d->reason);
+}
+
+/* input, output, then "<path>[+<bsf>]" and the reason for video and audio, tab separated */
+static void record_decision(const StreamingParams *sp, const StreamDecision *video, const StreamDecision *audio) {
+    const StreamDecision *d[2] = {video, audio};
+    enum StreamAction action[2] = {sp->video_action, sp->audio_action};
+    FILE *f = fopen(sp->decision_file, "a");
+    if (!f) {logging("cannot open decision file %s", sp->decision_file); return;}
+
+    fprintf(f, "%s\t%s", sp->input, sp->output);
+    for (int i = 0; i < 2; i++)
+        fprintf(f, "\t%s%s%s\t%s", stream_action_names[action[i]], d[i]->bsf ? "+" : "",
+                d[i]->bsf ? d[i]->bsf : "", d[i]->reason);
+    fprintf(f, "\n");
+    fclose(f);
+}
+
+/* Open a decoder only for the streams that are transcoded. */
+int prepare_decoder(StreamingContext *sc, StreamingParams *sp) {
+    if (sp->video_action == STREAM_ACTION_TRANSCODE &&
+        fill_stream_info(sc->video_avs, &sc->video_avc, &sc->video_avcc, sp->threads)) {return -1;}
+    if (sp->audio_action == STREAM_ACTION_TRANSCODE &&
+        fill_stream_info(sc->audio_avs, &sc->audio_avc, &sc->audio_avcc, sp->threads)) {return -1;}
+    return 0;
+}
+
+int prepare_video_encoder(StreamingContext *sc, AVCodecContext *decoder_ctx, AVRational input_framerate, const StreamingParams *sp) {
     sc->video_avs = avformat_new_stream(sc->avfc, NULL);
+    if (!sc->video_avs) {logging("could not allocate the output stream"); return -1;}
 
-    sc->video_avc = avcodec_find_encoder_by_name(sp.video_codec);
+    sc->video_avc = avcodec_find_encoder_by_name(sp->video_codec);
     if (!sc->video_avc) {logging("could not find the proper codec"); return -1;}
 
     sc->video_avcc = avcodec_alloc_context3(sc->video_avc);
     if (!sc->video_avcc) {logging("could not allocated memory for codec context"); return -1;}
 
-    av_opt_set(sc->video_avcc->priv_data, "preset", "fast", 0);
-    if (sp.codec_priv_key && sp.codec_priv_value)
-        av_opt_set(sc->video_avcc->priv_data, sp.codec_priv_key, sp.codec_priv_value, 0);
-
     sc->video_avcc->height = decoder_ctx->height;
     sc->video_avcc->width = decoder_ctx->width;
     sc->video_avcc->sample_aspect_ratio = decoder_ctx->sample_aspect_ratio;
@@ -94,62 +481,136 @@ int prepare_video_encoder(StreamingContext *sc, AVCodecContext *decoder_ctx, AVR
     else
         sc->video_avcc->pix_fmt = decoder_ctx->pix_fmt;
 
+    // 2 Mbit/s on average with peaks up to 2.5 Mbit/s over a 4 Mbit buffer, no floor:
+    // a minimum rate only makes the encoder pad static scenes
     sc->video_avcc->bit_rate = 2 * 1000 * 1000;
     sc->video_avcc->rc_buffer_size = 4 * 1000 * 1000;
-    sc->video_avcc->rc_max_rate = 2 * 1000 * 1000;
-    sc->video_avcc->rc_min_rate = 2.5 * 1000 * 1000;
+    sc->video_avcc->rc_max_rate = 2.5 * 1000 * 1000;
 
     sc->video_avcc->time_base = av_inv_q(input_framerate);
     sc->video_avs->time_base = sc->video_avcc->time_base;
+    if (sc->avfc->oformat->flags & AVFMT_GLOBALHEADER)
+        sc->video_avcc->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
+
+    AVDictionary *encoder_opts = NULL;
+    av_dict_copy(&encoder_opts, sp->video_opts, 0);
+    // b, maxrate, minrate and bufsize of the job replace the defaults above, the rest is for the encoder
+    if (av_opt_set_dict(sc->video_avcc, &encoder_opts) < 0) {logging("invalid video options"); av_dict_free(&encoder_opts); return -1;}
+    if (sc->video_avcc->rc_max_rate && sc->video_avcc->rc_min_rate > sc->video_avcc->rc_max_rate) {
+        logging("minrate %"PRId64" is above maxrate %"PRId64, sc->video_avcc->rc_min_rate, sc->video_avcc->rc_max_rate);
+        av_dict_free(&encoder_opts);
+        return -1;
+    }
+    // libvpx ignores "preset", it gets threading and speed settings picked for the resolution instead
+    if (sc->video_avc->id == AV_CODEC_ID_VP9) {
+        if (vp9_tuning_set_defaults(&encoder_opts, sc->video_avcc->width, sc->video_avcc->height, sp->threads, 0) < 0) {logging("could not set the vp9 options"); av_dict_free(&encoder_opts); return -1;}
+    } else {
+        sc->video_avcc->thread_count = sp->threads;
+        av_dict_set(&encoder_opts, "preset", "fast", AV_DICT_DONT_OVERWRITE);
+    }
 
-    if (avcodec_open2(sc->video_avcc, sc->video_avc, NULL) < 0) {logging("could not open the codec"); return -1;}
+    if (avcodec_open2(sc->video_avcc, sc->video_avc, &encoder_opts) < 0) {logging("could not open the codec"); av_dict_free(&encoder_opts); return -1;}
+    av_dict_free(&encoder_opts);
     avcodec_parameters_from_context(sc->video_avs->codecpar, sc->video_avcc);
     return 0;
 }
 
-int prepare_audio_encoder(StreamingContext *sc, int sample_rate, StreamingParams sp){
+/* There is no resampler here, the encoder has to take the decoded sample format. */
+int prepare_audio_encoder(StreamingContext *sc, AVCodecContext *decoder_ctx, const StreamingParams *sp) {
     sc->audio_avs = avformat_new_stream(sc->avfc, NULL);
+    if (!sc->audio_avs) {logging("could not allocate the output stream"); return -1;}
 
-    sc->audio_avc = avcodec_find_encoder_by_name(sp.audio_codec);
+    sc->audio_avc = avcodec_find_encoder_by_name(sp->audio_codec);
     if (!sc->audio_avc) {logging("could not find the proper codec"); return -1;}
 
     sc->audio_avcc = avcodec_alloc_context3(sc->audio_avc);
     if (!sc->audio_avcc) {logging("could not allocated memory for codec context"); return -1;}
 
-    int OUTPUT_CHANNELS = 2;
     int OUTPUT_BIT_RATE = 196000;
-    sc->audio_avcc->channels       = OUTPUT_CHANNELS;
-    sc->audio_avcc->channel_layout = av_get_default_channel_layout(OUTPUT_CHANNELS);
-    sc->audio_avcc->sample_rate    = sample_rate;
-    sc->audio_avcc->sample_fmt     = sc->audio_avc->sample_fmts[0];
+    if (av_channel_layout_copy(&sc->audio_avcc->ch_layout, &decoder_ctx->ch_layout) < 0) {logging("could not copy the channel layout"); return -1;}
+    sc->audio_avcc->sample_rate    = decoder_ctx->sample_rate;
+    sc->audio_avcc->sample_fmt     = decoder_ctx->sample_fmt;
     sc->audio_avcc->bit_rate       = OUTPUT_BIT_RATE;
-    sc->audio_avcc->time_base      = (AVRational){1, sample_rate};
+    sc->audio_avcc->time_base      = (AVRational){1, decoder_ctx->sample_rate};
+    sc->audio_avcc->thread_count   = sp->threads;
+    if (sc->avfc->oformat->flags & AVFMT_GLOBALHEADER)
+        sc->audio_avcc->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
+
+    const enum AVSampleFormat *fmt = sc->audio_avc->sample_fmts;
+    while (fmt && *fmt != AV_SAMPLE_FMT_NONE && *fmt != decoder_ctx->sample_fmt)
+        fmt++;
+    if (fmt && *fmt == AV_SAMPLE_FMT_NONE) {
+        logging("%s does not take %s samples, copy the audio or pick another encoder",
+                sp->audio_codec, av_get_sample_fmt_name(decoder_ctx->sample_fmt));
+        return -1;
+    }
 
     sc->audio_avcc->strict_std_compliance = FF_COMPLIANCE_EXPERIMENTAL;
 
     sc->audio_avs->time_base = sc->audio_avcc->time_base;
 
-    if (avcodec_open2(sc->audio_avcc, sc->audio_avc, NULL) < 0) {logging("could not open the codec"); return -1;}
+    AVDictionary *encoder_opts = NULL;
+    av_dict_copy(&encoder_opts, sp->audio_opts, 0);
+    if (avcodec_open2(sc->audio_avcc, sc->audio_avc, &encoder_opts) < 0) {logging("could not open the codec"); av_dict_free(&encoder_opts); return -1;}
+    av_dict_free(&encoder_opts);
     avcodec_parameters_from_context(sc->audio_avs->codecpar, sc->audio_avcc);
     return 0;
 }
 
-int prepare_copy(AVFormatContext *avfc, AVStream **avs, AVCodecParameters *decoder_par) {
+/* With a bitstream filter the output stream gets the filtered parameters. */
+int prepare_copy(AVFormatContext *avfc, AVStream **avs, const AVStream *decoder_avs, const char *bsf_name, AVBSFContext **bsf) {
+    const AVCodecParameters *par = decoder_avs->codecpar;
+
     *avs = avformat_new_stream(avfc, NULL);
-    avcodec_parameters_copy((*avs)->codecpar, decoder_par);
+    if (!*avs) {logging("could not allocate the output stream"); return -1;}
+    if (bsf_name) {
+        const AVBitStreamFilter *filter = av_bsf_get_by_name(bsf_name);
+        if (!filter || av_bsf_alloc(filter, bsf) < 0) {logging("could not allocate the %s filter", bsf_name); return -1;}
+        if (avcodec_parameters_copy((*bsf)->par_in, par) < 0) {logging("could not copy the codec parameters"); return -1;}
+        (*bsf)->time_base_in = decoder_avs->time_base;
+        if (av_bsf_init(*bsf) < 0) {logging("could not init the %s filter", bsf_name); return -1;}
+        par = (*bsf)->par_out;
+    }
+    if (avcodec_parameters_copy((*avs)->codecpar, par) < 0) {logging("could not copy the codec parameters"); return -1;}
+    // the input container's tag may mean something else in the output container
+    (*avs)->codecpar->codec_tag = 0;
+    return 0;
+}
+
+static int write_copied(AVFormatContext *avfc, AVPacket *pkt, AVRational tb, AVStream *encoder_avs) {
+    av_packet_rescale_ts(pkt, tb, encoder_avs->time_base);
+    pkt->stream_index = encoder_avs->index;
+    pkt->pos = -1;
+    if (av_interleaved_write_frame(avfc, pkt) < 0) { logging("error while copying stream packet"); return -1; }
     return 0;
 }
 
-int remux(AVPacket **pkt, AVFormatContext **avfc, AVRational decoder_tb, AVRational encoder_tb) {
-    av_packet_rescale_ts(*pkt, decoder_tb, encoder_tb);
-    if (av_interleaved_write_frame(*avfc, *pkt) < 0) { logging("error while copying stream packet"); return -1; }
+/* A NULL pkt drains the bitstream filter at the end. */
+int remux(AVPacket **pkt, AVFormatContext **avfc, AVRational decoder_tb, AVStream *encoder_avs, AVBSFContext *bsf) {
+    if (!bsf)
+        return *pkt ? write_copied(*avfc, *pkt, decoder_tb, encoder_avs) : 0;
+
+    if (av_bsf_send_packet(bsf, *pkt) < 0) { logging("error while filtering stream packet"); return -1; }
+    AVPacket *out = media_pool_get_packet();
+    if (!out) {logging("could not allocate memory for output packet"); return -1;}
+    int response;
+    while ((response = av_bsf_receive_packet(bsf, out)) >= 0) {
+        if (write_copied(*avfc, out, bsf->time_base_out, encoder_avs)) {media_pool_put_packet(&out); return -1;}
+    }
+    media_pool_put_packet(&out);
+    if (response != AVERROR(EAGAIN) && response != AVERROR_EOF) { logging("error while filtering stream packet"); return -1; }
     return 0;
 }
 
 int encode_video(StreamingContext *decoder, StreamingContext *encoder, AVFrame *input_frame) {
-    if (input_frame) input_frame->pict_type = AV_PICTURE_TYPE_NONE;
+    if (input_frame) {
+        input_frame->pict_type = AV_PICTURE_TYPE_NONE;
+        // the encoder's rate control works in its own 1/framerate time base
+        if (input_frame->pts != AV_NOPTS_VALUE) input_frame->pts = av_rescale_q(input_frame->pts, decoder->video_avs->time_base, encoder->video_avcc->time_base);
+        input_frame->duration = av_rescale_q(input_frame->duration, decoder->video_avs->time_base, encoder->video_avcc->time_base);
+    }
 
-    AVPacket *output_packet = av_packet_alloc();
+    AVPacket *output_packet = media_pool_get_packet();
     if (!output_packet) {logging("could not allocate memory for output packet"); return -1;}
 
     int response = avcodec_send_frame(encoder->video_avcc, input_frame);
@@ -163,20 +624,18 @@ int encode_video(StreamingContext *decoder, StreamingContext *encoder, AVFrame *
             return -1;
         }
 
-        output_packet->stream_index = decoder->video_index;
-        output_packet->duration = encoder->video_avs->time_base.den / encoder->video_avs->time_base.num / decoder->video_avs->avg_frame_rate.num * decoder->video_avs->avg_frame_rate.den;
+        output_packet->stream_index = encoder->video_avs->index;
 
-        av_packet_rescale_ts(output_packet, decoder->video_avs->time_base, encoder->video_avs->time_base);
+        av_packet_rescale_ts(output_packet, encoder->video_avcc->time_base, encoder->video_avs->time_base);
         response = av_interleaved_write_frame(encoder->avfc, output_packet);
         if (response != 0) { logging("Error %d while receiving packet from decoder: %s", response, av_err2str(response)); return -1;}
     }
-    av_packet_unref(output_packet);
-    av_packet_free(&output_packet);
+    media_pool_put_packet(&output_packet);
     return 0;
 }
 
 int encode_audio(StreamingContext *decoder, StreamingContext *encoder, AVFrame *input_frame) {
-    AVPacket *output_packet = av_packet_alloc();
+    AVPacket *output_packet = media_pool_get_packet();
     if (!output_packet) {logging("could not allocate memory for output packet"); return -1;}
 
     int response = avcodec_send_frame(encoder->audio_avcc, input_frame);
@@ -190,14 +649,13 @@ int encode_audio(StreamingContext *decoder, StreamingContext *encoder, AVFrame *
             return -1;
         }
 
-        output_packet->stream_index = decoder->audio_index;
+        output_packet->stream_index = encoder->audio_avs->index;
 
         av_packet_rescale_ts(output_packet, decoder->audio_avs->time_base, encoder->audio_avs->time_base);
         response = av_interleaved_write_frame(encoder->avfc, output_packet);
         if (response != 0) { logging("Error %d while receiving packet from decoder: %s", response, av_err2str(response)); return -1;}
     }
-    av_packet_unref(output_packet);
-    av_packet_free(&output_packet);
+    media_pool_put_packet(&output_packet);
     return 0;
 }
 
@@ -243,125 +701,193 @@ int transcode_video(StreamingContext *decoder, StreamingContext *encoder, AVPack
     return 0;
 }
 
-int main(int argc, char *argv[])
-{
-    /*
-   * H264 -> H265
-   * Audio -> remuxed (untouched)
-   * MP4 - MP4
-   */
-//    StreamingParams sp = {0};
-//    sp.copy_audio = 1;
-//    sp.copy_video = 0;
-//    sp.video_codec = "libx265";
-//    sp.codec_priv_key = "x265-params";
-//    sp.codec_priv_value = "keyint=60:min-keyint=60:scenecut=0";
-
-    /*
-   * H264 -> H264 (fixed gop)
-   * Audio -> remuxed (untouched)
-   * MP4 - MP4
-   */
-    //StreamingParams sp = {0};
-    //sp.copy_audio = 1;
-    //sp.copy_video = 0;
-    //sp.video_codec = "libx264";
-    //sp.codec_priv_key = "x264-params";
-    //sp.codec_priv_value = "keyint=60:min-keyint=60:scenecut=0:force-cfr=1";
-
-    /*
-   * H264 -> H264 (fixed gop)
-   * Audio -> remuxed (untouched)
-   * MP4 - fragmented MP4
-   */
-    //StreamingParams sp = {0};
-    //sp.copy_audio = 1;
-    //sp.copy_video = 0;
-    //sp.video_codec = "libx264";
-    //sp.codec_priv_key = "x264-params";
-    //sp.codec_priv_value = "keyint=60:min-keyint=60:scenecut=0:force-cfr=1";
-    //sp.muxer_opt_key = "movflags";
-    //sp.muxer_opt_value = "frag_keyframe+empty_moov+delay_moov+default_base_moof";
+static void usage(const char *name) {
+    fprintf(stderr,
+            "Usage: %s [-c <job file>] [-v <encoder|copy|none>] [-a <encoder|copy|none>]\n"
+            "          [-V <options>] [-A <options>] [-m <options>] [-f <format>] [-t <threads>]\n"
+            "          [-s] [-o <key>=<value>] [-j <decision file>]\n"
+            "          [<input file> <output file>]\n"
+            "  -c <file>     read the job from a file with one 'key value' per line, keys are\n"
+            "                input, output, format, video, audio, video_options, audio_options,\n"
+            "                muxer_options, threads, smart_copy, decision_file and the targets\n"
+            "                below; later options override earlier ones\n"
+            "  -v <encoder>  video encoder, e.g. libvpx-vp9 or libx265, 'copy' remuxes (default)\n"
+            "  -a <encoder>  audio encoder, e.g. libvorbis or aac, 'copy' remuxes (default)\n"
+            "  -V <options>  video encoder options, e.g. x265-params='keyint=60:scenecut=0'\n"
+            "  -A <options>  audio encoder options, e.g. b=128k\n"
+            "  -m <options>  muxer options, e.g. movflags=frag_keyframe+empty_moov\n"
+            "  -f <format>   output format, guessed from the output file name by default\n"
+            "  -t <threads>  threads per decoder and encoder, 0 = picked by the codec\n"
+            "  -s            smart copy: copy a stream that already fits the target instead\n"
+            "                of transcoding it; targets are video_/audio_ + max_size, pix_fmt,\n"
+            "                profile, max_bit_rate and max_gop (frames), e.g.\n"
+            "                -o video_profile=High -o video_max_bit_rate=4M -o video_max_gop=60\n"
+            "  -o <k>=<v>    any job file key\n"
+            "  -j <file>     append the chosen path of every stream to this file\n"
+            "Without input and output small_bunny_1080p_60fps.mp4 is remuxed to argv.mp4.\n",
+            name);
+}
 
-    /*
-   * H264 -> H264 (fixed gop)
-   * Audio -> AAC
-   * MP4 - MPEG-TS
-   */
-    //StreamingParams sp = {0};
-    //sp.copy_audio = 0;
-    //sp.copy_video = 0;
-    //sp.video_codec = "libx264";
-    //sp.codec_priv_key = "x264-params";
-    //sp.codec_priv_value = "keyint=60:min-keyint=60:scenecut=0:force-cfr=1";
-    //sp.audio_codec = "aac";
-    //sp.output_extension = ".ts";
+/* options are applied in order, so -c loads a base job that later flags adjust */
+static int parse_command_line(StreamingParams *sp, int argc, char *argv[]) {
+    static const struct { char opt; const char *key; } keys[] = {
+        {'v', "video"}, {'a', "audio"}, {'V', "video_options"}, {'A', "audio_options"},
+        {'m', "muxer_options"}, {'f', "format"}, {'t', "threads"}, {'j', "decision_file"},
+    };
+    int opt;
+
+    while ((opt = getopt(argc, argv, "c:v:a:V:A:m:f:t:so:j:")) != -1) {
+        int i, n = sizeof(keys) / sizeof(keys[0]);
+        if (opt == 'c') {
+            if (parse_spec_file(sp, optarg)) return -1;
+            continue;
+        }
+        if (opt == 's') {
+            sp->smart_copy = 1;
+            continue;
+        }
+        if (opt == 'o') {
+            char *value = strchr(optarg, '=');
+            if (!value) return -1;
+            *value++ = '\0';
+            if (parse_spec_option(sp, optarg, value)) return -1;
+            continue;
+        }
+        for (i = 0; i < n && keys[i].opt != opt; i++)
+            ;
+        if (i == n) return -1;
+        if (parse_spec_option(sp, keys[i].key, optarg)) return -1;
+    }
+    if (argc - optind == 2) {
+        if (set_string(&sp->input, argv[optind]) || set_string(&sp->output, argv[optind + 1])) return -1;
+    } else if (argc != optind) {
+        return -1;
+    }
+    if (!sp->input && set_string(&sp->input, "small_bunny_1080p_60fps.mp4")) return -1;
+    if (!sp->output && set_string(&sp->output, "argv.mp4")) return -1;
+    return 0;
+}
 
+int main(int argc, char *argv[])
+{
     /*
-   * H264 -> VP9
-   * Audio -> Vorbis
-   * MP4 - WebM
-   */
-      StreamingParams sp = {0};
-//      sp.copy_audio = 0;
-//      sp.copy_video = 0;
-      sp.video_codec = "libvpx-vp9";
-      sp.audio_codec = "vorbis"; //https://trac.ffmpeg.org/ticket/10571
-      sp.output_extension = ".webm";
+     * Examples, as command lines or job files with the same keys:
+     *   H264 -> H265, audio remuxed, MP4 -> MP4
+     *     -v libx265 -V x265-params='keyint=60:min-keyint=60:scenecut=0' in.mp4 out.mp4
+     *   H264 -> H264 (fixed gop), audio remuxed, MP4 -> fragmented MP4
+     *     -v libx264 -V x264-params='keyint=60:min-keyint=60:scenecut=0:force-cfr=1'
+     *     -m movflags=frag_keyframe+empty_moov+delay_moov+default_base_moof in.mp4 out.mp4
+     *   H264 -> H264 (fixed gop), audio -> AAC, MP4 -> MPEG-TS
+     *     -v libx264 -V x264-params='keyint=60:min-keyint=60:scenecut=0:force-cfr=1' -a aac in.mp4 out.ts
+     *   H264 -> VP9, audio -> Vorbis, MP4 -> WebM
+     *     -v libvpx-vp9 -a vorbis in.mp4 out.webm   (https://trac.ffmpeg.org/ticket/10571)
+     */
+    StreamingParams sp = {0};
+    if (parse_command_line(&sp, argc, argv)) {
+        usage(argv[0]);
+        free_spec(&sp);
+        return 1;
+    }
 
     StreamingContext *decoder = (StreamingContext*) calloc(1, sizeof(StreamingContext));
-    decoder->filename = "small_bunny_1080p_60fps.mp4";
+    decoder->filename = sp.input;
 
     StreamingContext *encoder = (StreamingContext*) calloc(1, sizeof(StreamingContext));
-    encoder->filename = "argv.mp4";
+    encoder->filename = sp.output;
 
-//    if (sp.output_extension)
-//        strcat(encoder->filename, sp.output_extension);
+    // logging() hands its messages to a background thread from here on, flushed at exit
+    if (async_log_start() < 0) {logging("failed to start the logger"); return -1;}
+    log_simd_report();
 
     if (open_media(decoder->filename, &decoder->avfc)) return -1;
-    if (prepare_decoder(decoder)) return -1;
+    select_streams(decoder, &sp);
 
-    avformat_alloc_output_context2(&encoder->avfc, NULL, NULL, encoder->filename);
+    avformat_alloc_output_context2(&encoder->avfc, NULL, sp.format, encoder->filename);
     if (!encoder->avfc) {logging("could not allocate memory for output format");return -1;}
-    if (prepare_copy(encoder->avfc, &encoder->video_avs, decoder->video_avs->codecpar)) {return -1;}
 
-    if (encoder->avfc->oformat->flags & AVFMT_GLOBALHEADER)
-        encoder->avfc->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
+    // decide before any decoder is opened, a copied stream is never decoded
+    ProbeBuffer probe_buf = {0};
+    InputProbe probe = {0};
+    StreamDecision video_decision = {0}, audio_decision = {0};
+    if (probe_input(decoder, &sp, &probe_buf, &probe)) return -1;
+    decide_stream(decoder->video_avs, &sp.video_action, sp.video_codec, &sp.video_target, sp.smart_copy,
+                  probe.video_bit_rate, probe.video_gop, encoder->avfc->oformat, &video_decision);
+    decide_stream(decoder->audio_avs, &sp.audio_action, sp.audio_codec, &sp.audio_target, sp.smart_copy,
+                  probe.audio_bit_rate, 0, encoder->avfc->oformat, &audio_decision);
+    log_decision("video", sp.video_action, sp.video_codec, &video_decision);
+    log_decision("audio", sp.audio_action, sp.audio_codec, &audio_decision);
+    if (sp.decision_file) record_decision(&sp, &video_decision, &audio_decision);
+
+    if (prepare_decoder(decoder, &sp)) return -1;
+
+    // encoders are opened once, before the header, in the order of the output streams
+    if (sp.video_action == STREAM_ACTION_COPY) {
+        if (prepare_copy(encoder->avfc, &encoder->video_avs, decoder->video_avs, video_decision.bsf, &encoder->video_bsf)) {return -1;}
+    } else if (sp.video_action == STREAM_ACTION_TRANSCODE) {
+        AVRational input_framerate = av_guess_frame_rate(decoder->avfc, decoder->video_avs, NULL);
+        if (prepare_video_encoder(encoder, decoder->video_avcc, input_framerate, &sp)) {return -1;}
+    }
+    if (sp.audio_action == STREAM_ACTION_COPY) {
+        if (prepare_copy(encoder->avfc, &encoder->audio_avs, decoder->audio_avs, audio_decision.bsf, &encoder->audio_bsf)) {return -1;}
+    } else if (sp.audio_action == STREAM_ACTION_TRANSCODE) {
+        if (prepare_audio_encoder(encoder, decoder->audio_avcc, &sp)) {return -1;}
+    }
+    if (!encoder->avfc->nb_streams) {logging("nothing to write, both streams are dropped"); return -1;}
 
     if (!(encoder->avfc->oformat->flags & AVFMT_NOFILE)) {
-        if (avio_open(&encoder->avfc->pb, encoder->filename, AVIO_FLAG_WRITE) < 0) {
+        if (async_writer_open(&encoder->avfc->pb, encoder->filename, ASYNC_WRITER_SYNC_CLOSE) < 0) {
             logging("could not open the output file");
             return -1;
         }
     }
 
     AVDictionary* muxer_opts = NULL;
-
-    if (sp.muxer_opt_key && sp.muxer_opt_value) {
-        av_dict_set(&muxer_opts, sp.muxer_opt_key, sp.muxer_opt_value, 0);
-    }
+    av_dict_copy(&muxer_opts, sp.muxer_opts, 0);
 
     if (avformat_write_header(encoder->avfc, &muxer_opts) < 0) {logging("an error occurred when opening output file"); return -1;}
 
+    // encode_video/encode_audio take their output packets from here instead of allocating one per frame
+    if (media_pool_init(16, 16) < 0) {logging("failed to allocate the packet pool"); return -1;}
+
     AVFrame *input_frame = av_frame_alloc();
     if (!input_frame) {logging("failed to allocated memory for AVFrame"); return -1;}
 
     AVPacket *input_packet = av_packet_alloc();
     if (!input_packet) {logging("failed to allocated memory for AVPacket"); return -1;}
 
-    while (av_read_frame(decoder->avfc, input_packet) >= 0)
+    while (next_packet(decoder, &probe_buf, input_packet) >= 0)
     {
-        if (decoder->avfc->streams[input_packet->stream_index]->codecpar->codec_type == AVMEDIA_TYPE_VIDEO) {
-            if (remux(&input_packet, &encoder->avfc, decoder->video_avs->time_base, encoder->video_avs->time_base)) return -1;
-        } else if (decoder->avfc->streams[input_packet->stream_index]->codecpar->codec_type == AVMEDIA_TYPE_AUDIO)  {
-        } else {
-            logging("ignoring all non video or audio packets");
+        if (input_packet->stream_index == decoder->video_index) {
+            if (sp.video_action == STREAM_ACTION_COPY) {
+                if (remux(&input_packet, &encoder->avfc, decoder->video_avs->time_base, encoder->video_avs, encoder->video_bsf)) return -1;
+            } else if (sp.video_action == STREAM_ACTION_TRANSCODE) {
+                if (transcode_video(decoder, encoder, input_packet, input_frame)) return -1;
+            }
+        } else if (input_packet->stream_index == decoder->audio_index) {
+            if (sp.audio_action == STREAM_ACTION_COPY) {
+                if (remux(&input_packet, &encoder->avfc, decoder->audio_avs->time_base, encoder->audio_avs, encoder->audio_bsf)) return -1;
+            } else if (sp.audio_action == STREAM_ACTION_TRANSCODE) {
+                if (transcode_audio(decoder, encoder, input_packet, input_frame)) return -1;
+            }
         }
+        av_packet_unref(input_packet);
+    }
+    free_probe_buffer(&probe_buf);
+    // drain the bitstream filters, the decoders into the encoders, then the encoders themselves
+    AVPacket *flush_packet = NULL;
+    if (encoder->video_bsf && remux(&flush_packet, &encoder->avfc, decoder->video_avs->time_base, encoder->video_avs, encoder->video_bsf)) return -1;
+    if (encoder->audio_bsf && remux(&flush_packet, &encoder->avfc, decoder->audio_avs->time_base, encoder->audio_avs, encoder->audio_bsf)) return -1;
+    if (sp.video_action == STREAM_ACTION_TRANSCODE) {
+        if (transcode_video(decoder, encoder, NULL, input_frame)) return -1;
+        if (encode_video(decoder, encoder, NULL)) return -1;
+    }
+    if (sp.audio_action == STREAM_ACTION_TRANSCODE) {
+        if (transcode_audio(decoder, encoder, NULL, input_frame)) return -1;
+        if (encode_audio(decoder, encoder, NULL)) return -1;
     }
-    // TODO: should I also flush the audio encoder?
-    if (encode_video(decoder, encoder, NULL)) return -1;
 
     av_write_trailer(encoder->avfc);
+    if (async_writer_close(&encoder->avfc->pb) < 0) {logging("error while writing the output file"); return -1;}
 
     if (muxer_opts != NULL) {
         av_dict_free(&muxer_opts);
@@ -384,9 +910,16 @@ int main(int argc, char *argv[])
     avformat_free_context(encoder->avfc); encoder->avfc = NULL;
 
     avcodec_free_context(&decoder->video_avcc); decoder->video_avcc = NULL;
+    avcodec_free_context(&decoder->audio_avcc); decoder->audio_avcc = NULL;
+    avcodec_free_context(&encoder->video_avcc); encoder->video_avcc = NULL;
+    avcodec_free_context(&encoder->audio_avcc); encoder->audio_avcc = NULL;
+    av_bsf_free(&encoder->video_bsf);
+    av_bsf_free(&encoder->audio_bsf);
+
+    media_pool_uninit();
 
     free(decoder); decoder = NULL;
     free(encoder); encoder = NULL;
+    free_spec(&sp);
     return 0;
 }
-
@@ -0,0 +1,194 @@
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <libavutil/avutil.h>
+#include <libavutil/time.h>
+#include "async_log.h"
+
+/* power of two, so a position maps to its slot with a mask */
+#define LOG_RING_SIZE 1024
+#define LOG_LINE_SIZE ASYNC_LOG_LINE_SIZE
+/* how long the drain thread sleeps when the ring is empty */
+#define LOG_DRAIN_IDLE_US 10000
+
+/*
+ * Bounded multi-producer ring (Vyukov). A slot is free for the producer
+ * at position pos when seq == pos and holds a message for the consumer
+ * when seq == pos + 1.
+ */
+typedef struct LogSlot {
+    atomic_size_t seq;
+    int level;
+    char line[LOG_LINE_SIZE];
+} LogSlot;
+
+static LogSlot ring[LOG_RING_SIZE];
+static atomic_size_t enqueue_pos;
+static size_t dequeue_pos; /* only used by the drain thread */
+static atomic_int_least64_t nb_dropped;
+
+static atomic_int running;
+static atomic_int stop_requested;
+static pthread_t drain_tid;
+static pthread_once_t atexit_once = PTHREAD_ONCE_INIT;
+
+static LogSlot *ring_claim(void)
+{
+    size_t pos = atomic_load_explicit(&enqueue_pos, memory_order_relaxed);
+
+    while (1) {
+        LogSlot *slot = &ring[pos & (LOG_RING_SIZE - 1)];
+        size_t seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+        intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+
+        if (diff == 0) {
+            if (atomic_compare_exchange_weak_explicit(&enqueue_pos, &pos, pos + 1,
+                                                      memory_order_relaxed,
+                                                      memory_order_relaxed))
+                return slot;
+        } else if (diff < 0) {
+            return NULL; /* full */
+        } else {
+            pos = atomic_load_explicit(&enqueue_pos, memory_order_relaxed);
+        }
+    }
+}
+
+static void ring_publish(LogSlot *slot)
+{
+    size_t seq = atomic_load_explicit(&slot->seq, memory_order_relaxed);
+    atomic_store_explicit(&slot->seq, seq + 1, memory_order_release);
+}
+
+/* returns 0 when the ring is empty */
+static int ring_drain_one(void)
+{
+    LogSlot *slot = &ring[dequeue_pos & (LOG_RING_SIZE - 1)];
+    size_t seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+
+    if (seq != dequeue_pos + 1)
+        return 0;
+    av_log(NULL, slot->level, "%s", slot->line);
+    atomic_store_explicit(&slot->seq, dequeue_pos + LOG_RING_SIZE, memory_order_release);
+    dequeue_pos++;
+    return 1;
+}
+
+static void report_dropped(void)
+{
+    int64_t dropped = atomic_exchange(&nb_dropped, 0);
+
+    if (dropped)
+        av_log(NULL, AV_LOG_WARNING, "Log ring full, %"PRId64" messages dropped\n", dropped);
+}
+
+static void *drain_thread(void *arg)
+{
+    (void)arg;
+    while (!atomic_load(&stop_requested)) {
+        if (!ring_drain_one()) {
+            report_dropped();
+            usleep(LOG_DRAIN_IDLE_US);
+        }
+    }
+    while (ring_drain_one())
+        ;
+    report_dropped();
+    return NULL;
+}
+
+static void stop_at_exit(void)
+{
+    atexit(async_log_stop);
+}
+
+int async_log_start(void)
+{
+    int ret;
+
+    if (atomic_load(&running))
+        return 0;
+    for (size_t i = 0; i < LOG_RING_SIZE; i++)
+        atomic_init(&ring[i].seq, i);
+    atomic_init(&enqueue_pos, 0);
+    dequeue_pos = 0;
+    atomic_store(&stop_requested, 0);
+
+    if ((ret = pthread_create(&drain_tid, NULL, drain_thread, NULL)))
+        return AVERROR(ret);
+    atomic_store(&running, 1);
+    pthread_once(&atexit_once, stop_at_exit);
+    return 0;
+}
+
+void async_log_stop(void)
+{
+    if (!atomic_exchange(&running, 0))
+        return;
+    atomic_store(&stop_requested, 1);
+    pthread_join(drain_tid, NULL);
+}
+
+static void async_vlog(int level, const char *fmt, va_list vl)
+{
+    LogSlot *slot;
+
+    /* skip the formatting for messages av_log would not print anyway */
+    if (level > av_log_get_level())
+        return;
+    if (!atomic_load_explicit(&running, memory_order_relaxed)) {
+        av_vlog(NULL, level, fmt, vl);
+        return;
+    }
+
+    slot = ring_claim();
+    if (!slot) {
+        atomic_fetch_add_explicit(&nb_dropped, 1, memory_order_relaxed);
+        return;
+    }
+    slot->level = level;
+    vsnprintf(slot->line, sizeof(slot->line), fmt, vl);
+    ring_publish(slot);
+}
+
+void async_log(int level, const char *fmt, ...)
+{
+    va_list vl;
+
+    va_start(vl, fmt);
+    async_vlog(level, fmt, vl);
+    va_end(vl);
+}
+
+void async_log_ratelimited(atomic_int_least64_t *next_allowed, atomic_int *suppressed,
+                           int level, int interval_ms, const char *fmt, ...)
+{
+    int64_t now = av_gettime_relative();
+    int64_t next = atomic_load_explicit(next_allowed, memory_order_relaxed);
+    char line[LOG_LINE_SIZE];
+    size_t len;
+    va_list vl;
+    int nb_suppressed;
+
+    if (now < next ||
+        !atomic_compare_exchange_strong(next_allowed, &next, now + interval_ms * INT64_C(1000))) {
+        atomic_fetch_add_explicit(suppressed, 1, memory_order_relaxed);
+        return;
+    }
+    nb_suppressed = atomic_exchange(suppressed, 0);
+
+    va_start(vl, fmt);
+    vsnprintf(line, sizeof(line), fmt, vl);
+    va_end(vl);
+    if (!nb_suppressed) {
+        async_log(level, "%s", line);
+        return;
+    }
+    len = strlen(line);
+    if (len && line[len - 1] == '\n')
+        line[--len] = '\0';
+    async_log(level, "%s (%d similar messages suppressed)\n", line, nb_suppressed);
+}
@@ -0,0 +1,53 @@
+#ifndef ASYNC_LOG_H
+#define ASYNC_LOG_H
+
+#include <stdatomic.h>
+#include <stdint.h>
+#include <libavutil/log.h>
+
+/*
+ * Logging for the per-frame paths. Messages are formatted by the caller
+ * into a lock-free ring and handed to av_log() by a background thread, so
+ * a frame never waits for stderr or for the av_log lock. When the ring is
+ * full messages are dropped and counted instead of blocking.
+ *
+ * ALOG() calls above ASYNC_LOG_MAX_LEVEL are compiled out, build with
+ * e.g. -DASYNC_LOG_MAX_LEVEL=AV_LOG_TRACE to get the per-frame traces.
+ * ALOG_RATELIMIT() lets one message through per interval_ms for its call
+ * site and reports how many were suppressed in between.
+ *
+ * Before async_log_start() (or after async_log_stop()) messages go to
+ * av_log() directly.
+ */
+/* longest message the ring holds, with its newline and terminator */
+#define ASYNC_LOG_LINE_SIZE 256
+
+#ifndef ASYNC_LOG_MAX_LEVEL
+#define ASYNC_LOG_MAX_LEVEL AV_LOG_VERBOSE
+#endif
+
+#define ALOG(level, ...) do {                                             \
+    if ((level) <= ASYNC_LOG_MAX_LEVEL)                                   \
+        async_log(level, __VA_ARGS__);                                    \
+} while (0)
+
+#define ALOG_RATELIMIT(level, interval_ms, ...) do {                      \
+    static atomic_int_least64_t alog_next_allowed;                        \
+    static atomic_int alog_suppressed;                                    \
+    if ((level) <= ASYNC_LOG_MAX_LEVEL)                                   \
+        async_log_ratelimited(&alog_next_allowed, &alog_suppressed,       \
+                              level, interval_ms, __VA_ARGS__);           \
+} while (0)
+
+/* start the drain thread, async_log_stop() also runs at exit */
+int async_log_start(void);
+/* write out what is still queued and stop the thread, call it once
+ * nothing else logs any more */
+void async_log_stop(void);
+
+void async_log(int level, const char *fmt, ...) av_printf_format(2, 3);
+void async_log_ratelimited(atomic_int_least64_t *next_allowed, atomic_int *suppressed,
+                           int level, int interval_ms, const char *fmt, ...)
+    av_printf_format(5, 6);
+
+#endif /* ASYNC_LOG_H */
@@ -0,0 +1,426 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#include <libavutil/avutil.h>
+#include <libavutil/time.h>
+#if HAVE_LIBURING
+#include <liburing.h>
+#endif
+#include "async_writer.h"
+#include "frame_queue.h"
+
+#define WRITER_BUFFER_SIZE (4 * 1024 * 1024)
+/* one buffer is filled while the other is written */
+#define WRITER_NB_BUFFERS 2
+#define WRITER_ALIGN 4096
+#define IO_BUFFER_SIZE (64 * 1024)
+
+typedef struct WriterBuffer {
+    uint8_t *data;
+    size_t len;
+    int64_t offset;
+    int index;
+} WriterBuffer;
+
+typedef struct AsyncWriter {
+    int fd;
+    enum AsyncWriterSync sync;
+    WriterBuffer buffers[WRITER_NB_BUFFERS];
+
+    /* muxer thread */
+    WriterBuffer *cur;
+    int64_t pos;
+    int64_t size;
+    int64_t nb_stalls;
+    int64_t stall_us;
+
+    FrameQueue full_q; /* WriterBuffer*, to the writer thread */
+    FrameQueue free_q; /* WriterBuffer*, back to the muxer */
+    pthread_t thread;
+    int started;
+    atomic_int error;
+
+#if HAVE_LIBURING
+    struct io_uring ring;
+    int has_ring;
+    int fixed_buffers; /* buffers registered with the ring */
+#endif
+} AsyncWriter;
+
+int async_writer_parse_sync(const char *name)
+{
+    if (!strcmp(name, "none"))
+        return ASYNC_WRITER_SYNC_NONE;
+    if (!strcmp(name, "close"))
+        return ASYNC_WRITER_SYNC_CLOSE;
+    if (!strcmp(name, "buffer"))
+        return ASYNC_WRITER_SYNC_BUFFER;
+    return AVERROR(EINVAL);
+}
+
+static int write_full(int fd, const uint8_t *data, size_t len, int64_t offset)
+{
+    while (len) {
+        ssize_t n = pwrite(fd, data, len, offset);
+
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return AVERROR(errno);
+        }
+        data += n;
+        len -= n;
+        offset += n;
+    }
+    return 0;
+}
+
+#if HAVE_LIBURING
+/* The writes are linked so the ring runs them in order, overlapping header
+ * rewrites must not overtake each other. A short write breaks the chain and
+ * cancels the rest, which is then finished with pwrite(). */
+static int write_batch_uring(AsyncWriter *w, WriterBuffer **batch, int nb)
+{
+    int res[WRITER_NB_BUFFERS];
+    struct io_uring_cqe *cqe;
+    int ret;
+
+    for (int i = 0; i < nb; i++) {
+        struct io_uring_sqe *sqe = io_uring_get_sqe(&w->ring);
+
+        if (w->fixed_buffers)
+            io_uring_prep_write_fixed(sqe, w->fd, batch[i]->data, batch[i]->len,
+                                      batch[i]->offset, batch[i]->index);
+        else
+            io_uring_prep_write(sqe, w->fd, batch[i]->data, batch[i]->len, batch[i]->offset);
+        if (i < nb - 1)
+            sqe->flags |= IOSQE_IO_LINK;
+        io_uring_sqe_set_data(sqe, (void *)(intptr_t)i);
+    }
+    if ((ret = io_uring_submit(&w->ring)) < 0)
+        return AVERROR(-ret);
+
+    for (int i = 0; i < nb; i++) {
+        if ((ret = io_uring_wait_cqe(&w->ring, &cqe)) < 0)
+            return AVERROR(-ret);
+        res[(intptr_t)io_uring_cqe_get_data(cqe)] = cqe->res;
+        io_uring_cqe_seen(&w->ring, cqe);
+    }
+
+    for (int i = 0; i < nb; i++) {
+        size_t done = res[i] > 0 ? res[i] : 0;
+
+        if (res[i] < 0 && res[i] != -ECANCELED && res[i] != -EINTR && res[i] != -EAGAIN)
+            return AVERROR(-res[i]);
+        if (done < batch[i]->len &&
+            (ret = write_full(w->fd, batch[i]->data + done, batch[i]->len - done,
+                              batch[i]->offset + done)) < 0)
+            return ret;
+    }
+    return 0;
+}
+#endif
+
+static int write_batch(AsyncWriter *w, WriterBuffer **batch, int nb)
+{
+    int ret = 0;
+
+#if HAVE_LIBURING
+    if (w->has_ring)
+        ret = write_batch_uring(w, batch, nb);
+    else
+#endif
+    for (int i = 0; i < nb && ret >= 0; i++)
+        ret = write_full(w->fd, batch[i]->data, batch[i]->len, batch[i]->offset);
+
+    if (ret >= 0 && w->sync == ASYNC_WRITER_SYNC_BUFFER && fdatasync(w->fd) < 0)
+        ret = AVERROR(errno);
+    return ret;
+}
+
+static void *writer_thread(void *arg)
+{
+    AsyncWriter *w = arg;
+    WriterBuffer *batch[WRITER_NB_BUFFERS];
+    void *item;
+    int nb, ret;
+
+    while (frame_queue_pop(&w->full_q, &item) >= 0) {
+        /* take whatever else is queued, it goes out in one submission */
+        nb = 0;
+        batch[nb++] = item;
+        while (nb < WRITER_NB_BUFFERS && frame_queue_size(&w->full_q) > 0 &&
+               frame_queue_pop(&w->full_q, &item) >= 0)
+            batch[nb++] = item;
+
+        /* after an error keep recycling buffers so the muxer never hangs,
+         * it fails on its next write */
+        if (!atomic_load(&w->error) && (ret = write_batch(w, batch, nb)) < 0) {
+            av_log(NULL, AV_LOG_ERROR, "Output write failed: %s\n", av_err2str(ret));
+            atomic_store(&w->error, ret);
+        }
+        for (int i = 0; i < nb; i++) {
+            batch[i]->len = 0;
+            frame_queue_push(&w->free_q, batch[i]);
+        }
+    }
+    return NULL;
+}
+
+/* hand the current buffer to the writer thread */
+static int submit_buffer(AsyncWriter *w)
+{
+    int ret;
+
+    if (!w->cur || !w->cur->len)
+        return 0;
+    if ((ret = frame_queue_push(&w->full_q, w->cur)) < 0)
+        return ret;
+    w->cur = NULL;
+    return 0;
+}
+
+static int next_buffer(AsyncWriter *w)
+{
+    void *item;
+    int64_t start;
+    int ret;
+
+    if (frame_queue_size(&w->free_q) == 0) {
+        /* the disk fell behind by more than the buffers hold */
+        start = av_gettime_relative();
+        ret = frame_queue_pop(&w->free_q, &item);
+        w->nb_stalls++;
+        w->stall_us += av_gettime_relative() - start;
+    } else {
+        ret = frame_queue_pop(&w->free_q, &item);
+    }
+    if (ret < 0)
+        return ret;
+    w->cur = item;
+    w->cur->offset = w->pos;
+    w->cur->len = 0;
+    return 0;
+}
+
+static int io_write(void *opaque, const uint8_t *buf, int buf_size)
+{
+    AsyncWriter *w = opaque;
+    int left = buf_size, ret;
+
+    if ((ret = atomic_load(&w->error)) < 0)
+        return ret;
+
+    while (left > 0) {
+        int n;
+
+        if (!w->cur && (ret = next_buffer(w)) < 0)
+            return ret;
+        n = FFMIN(left, WRITER_BUFFER_SIZE - (int)w->cur->len);
+        memcpy(w->cur->data + w->cur->len, buf, n);
+        w->cur->len += n;
+        w->pos += n;
+        buf += n;
+        left -= n;
+        if (w->cur->len == WRITER_BUFFER_SIZE && (ret = submit_buffer(w)) < 0)
+            return ret;
+    }
+    w->size = FFMAX(w->size, w->pos);
+    return buf_size;
+}
+
+static int64_t io_seek(void *opaque, int64_t offset, int whence)
+{
+    AsyncWriter *w = opaque;
+    int ret;
+
+    switch (whence & ~AVSEEK_FORCE) {
+    case AVSEEK_SIZE:
+        return w->size;
+    case SEEK_SET:
+        break;
+    case SEEK_CUR:
+        offset += w->pos;
+        break;
+    case SEEK_END:
+        offset += w->size;
+        break;
+    default:
+        return AVERROR(EINVAL);
+    }
+    if (offset < 0)
+        return AVERROR(EINVAL);
+
+    if (offset != w->pos) {
+        /* a buffer is one contiguous range of the file */
+        if ((ret = submit_buffer(w)) < 0)
+            return ret;
+        if (w->cur)
+            w->cur->offset = offset;
+        w->pos = offset;
+    }
+    return offset;
+}
+
+static void writer_free(AsyncWriter **pw)
+{
+    AsyncWriter *w = *pw;
+
+    if (!w)
+        return;
+#if HAVE_LIBURING
+    if (w->has_ring)
+        io_uring_queue_exit(&w->ring);
+#endif
+    frame_queue_destroy(&w->full_q, NULL);
+    frame_queue_destroy(&w->free_q, NULL);
+    for (int i = 0; i < WRITER_NB_BUFFERS; i++)
+        free(w->buffers[i].data);
+    if (w->fd >= 0)
+        close(w->fd);
+    av_freep(pw);
+}
+
+int async_writer_open(AVIOContext **ppb, const char *filename, enum AsyncWriterSync sync)
+{
+    AsyncWriter *w;
+    uint8_t *io_buffer = NULL;
+    int ret;
+
+    *ppb = NULL;
+    w = av_mallocz(sizeof(*w));
+    if (!w)
+        return AVERROR(ENOMEM);
+    w->sync = sync;
+    atomic_init(&w->error, 0);
+
+    w->fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+    if (w->fd < 0) {
+        ret = AVERROR(errno);
+        goto fail;
+    }
+
+    if ((ret = frame_queue_init(&w->full_q, WRITER_NB_BUFFERS)) < 0 ||
+        (ret = frame_queue_init(&w->free_q, WRITER_NB_BUFFERS)) < 0)
+        goto fail;
+    for (int i = 0; i < WRITER_NB_BUFFERS; i++) {
+        void *data;
+
+        if ((ret = posix_memalign(&data, WRITER_ALIGN, WRITER_BUFFER_SIZE))) {
+            ret = AVERROR(ret);
+            goto fail;
+        }
+        w->buffers[i].data = data;
+        w->buffers[i].index = i;
+        frame_queue_push(&w->free_q, &w->buffers[i]);
+    }
+
+#if HAVE_LIBURING
+    if (!io_uring_queue_init(WRITER_NB_BUFFERS, &w->ring, 0)) {
+        struct iovec iov[WRITER_NB_BUFFERS];
+
+        w->has_ring = 1;
+        for (int i = 0; i < WRITER_NB_BUFFERS; i++) {
+            iov[i].iov_base = w->buffers[i].data;
+            iov[i].iov_len = WRITER_BUFFER_SIZE;
+        }
+        /* pinned once instead of mapped on every write */
+        w->fixed_buffers = !io_uring_register_buffers(&w->ring, iov, WRITER_NB_BUFFERS);
+    } else {
+        av_log(NULL, AV_LOG_VERBOSE, "io_uring unavailable, writing %s with pwrite()\n",
+               filename);
+    }
+#endif
+
+    io_buffer = av_malloc(IO_BUFFER_SIZE);
+    if (!io_buffer) {
+        ret = AVERROR(ENOMEM);
+        goto fail;
+    }
+    *ppb = avio_alloc_context(io_buffer, IO_BUFFER_SIZE, 1, w, NULL, io_write, io_seek);
+    if (!*ppb) {
+        av_free(io_buffer);
+        ret = AVERROR(ENOMEM);
+        goto fail;
+    }
+
+    if ((ret = pthread_create(&w->thread, NULL, writer_thread, w))) {
+        ret = AVERROR(ret);
+        goto fail;
+    }
+    w->started = 1;
+    return 0;
+fail:
+    if (*ppb) {
+        av_freep(&(*ppb)->buffer);
+        avio_context_free(ppb);
+    }
+    writer_free(&w);
+    return ret;
+}
+
+int async_writer_is_async(const AVIOContext *pb)
+{
+    return pb->seek == io_seek;
+}
+
+int async_writer_drain(AVIOContext *pb)
+{
+    AsyncWriter *w = pb->opaque;
+    void *items[WRITER_NB_BUFFERS];
+    int nb, ret;
+
+    avio_flush(pb);
+    if ((ret = submit_buffer(w)) < 0)
+        return ret;
+    /* every buffer the muxer does not hold back on the free list means
+     * the writer thread is done with all of them */
+    nb = WRITER_NB_BUFFERS - !!w->cur;
+    for (int i = 0; i < nb; i++)
+        if ((ret = frame_queue_pop(&w->free_q, &items[i])) < 0)
+            return ret;
+    for (int i = 0; i < nb; i++)
+        frame_queue_push(&w->free_q, items[i]);
+    return atomic_load(&w->error);
+}
+
+int async_writer_close(AVIOContext **ppb)
+{
+    AVIOContext *pb = *ppb;
+    AsyncWriter *w;
+    int ret;
+
+    if (!pb)
+        return 0;
+    w = pb->opaque;
+
+    avio_flush(pb);
+    ret = submit_buffer(w);
+    frame_queue_finish(&w->full_q);
+    if (w->started)
+        pthread_join(w->thread, NULL);
+
+    if (ret >= 0)
+        ret = atomic_load(&w->error);
+    if (ret >= 0 && pb->error < 0)
+        ret = pb->error;
+    if (ret >= 0 && w->sync != ASYNC_WRITER_SYNC_NONE && fsync(w->fd) < 0)
+        ret = AVERROR(errno);
+    if (close(w->fd) < 0 && ret >= 0)
+        ret = AVERROR(errno);
+    w->fd = -1;
+
+    if (w->nb_stalls)
+        av_log(NULL, AV_LOG_WARNING, "Output: the muxer waited %"PRId64" times for the disk, "
+               "%"PRId64" ms in total\n", w->nb_stalls, w->stall_us / 1000);
+
+    writer_free(&w);
+    av_freep(&pb->buffer);
+    avio_context_free(ppb);
+    return ret;
+}
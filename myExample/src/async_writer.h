@@ -0,0 +1,39 @@
+#ifndef ASYNC_WRITER_H
+#define ASYNC_WRITER_H
+
+#include <libavformat/avio.h>
+
+/*
+ * Output AVIOContext that never blocks the muxing thread on the disk. Muxed
+ * bytes are gathered into large page-aligned buffers, full buffers are
+ * written by a dedicated thread (io_uring when built with HAVE_LIBURING,
+ * pwrite otherwise) while the muxer fills the next one. The muxer only
+ * waits when the disk is slower than the encoder for longer than the
+ * buffers last.
+ *
+ * Seeking is supported (the WebM muxer rewrites its header at the end),
+ * writes reach the file in the order they were made.
+ */
+enum AsyncWriterSync {
+    ASYNC_WRITER_SYNC_NONE,   /* leave it to the kernel */
+    ASYNC_WRITER_SYNC_CLOSE,  /* fsync() once when the file is closed */
+    ASYNC_WRITER_SYNC_BUFFER, /* fdatasync() after every buffer, and on close */
+};
+
+/* "none", "close" or "buffer", AVERROR(EINVAL) for anything else */
+int async_writer_parse_sync(const char *name);
+
+int async_writer_open(AVIOContext **ppb, const char *filename, enum AsyncWriterSync sync);
+
+/* whether pb was opened by async_writer_open() */
+int async_writer_is_async(const AVIOContext *pb);
+
+/* Flush and wait until everything written so far is in the file, for a
+ * muxer that reads its output back. Returns the first write error. */
+int async_writer_drain(AVIOContext *pb);
+
+/* Flush, wait for the writer thread, sync as configured and free *ppb.
+ * Returns the first error of any write, so check it before trusting the file. */
+int async_writer_close(AVIOContext **ppb);
+
+#endif /* ASYNC_WRITER_H */
@@ -0,0 +1,229 @@
+#include <errno.h>
+#include <inttypes.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <libavformat/avformat.h>
+#include <libavutil/avstring.h>
+#include <libavutil/avutil.h>
+#include <libavutil/mem.h>
+#include "checkpoint.h"
+
+/* fopen() a temporary file next to filename, see commit_file() */
+static FILE *open_tmp(const char *filename, char **tmp_filename)
+{
+    FILE *f;
+
+    *tmp_filename = av_asprintf("%s.tmp", filename);
+    if (!*tmp_filename)
+        return NULL;
+    f = fopen(*tmp_filename, "w");
+    if (!f)
+        av_freep(tmp_filename);
+    return f;
+}
+
+/* flush, sync and rename the temporary file over filename */
+static int commit_file(FILE *f, char **tmp_filename, const char *filename)
+{
+    int ret = 0;
+
+    if (fflush(f) || fsync(fileno(f)) < 0)
+        ret = AVERROR(errno);
+    if (fclose(f) && !ret)
+        ret = AVERROR(errno);
+    if (!ret && rename(*tmp_filename, filename) < 0)
+        ret = AVERROR(errno);
+    if (ret < 0)
+        unlink(*tmp_filename);
+    av_freep(tmp_filename);
+    return ret;
+}
+
+int checkpoint_add_segment(Checkpoint *ckpt, const char *filename,
+                           double start_time, double end_time)
+{
+    CheckpointSegment *seg;
+
+    /* not av_reallocp_array(), a failed append leaves the checkpoint as it was */
+    seg = av_realloc_array(ckpt->segments, ckpt->nb_segments + 1, sizeof(*ckpt->segments));
+    if (!seg)
+        return AVERROR(ENOMEM);
+    ckpt->segments = seg;
+    seg = &ckpt->segments[ckpt->nb_segments];
+    seg->filename = av_strdup(filename);
+    if (!seg->filename)
+        return AVERROR(ENOMEM);
+    seg->start_time = start_time;
+    seg->end_time = end_time;
+    ckpt->nb_segments++;
+    return 0;
+}
+
+void checkpoint_free(Checkpoint *ckpt)
+{
+    for (int i = 0; i < ckpt->nb_segments; i++)
+        av_freep(&ckpt->segments[i].filename);
+    av_freep(&ckpt->segments);
+    av_freep(&ckpt->config);
+    ckpt->nb_segments = 0;
+}
+
+/* strip the line end fgets() kept */
+static void chomp(char *line)
+{
+    line[strcspn(line, "\r\n")] = '\0';
+}
+
+int checkpoint_read(const char *filename, Checkpoint *ckpt)
+{
+    char line[4096];
+    int version = 0;
+    int ret = 0;
+    FILE *f;
+
+    memset(ckpt, 0, sizeof(*ckpt));
+    f = fopen(filename, "r");
+    if (!f)
+        return AVERROR(errno);
+
+    if (!fgets(line, sizeof(line), f) ||
+        sscanf(line, "transcode-checkpoint %d", &version) != 1 || version != CHECKPOINT_VERSION) {
+        av_log(NULL, AV_LOG_ERROR, "%s is not a version %d checkpoint\n", filename, CHECKPOINT_VERSION);
+        ret = AVERROR_INVALIDDATA;
+    }
+    while (ret >= 0 && fgets(line, sizeof(line), f)) {
+        const char *value;
+        double start, end;
+        int name_pos;
+
+        chomp(line);
+        if (av_strstart(line, "config ", &value)) {
+            av_freep(&ckpt->config);
+            if (!(ckpt->config = av_strdup(value)))
+                ret = AVERROR(ENOMEM);
+        } else if (sscanf(line, "next_segment %"SCNd64, &ckpt->next_segment) == 1 ||
+                   sscanf(line, "input_pos %"SCNd64, &ckpt->input_pos) == 1 ||
+                   sscanf(line, "input_pts %"SCNd64, &ckpt->input_pts) == 1 ||
+                   sscanf(line, "input_frame %"SCNd64, &ckpt->input_frame) == 1) {
+            continue;
+        } else if (sscanf(line, "segment %lf %lf %n", &start, &end, &name_pos) == 2 && line[name_pos]) {
+            ret = checkpoint_add_segment(ckpt, line + name_pos, start, end);
+        } else {
+            av_log(NULL, AV_LOG_ERROR, "%s: cannot parse '%s'\n", filename, line);
+            ret = AVERROR_INVALIDDATA;
+        }
+    }
+    fclose(f);
+
+    if (ret >= 0 && (!ckpt->config || ckpt->nb_segments != ckpt->next_segment)) {
+        av_log(NULL, AV_LOG_ERROR, "%s is incomplete\n", filename);
+        ret = AVERROR_INVALIDDATA;
+    }
+    if (ret < 0)
+        checkpoint_free(ckpt);
+    return ret;
+}
+
+int checkpoint_write(const char *filename, const Checkpoint *ckpt)
+{
+    char *tmp_filename;
+    FILE *f = open_tmp(filename, &tmp_filename);
+
+    if (!f)
+        return AVERROR(errno ? errno : ENOMEM);
+    fprintf(f, "transcode-checkpoint %d\n", CHECKPOINT_VERSION);
+    fprintf(f, "config %s\n", ckpt->config);
+    fprintf(f, "next_segment %"PRId64"\n", ckpt->next_segment);
+    fprintf(f, "input_pos %"PRId64"\n", ckpt->input_pos);
+    fprintf(f, "input_pts %"PRId64"\n", ckpt->input_pts);
+    fprintf(f, "input_frame %"PRId64"\n", ckpt->input_frame);
+    for (int i = 0; i < ckpt->nb_segments; i++)
+        fprintf(f, "segment %f %f %s\n", ckpt->segments[i].start_time,
+                ckpt->segments[i].end_time, ckpt->segments[i].filename);
+    return commit_file(f, &tmp_filename, filename);
+}
+
+enum ManifestType { MANIFEST_FLAT, MANIFEST_CSV, MANIFEST_M3U8, MANIFEST_FFCONCAT };
+
+/* the same choice as the segment muxer's segment_list_type */
+static enum ManifestType manifest_type(const char *manifest)
+{
+    if (av_match_ext(manifest, "csv"))
+        return MANIFEST_CSV;
+    if (av_match_ext(manifest, "m3u8"))
+        return MANIFEST_M3U8;
+    if (av_match_ext(manifest, "ffcat,ffconcat"))
+        return MANIFEST_FFCONCAT;
+    return MANIFEST_FLAT;
+}
+
+/* quoted when it has a separator or quote in it, quotes doubled */
+static void print_csv_string(FILE *f, const char *str)
+{
+    int quote = !!str[strcspn(str, "\",\n\r")];
+
+    if (quote)
+        fputc('"', f);
+    for (; *str; str++) {
+        if (*str == '"')
+            fputc('"', f);
+        fputc(*str, f);
+    }
+    if (quote)
+        fputc('"', f);
+}
+
+int checkpoint_write_manifest(const char *manifest, const Checkpoint *ckpt, int finished)
+{
+    enum ManifestType type = manifest_type(manifest);
+    double max_duration = 0;
+    char *tmp_filename;
+    FILE *f = open_tmp(manifest, &tmp_filename);
+
+    if (!f)
+        return AVERROR(errno ? errno : ENOMEM);
+
+    if (type == MANIFEST_M3U8) {
+        for (int i = 0; i < ckpt->nb_segments; i++)
+            max_duration = FFMAX(max_duration, ckpt->segments[i].end_time - ckpt->segments[i].start_time);
+        fprintf(f, "#EXTM3U\n#EXT-X-VERSION:3\n#EXT-X-MEDIA-SEQUENCE:0\n#EXT-X-ALLOW-CACHE:NO\n");
+        fprintf(f, "#EXT-X-TARGETDURATION:%"PRId64"\n", (int64_t)ceil(max_duration));
+    } else if (type == MANIFEST_FFCONCAT) {
+        fprintf(f, "ffconcat version 1.0\n");
+    }
+
+    for (int i = 0; i < ckpt->nb_segments; i++) {
+        const CheckpointSegment *seg = &ckpt->segments[i];
+        char *escaped;
+
+        switch (type) {
+        case MANIFEST_FLAT:
+            fprintf(f, "%s\n", seg->filename);
+            break;
+        case MANIFEST_CSV:
+            print_csv_string(f, seg->filename);
+            fprintf(f, ",%f,%f\n", seg->start_time, seg->end_time);
+            break;
+        case MANIFEST_M3U8:
+            fprintf(f, "#EXTINF:%f,\n%s\n", seg->end_time - seg->start_time, seg->filename);
+            break;
+        case MANIFEST_FFCONCAT:
+            if (av_escape(&escaped, seg->filename, NULL, AV_ESCAPE_MODE_AUTO,
+                          AV_ESCAPE_FLAG_WHITESPACE) < 0) {
+                fclose(f);
+                unlink(tmp_filename);
+                av_free(tmp_filename);
+                return AVERROR(ENOMEM);
+            }
+            fprintf(f, "file %s\n", escaped);
+            av_free(escaped);
+            break;
+        }
+    }
+    if (type == MANIFEST_M3U8 && finished)
+        fprintf(f, "#EXT-X-ENDLIST\n");
+    return commit_file(f, &tmp_filename, manifest);
+}
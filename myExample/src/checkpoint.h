@@ -0,0 +1,53 @@
+#ifndef CHECKPOINT_H
+#define CHECKPOINT_H
+
+#include <stdint.h>
+
+/*
+ * Progress of a segmented transcode, written next to the manifest after
+ * every completed segment so a restarted job can continue from there
+ * instead of from the start of the input. A text file:
+ *
+ *   transcode-checkpoint 1
+ *   config <encoder configuration, must match to resume>
+ *   next_segment <number of the first segment not completed>
+ *   input_pos <byte offset of its first input packet>
+ *   input_pts <its pts, input stream time base>
+ *   input_frame <input frames before it>
+ *   segment <start seconds> <end seconds> <file name>   per completed segment
+ */
+#define CHECKPOINT_VERSION 1
+
+typedef struct CheckpointSegment {
+    char *filename; /* as listed in the manifest, without directory */
+    double start_time, end_time;
+} CheckpointSegment;
+
+typedef struct Checkpoint {
+    char *config;
+    int64_t next_segment;
+    int64_t input_pos;
+    int64_t input_pts;
+    int64_t input_frame;
+    CheckpointSegment *segments; /* completed ones, in order */
+    int nb_segments;
+} Checkpoint;
+
+/* AVERROR(ENOENT) when there is none, *ckpt is zeroed first */
+int checkpoint_read(const char *filename, Checkpoint *ckpt);
+
+/* Write through a temporary file, synced and renamed, so a crash leaves
+ * either the previous or the new checkpoint. */
+int checkpoint_write(const char *filename, const Checkpoint *ckpt);
+
+int checkpoint_add_segment(Checkpoint *ckpt, const char *filename,
+                           double start_time, double end_time);
+
+void checkpoint_free(Checkpoint *ckpt);
+
+/* The manifest the segment muxer would write for the completed segments,
+ * typed by its extension (.m3u8, .csv, .ffconcat/.ffcat, a plain list
+ * otherwise), written atomically. finished adds the end of an m3u8 playlist. */
+int checkpoint_write_manifest(const char *manifest, const Checkpoint *ckpt, int finished);
+
+#endif /* CHECKPOINT_H */
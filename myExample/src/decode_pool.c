@@ -0,0 +1,277 @@
+#include <pthread.h>
+#include <libavcodec/avcodec.h>
+#include <libavutil/avutil.h>
+#include "decode_pool.h"
+#include "frame_queue.h"
+#include "media_pool.h"
+
+typedef struct DecodeJob {
+    int64_t seq;
+    AVPacket *pkt;
+} DecodeJob;
+
+typedef struct DecodeSlot {
+    int ready;
+    AVFrame *frame; /* NULL when the packet produced no frame */
+} DecodeSlot;
+
+typedef struct DecodeWorker {
+    DecodePool *pool;
+    AVCodecContext *dec_ctx;
+    pthread_t thread;
+    int started;
+} DecodeWorker;
+
+struct DecodePool {
+    DecodeWorker *workers;
+    int nb_workers;
+    FrameQueue job_q; /* DecodeJob* */
+
+    /* reorder window, slot seq % window holds the result for packet seq */
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    DecodeSlot *slots;
+    int window;
+    int64_t next_send;
+    int64_t next_receive;
+    int eof;
+    int error;
+};
+
+static void free_job(DecodeJob **pjob)
+{
+    if (!*pjob)
+        return;
+    media_pool_put_packet(&(*pjob)->pkt);
+    av_freep(pjob);
+}
+
+static void free_job_item(void **item)
+{
+    free_job((DecodeJob **)item);
+}
+
+static int decode_job(AVCodecContext *dec_ctx, DecodeJob *job, AVFrame **pframe)
+{
+    AVFrame *frame;
+    int ret;
+
+    *pframe = NULL;
+    ret = avcodec_send_packet(dec_ctx, job->pkt);
+    if (ret < 0)
+        return ret;
+
+    frame = media_pool_get_frame();
+    if (!frame)
+        return AVERROR(ENOMEM);
+    /* intra-only decoders without delay return the frame right away */
+    ret = avcodec_receive_frame(dec_ctx, frame);
+    if (ret < 0) {
+        media_pool_put_frame(&frame);
+        return ret == AVERROR(EAGAIN) ? 0 : ret;
+    }
+    *pframe = frame;
+    return 0;
+}
+
+static void *decode_worker_thread(void *arg)
+{
+    DecodeWorker *w = arg;
+    DecodePool *pool = w->pool;
+    DecodeJob *job;
+    AVFrame *frame;
+    int ret;
+
+    while (frame_queue_pop(&pool->job_q, (void **)&job) >= 0) {
+        ret = decode_job(w->dec_ctx, job, &frame);
+
+        pthread_mutex_lock(&pool->lock);
+        if (ret < 0 && !pool->error)
+            pool->error = ret;
+        pool->slots[job->seq % pool->window].frame = frame;
+        pool->slots[job->seq % pool->window].ready = 1;
+        pthread_cond_broadcast(&pool->cond);
+        pthread_mutex_unlock(&pool->lock);
+
+        free_job(&job);
+        if (ret < 0)
+            frame_queue_abort(&pool->job_q);
+    }
+    return NULL;
+}
+
+int decode_pool_supported(const AVCodec *dec)
+{
+    const AVCodecDescriptor *desc = avcodec_descriptor_get(dec->id);
+
+    if (dec->capabilities & AV_CODEC_CAP_FRAME_THREADS)
+        return 0;
+    /* packets can only be decoded independently if no frame references another */
+    return desc && (desc->props & AV_CODEC_PROP_INTRA_ONLY) &&
+           !(dec->capabilities & AV_CODEC_CAP_DELAY);
+}
+
+int decode_pool_alloc(DecodePool **ppool, AVCodecContext **dec_ctxs, int nb_workers)
+{
+    DecodePool *pool;
+    int ret;
+
+    *ppool = NULL;
+    pool = av_mallocz(sizeof(*pool));
+    if (!pool)
+        goto fail_nomem;
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->cond, NULL);
+    *ppool = pool;
+
+    pool->workers = av_calloc(nb_workers, sizeof(*pool->workers));
+    if (!pool->workers)
+        goto fail_nomem;
+    pool->nb_workers = nb_workers;
+    for (int i = 0; i < nb_workers; i++) {
+        pool->workers[i].pool = pool;
+        pool->workers[i].dec_ctx = dec_ctxs[i];
+        dec_ctxs[i] = NULL;
+    }
+
+    /* two packets per worker in flight keeps every worker busy while the
+     * receiver waits for the oldest one */
+    pool->window = 2 * nb_workers;
+    pool->slots = av_calloc(pool->window, sizeof(*pool->slots));
+    if (!pool->slots)
+        goto fail_nomem;
+    if ((ret = frame_queue_init(&pool->job_q, pool->window)) < 0)
+        goto fail;
+
+    for (int i = 0; i < nb_workers; i++) {
+        if ((ret = pthread_create(&pool->workers[i].thread, NULL,
+                                  decode_worker_thread, &pool->workers[i]))) {
+            ret = AVERROR(ret);
+            goto fail;
+        }
+        pool->workers[i].started = 1;
+    }
+    return 0;
+
+fail_nomem:
+    ret = AVERROR(ENOMEM);
+fail:
+    for (int i = 0; i < nb_workers; i++)
+        avcodec_free_context(&dec_ctxs[i]);
+    decode_pool_free(ppool);
+    return ret;
+}
+
+void decode_pool_free(DecodePool **ppool)
+{
+    DecodePool *pool = *ppool;
+
+    if (!pool)
+        return;
+
+    if (pool->job_q.items)
+        frame_queue_abort(&pool->job_q);
+    for (int i = 0; pool->workers && i < pool->nb_workers; i++) {
+        if (pool->workers[i].started)
+            pthread_join(pool->workers[i].thread, NULL);
+        avcodec_free_context(&pool->workers[i].dec_ctx);
+    }
+    frame_queue_destroy(&pool->job_q, free_job_item);
+
+    for (int i = 0; pool->slots && i < pool->window; i++)
+        media_pool_put_frame(&pool->slots[i].frame);
+    av_freep(&pool->slots);
+    av_freep(&pool->workers);
+
+    pthread_cond_destroy(&pool->cond);
+    pthread_mutex_destroy(&pool->lock);
+    av_freep(ppool);
+}
+
+int decode_pool_send_packet(DecodePool *pool, AVPacket *pkt)
+{
+    DecodeJob *job;
+    int ret;
+
+    pthread_mutex_lock(&pool->lock);
+    ret = pool->error;
+    if (!ret && pool->eof) {
+        ret = AVERROR_EOF;
+    } else if (!ret && !pkt) {
+        pool->eof = 1;
+        pthread_cond_broadcast(&pool->cond);
+    } else if (!ret && pool->next_send - pool->next_receive >= pool->window) {
+        ret = AVERROR(EAGAIN);
+    }
+    pthread_mutex_unlock(&pool->lock);
+    if (ret < 0)
+        return ret;
+
+    if (!pkt) {
+        frame_queue_finish(&pool->job_q);
+        return 0;
+    }
+
+    job = av_mallocz(sizeof(*job));
+    if (!job)
+        return AVERROR(ENOMEM);
+    job->pkt = media_pool_get_packet();
+    if (!job->pkt) {
+        av_free(job);
+        return AVERROR(ENOMEM);
+    }
+    av_packet_move_ref(job->pkt, pkt);
+
+    /* only the sending thread advances next_send */
+    job->seq = pool->next_send;
+    pthread_mutex_lock(&pool->lock);
+    pool->slots[job->seq % pool->window].ready = 0;
+    pool->next_send++;
+    pthread_mutex_unlock(&pool->lock);
+
+    /* never blocks, the window is no larger than the queue */
+    if ((ret = frame_queue_push(&pool->job_q, job)) < 0) {
+        free_job(&job);
+        return pool->error ? pool->error : ret;
+    }
+    return 0;
+}
+
+int decode_pool_receive_frame(DecodePool *pool, AVFrame **frame)
+{
+    DecodeSlot *slot;
+    int ret = 0;
+
+    *frame = NULL;
+    pthread_mutex_lock(&pool->lock);
+    while (1) {
+        if (pool->error) {
+            ret = pool->error;
+            break;
+        }
+        if (pool->next_receive == pool->next_send) {
+            ret = pool->eof ? AVERROR_EOF : AVERROR(EAGAIN);
+            break;
+        }
+
+        slot = &pool->slots[pool->next_receive % pool->window];
+        if (slot->ready) {
+            *frame = slot->frame;
+            slot->frame = NULL;
+            slot->ready = 0;
+            pool->next_receive++;
+            if (*frame)
+                break;
+            continue;
+        }
+
+        /* wait only if the caller cannot make progress by sending */
+        if (!pool->eof && pool->next_send - pool->next_receive < pool->window) {
+            ret = AVERROR(EAGAIN);
+            break;
+        }
+        pthread_cond_wait(&pool->cond, &pool->lock);
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return ret;
+}
@@ -0,0 +1,33 @@
+#ifndef DECODE_POOL_H
+#define DECODE_POOL_H
+
+#include <libavcodec/avcodec.h>
+
+/*
+ * Frame-parallel decoding for intra-only codecs (MJPEG) whose libavcodec
+ * decoder has no frame threading. Packets are decoded by several decoder
+ * contexts at once and the frames come back in the order the packets were
+ * sent, which for intra-only input is presentation order.
+ *
+ * The send/receive calls follow the avcodec_send_packet() and
+ * avcodec_receive_frame() contract: send returns AVERROR(EAGAIN) when the
+ * reorder window is full and frames have to be received first, receive
+ * returns AVERROR(EAGAIN) while the next frame is still being decoded and
+ * more input can be sent, and AVERROR_EOF once a NULL packet was sent and
+ * everything is drained.
+ */
+typedef struct DecodePool DecodePool;
+
+/* Takes ownership of the nb_workers opened decoder contexts in dec_ctxs. */
+int decode_pool_alloc(DecodePool **ppool, AVCodecContext **dec_ctxs, int nb_workers);
+void decode_pool_free(DecodePool **ppool);
+
+/* pkt's reference is moved into the pool on success, NULL starts draining */
+int decode_pool_send_packet(DecodePool *pool, AVPacket *pkt);
+/* *frame is newly allocated and owned by the caller */
+int decode_pool_receive_frame(DecodePool *pool, AVFrame **frame);
+
+/* whether a decoder for this codec needs the pool to decode in parallel */
+int decode_pool_supported(const AVCodec *dec);
+
+#endif /* DECODE_POOL_H */
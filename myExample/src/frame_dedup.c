@@ -0,0 +1,312 @@
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <libavutil/common.h>
+#include <libavutil/cpu.h>
+#include <libavutil/error.h>
+#include <libavutil/mem.h>
+#include <libavutil/pixdesc.h>
+#include "frame_dedup.h"
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#define HAVE_X86_KERNELS 1
+#include <immintrin.h>
+#else
+#define HAVE_X86_KERNELS 0
+#endif
+
+#define BLOCK_SIZE 8
+
+struct FrameDedup {
+    int threshold;
+    int64_t max_gap;
+    int64_t nb_dropped;
+
+    int has_ref;
+    int64_t ref_pts;      /* of the last kept packet/frame */
+    AVPacket *ref_pkt;    /* last kept packet */
+    AVPacket *tail_pkt;   /* last dropped packet, blank once one is kept */
+    AVFrame *tail_frame;  /* last dropped frame, blank once one is kept */
+
+    /* 8x8 block sums of the last kept and of the current frame's luma */
+    uint16_t *ref_sums, *sums;
+    int width, height, format;
+    int blocks_w, blocks_h;
+};
+
+/* sums of nb_blocks whole 8x8 blocks in the 8 rows at src */
+typedef void (*BlockSumsFunc)(uint16_t *sums, const uint8_t *src, ptrdiff_t stride, int nb_blocks);
+
+/* sum of a w x h block, w, h <= 8 */
+static int block_sum_c(const uint8_t *src, ptrdiff_t stride, int w, int h)
+{
+    int sum = 0;
+
+    for (int y = 0; y < h; y++)
+        for (int x = 0; x < w; x++)
+            sum += src[y * stride + x];
+    return sum;
+}
+
+static void block_sums_c(uint16_t *sums, const uint8_t *src, ptrdiff_t stride, int nb_blocks)
+{
+    for (int b = 0; b < nb_blocks; b++)
+        sums[b] = block_sum_c(src + b * BLOCK_SIZE, stride, BLOCK_SIZE, BLOCK_SIZE);
+}
+
+#if HAVE_X86_KERNELS
+/* psadbw against zero adds up each group of 8 bytes into a 64-bit lane,
+ * one block row per lane, so 8 rows give the block sums directly */
+__attribute__((target("sse2")))
+static void block_sums_sse2(uint16_t *sums, const uint8_t *src, ptrdiff_t stride, int nb_blocks)
+{
+    const __m128i zero = _mm_setzero_si128();
+    int b = 0;
+
+    for (; b + 2 <= nb_blocks; b += 2) {
+        const uint8_t *p = src + b * BLOCK_SIZE;
+        __m128i acc = zero;
+
+        for (int y = 0; y < BLOCK_SIZE; y++)
+            acc = _mm_add_epi64(acc, _mm_sad_epu8(_mm_loadu_si128((const __m128i *)(p + y * stride)),
+                                                  zero));
+        sums[b]     = _mm_extract_epi16(acc, 0);
+        sums[b + 1] = _mm_extract_epi16(acc, 4);
+    }
+    block_sums_c(sums + b, src + b * BLOCK_SIZE, stride, nb_blocks - b);
+}
+
+__attribute__((target("avx2")))
+static void block_sums_avx2(uint16_t *sums, const uint8_t *src, ptrdiff_t stride, int nb_blocks)
+{
+    const __m256i zero = _mm256_setzero_si256();
+    int b = 0;
+
+    for (; b + 4 <= nb_blocks; b += 4) {
+        const uint8_t *p = src + b * BLOCK_SIZE;
+        __m256i acc = zero;
+
+        for (int y = 0; y < BLOCK_SIZE; y++)
+            acc = _mm256_add_epi64(acc, _mm256_sad_epu8(_mm256_loadu_si256((const __m256i *)(p + y * stride)),
+                                                        zero));
+        sums[b]     = _mm256_extract_epi16(acc, 0);
+        sums[b + 1] = _mm256_extract_epi16(acc, 4);
+        sums[b + 2] = _mm256_extract_epi16(acc, 8);
+        sums[b + 3] = _mm256_extract_epi16(acc, 12);
+    }
+    block_sums_sse2(sums + b, src + b * BLOCK_SIZE, stride, nb_blocks - b);
+}
+#endif
+
+static pthread_once_t kernels_once = PTHREAD_ONCE_INIT;
+static BlockSumsFunc block_sums = block_sums_c;
+static const char *kernel_name = "c";
+
+/* av_get_cpu_flags() rather than cpuid, so av_force_cpu_flags() applies */
+static void init_kernels(void)
+{
+#if HAVE_X86_KERNELS
+    int flags = av_get_cpu_flags();
+
+    if (flags & AV_CPU_FLAG_AVX2) {
+        block_sums = block_sums_avx2;
+        kernel_name = "avx2";
+    } else if (flags & AV_CPU_FLAG_SSE2) {
+        block_sums = block_sums_sse2;
+        kernel_name = "sse2";
+    }
+#endif
+}
+
+FrameDedup *frame_dedup_alloc(int threshold, int64_t max_gap)
+{
+    FrameDedup *fd = av_mallocz(sizeof(*fd));
+
+    if (!fd)
+        return NULL;
+    fd->threshold = threshold;
+    fd->max_gap = max_gap;
+    fd->format = AV_PIX_FMT_NONE;
+    fd->ref_pkt = av_packet_alloc();
+    fd->tail_pkt = av_packet_alloc();
+    fd->tail_frame = av_frame_alloc();
+    if (!fd->ref_pkt || !fd->tail_pkt || !fd->tail_frame)
+        frame_dedup_free(&fd);
+    pthread_once(&kernels_once, init_kernels);
+    return fd;
+}
+
+void frame_dedup_free(FrameDedup **pfd)
+{
+    FrameDedup *fd = *pfd;
+
+    if (!fd)
+        return;
+    av_packet_free(&fd->ref_pkt);
+    av_packet_free(&fd->tail_pkt);
+    av_frame_free(&fd->tail_frame);
+    av_freep(&fd->ref_sums);
+    av_freep(&fd->sums);
+    av_freep(pfd);
+}
+
+/* a repeat is only dropped while the kept frame may still cover it */
+static int within_gap(const FrameDedup *fd, int64_t pts)
+{
+    return fd->has_ref && pts != AV_NOPTS_VALUE && pts > fd->ref_pts &&
+           pts - fd->ref_pts < fd->max_gap;
+}
+
+int frame_dedup_packet(FrameDedup *fd, const AVPacket *pkt)
+{
+    int ret;
+
+    if (within_gap(fd, pkt->pts) && pkt->size == fd->ref_pkt->size &&
+        !memcmp(pkt->data, fd->ref_pkt->data, pkt->size)) {
+        av_packet_unref(fd->tail_pkt);
+        if ((ret = av_packet_ref(fd->tail_pkt, pkt)) < 0)
+            return ret;
+        fd->nb_dropped++;
+        return 1;
+    }
+
+    av_packet_unref(fd->tail_pkt);
+    av_packet_unref(fd->ref_pkt);
+    fd->has_ref = pkt->pts != AV_NOPTS_VALUE;
+    if (!fd->has_ref)
+        return 0;
+    fd->ref_pts = pkt->pts;
+    /* a reference to the demuxer's buffer, copied if it has none */
+    if ((ret = av_packet_ref(fd->ref_pkt, pkt)) < 0) {
+        fd->has_ref = 0;
+        return ret;
+    }
+    return 0;
+}
+
+/* planar formats with 8-bit luma first, what MJPEG decodes to */
+static int has_luma_plane(enum AVPixelFormat format)
+{
+    const AVPixFmtDescriptor *desc = av_pix_fmt_desc_get(format);
+
+    return desc && !(desc->flags & (AV_PIX_FMT_FLAG_RGB | AV_PIX_FMT_FLAG_PAL |
+                                    AV_PIX_FMT_FLAG_HWACCEL | AV_PIX_FMT_FLAG_BITSTREAM)) &&
+           desc->nb_components >= 1 && desc->comp[0].plane == 0 && desc->comp[0].step == 1 &&
+           desc->comp[0].depth == 8;
+}
+
+static int resize_sums(FrameDedup *fd, const AVFrame *frame)
+{
+    int blocks_w = AV_CEIL_RSHIFT(frame->width, 3);
+    int blocks_h = AV_CEIL_RSHIFT(frame->height, 3);
+
+    av_freep(&fd->ref_sums);
+    av_freep(&fd->sums);
+    fd->has_ref = 0;
+    fd->format = AV_PIX_FMT_NONE;
+    fd->ref_sums = av_malloc_array(blocks_w * blocks_h, sizeof(*fd->ref_sums));
+    fd->sums = av_malloc_array(blocks_w * blocks_h, sizeof(*fd->sums));
+    if (!fd->ref_sums || !fd->sums)
+        return AVERROR(ENOMEM);
+    fd->width = frame->width;
+    fd->height = frame->height;
+    fd->format = frame->format;
+    fd->blocks_w = blocks_w;
+    fd->blocks_h = blocks_h;
+    return 0;
+}
+
+/* Partial blocks at the right and bottom edge are summed over the pixels
+ * they have, and compared to the same partial block of the kept frame. */
+static void frame_block_sums(FrameDedup *fd, const AVFrame *frame)
+{
+    int full_w = frame->width / BLOCK_SIZE;
+
+    for (int by = 0; by < fd->blocks_h; by++) {
+        const uint8_t *band = frame->data[0] + by * BLOCK_SIZE * frame->linesize[0];
+        int rows = FFMIN(BLOCK_SIZE, frame->height - by * BLOCK_SIZE);
+        uint16_t *sums = fd->sums + by * fd->blocks_w;
+
+        if (rows == BLOCK_SIZE) {
+            block_sums(sums, band, frame->linesize[0], full_w);
+        } else {
+            for (int b = 0; b < full_w; b++)
+                sums[b] = block_sum_c(band + b * BLOCK_SIZE, frame->linesize[0], BLOCK_SIZE, rows);
+        }
+        if (full_w < fd->blocks_w)
+            sums[full_w] = block_sum_c(band + full_w * BLOCK_SIZE, frame->linesize[0],
+                                       frame->width - full_w * BLOCK_SIZE, rows);
+    }
+}
+
+/* every block mean within the threshold, i.e. its sum within 64 times it */
+static int sums_within(const FrameDedup *fd)
+{
+    int max_diff = fd->threshold * BLOCK_SIZE * BLOCK_SIZE;
+
+    for (int i = 0; i < fd->blocks_w * fd->blocks_h; i++) {
+        if (abs(fd->sums[i] - fd->ref_sums[i]) > max_diff)
+            return 0;
+    }
+    return 1;
+}
+
+int frame_dedup_frame(FrameDedup *fd, const AVFrame *frame)
+{
+    uint16_t *sums;
+    int ret;
+
+    if (frame->pts == AV_NOPTS_VALUE || !has_luma_plane(frame->format)) {
+        fd->has_ref = 0;
+        av_frame_unref(fd->tail_frame);
+        return 0;
+    }
+    if (frame->width != fd->width || frame->height != fd->height || frame->format != fd->format) {
+        if ((ret = resize_sums(fd, frame)) < 0)
+            return ret;
+    }
+
+    frame_block_sums(fd, frame);
+    if (within_gap(fd, frame->pts) && sums_within(fd)) {
+        av_frame_unref(fd->tail_frame);
+        if ((ret = av_frame_ref(fd->tail_frame, frame)) < 0)
+            return ret;
+        fd->nb_dropped++;
+        return 1;
+    }
+
+    av_frame_unref(fd->tail_frame);
+    sums = fd->ref_sums;
+    fd->ref_sums = fd->sums;
+    fd->sums = sums;
+    fd->ref_pts = frame->pts;
+    fd->has_ref = 1;
+    return 0;
+}
+
+int frame_dedup_tail_packet(FrameDedup *fd, AVPacket *dst)
+{
+    if (!fd->tail_pkt->data)
+        return 0;
+    av_packet_move_ref(dst, fd->tail_pkt);
+    return 1;
+}
+
+int frame_dedup_tail_frame(FrameDedup *fd, AVFrame *dst)
+{
+    if (!fd->tail_frame->buf[0])
+        return 0;
+    av_frame_move_ref(dst, fd->tail_frame);
+    return 1;
+}
+
+int64_t frame_dedup_nb_dropped(const FrameDedup *fd)
+{
+    return fd->nb_dropped;
+}
+
+const char *frame_dedup_kernel_name(void)
+{
+    pthread_once(&kernels_once, init_kernels);
+    return kernel_name;
+}
@@ -0,0 +1,52 @@
+#ifndef FRAME_DEDUP_H
+#define FRAME_DEDUP_H
+
+#include <stdint.h>
+#include <libavcodec/packet.h>
+#include <libavutil/frame.h>
+
+/*
+ * Static and repeated frame detection. Camera MJPEG often has long runs of
+ * frames in which nothing changes; those are dropped instead of being
+ * encoded again. The frames that are kept keep their timestamps, so the
+ * one before a dropped run is shown until the next kept one.
+ *
+ * Frames are compared to the last kept frame, not to the previous one, so a
+ * slow change still adds up to a kept frame. Two levels, each with its own
+ * context:
+ *   - packets: a byte-identical repeat of a compressed image (intra-only
+ *     codecs) is dropped before it is decoded
+ *   - frames: the luma plane is reduced to the sum of every 8x8 block
+ *     (psadbw, SSE2/AVX2), which averages out sensor noise; a frame whose
+ *     block means all stay within the threshold of the kept frame's is
+ *     static. Frames without 8-bit luma are always kept.
+ */
+typedef struct FrameDedup FrameDedup;
+
+/* threshold: the largest change of an 8x8 block mean (luma levels) taken
+ * as static, 0 only drops frames whose block means are unchanged. A kept
+ * frame covers at most max_gap (stream time base), so players and segments
+ * still get a frame that often. NULL when out of memory. */
+FrameDedup *frame_dedup_alloc(int threshold, int64_t max_gap);
+
+void frame_dedup_free(FrameDedup **pfd);
+
+/* 1 if pkt repeats the last kept packet and can be dropped, 0 if it is kept,
+ * a negative AVERROR on failure. Packets without pts are always kept. */
+int frame_dedup_packet(FrameDedup *fd, const AVPacket *pkt);
+
+/* the same for a decoded frame */
+int frame_dedup_frame(FrameDedup *fd, const AVFrame *frame);
+
+/* Move the last dropped packet/frame to dst if nothing was kept after it,
+ * returns 1 then. Sent at the end of the input so the output lasts as long. */
+int frame_dedup_tail_packet(FrameDedup *fd, AVPacket *dst);
+int frame_dedup_tail_frame(FrameDedup *fd, AVFrame *dst);
+
+/* packets or frames dropped so far */
+int64_t frame_dedup_nb_dropped(const FrameDedup *fd);
+
+/* name of the kernel picked for this CPU ("avx2", "sse2" or "c") */
+const char *frame_dedup_kernel_name(void);
+
+#endif /* FRAME_DEDUP_H */
@@ -0,0 +1,105 @@
+#include <libavutil/error.h>
+#include <libavutil/mem.h>
+#include "frame_queue.h"
+
+int frame_queue_init(FrameQueue *q, int capacity)
+{
+    q->items = av_calloc(capacity, sizeof(*q->items));
+    if (!q->items)
+        return AVERROR(ENOMEM);
+    q->capacity = capacity;
+    q->head = 0;
+    q->count = 0;
+    q->finished = 0;
+    q->aborted = 0;
+
+    pthread_mutex_init(&q->lock, NULL);
+    pthread_cond_init(&q->not_empty, NULL);
+    pthread_cond_init(&q->not_full, NULL);
+    return 0;
+}
+
+void frame_queue_destroy(FrameQueue *q, void (*free_item)(void **item))
+{
+    if (!q->items)
+        return;
+
+    while (q->count > 0) {
+        void *item = q->items[q->head];
+        q->head = (q->head + 1) % q->capacity;
+        q->count--;
+        if (free_item)
+            free_item(&item);
+    }
+    av_freep(&q->items);
+
+    pthread_cond_destroy(&q->not_full);
+    pthread_cond_destroy(&q->not_empty);
+    pthread_mutex_destroy(&q->lock);
+}
+
+int frame_queue_push(FrameQueue *q, void *item)
+{
+    pthread_mutex_lock(&q->lock);
+    while (q->count == q->capacity && !q->aborted)
+        pthread_cond_wait(&q->not_full, &q->lock);
+    if (q->aborted) {
+        pthread_mutex_unlock(&q->lock);
+        return AVERROR_EXIT;
+    }
+
+    q->items[(q->head + q->count) % q->capacity] = item;
+    q->count++;
+    pthread_cond_signal(&q->not_empty);
+    pthread_mutex_unlock(&q->lock);
+    return 0;
+}
+
+int frame_queue_pop(FrameQueue *q, void **item)
+{
+    int ret = 0;
+
+    pthread_mutex_lock(&q->lock);
+    while (q->count == 0 && !q->finished && !q->aborted)
+        pthread_cond_wait(&q->not_empty, &q->lock);
+
+    if (q->aborted) {
+        ret = AVERROR_EXIT;
+    } else if (q->count == 0) {
+        ret = AVERROR_EOF;
+    } else {
+        *item = q->items[q->head];
+        q->head = (q->head + 1) % q->capacity;
+        q->count--;
+        pthread_cond_signal(&q->not_full);
+    }
+    pthread_mutex_unlock(&q->lock);
+    return ret;
+}
+
+void frame_queue_finish(FrameQueue *q)
+{
+    pthread_mutex_lock(&q->lock);
+    q->finished = 1;
+    pthread_cond_broadcast(&q->not_empty);
+    pthread_mutex_unlock(&q->lock);
+}
+
+void frame_queue_abort(FrameQueue *q)
+{
+    pthread_mutex_lock(&q->lock);
+    q->aborted = 1;
+    pthread_cond_broadcast(&q->not_empty);
+    pthread_cond_broadcast(&q->not_full);
+    pthread_mutex_unlock(&q->lock);
+}
+
+int frame_queue_size(FrameQueue *q)
+{
+    int count;
+
+    pthread_mutex_lock(&q->lock);
+    count = q->count;
+    pthread_mutex_unlock(&q->lock);
+    return count;
+}
@@ -0,0 +1,38 @@
+#ifndef FRAME_QUEUE_H
+#define FRAME_QUEUE_H
+
+#include <pthread.h>
+
+/*
+ * Bounded FIFO used to hand ref-counted AVPacket/AVFrame pointers from one
+ * pipeline stage (thread) to the next. The queue owns the pointers it holds.
+ * frame_queue_push() blocks while the queue is full, so a slow consumer
+ * throttles its producer instead of letting memory grow.
+ */
+typedef struct FrameQueue {
+    void **items;
+    int capacity;
+    int head;
+    int count;
+    int finished; /* producer has no more items */
+    int aborted;  /* pipeline is being torn down, wake everybody up */
+
+    pthread_mutex_t lock;
+    pthread_cond_t not_empty;
+    pthread_cond_t not_full;
+} FrameQueue;
+
+int frame_queue_init(FrameQueue *q, int capacity);
+/* free_item is called for every item still queued, may be NULL */
+void frame_queue_destroy(FrameQueue *q, void (*free_item)(void **item));
+
+/* returns 0, or AVERROR_EXIT if the queue was aborted */
+int frame_queue_push(FrameQueue *q, void *item);
+/* returns 0, AVERROR_EOF when finished and drained, or AVERROR_EXIT if aborted */
+int frame_queue_pop(FrameQueue *q, void **item);
+
+void frame_queue_finish(FrameQueue *q);
+void frame_queue_abort(FrameQueue *q);
+int frame_queue_size(FrameQueue *q);
+
+#endif /* FRAME_QUEUE_H */
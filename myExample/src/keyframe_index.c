@@ -0,0 +1,85 @@
+#include <errno.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <libavformat/avformat.h>
+#include <libavutil/avstring.h>
+#include <libavutil/avutil.h>
+#include "keyframe_index.h"
+
+static int find_video_stream(AVFormatContext *ic)
+{
+    for (unsigned i = 0; i < ic->nb_streams; i++)
+        if (ic->streams[i]->codecpar->codec_type == AVMEDIA_TYPE_VIDEO)
+            return i;
+    return AVERROR_STREAM_NOT_FOUND;
+}
+
+int keyframe_index_write(const char *media_filename, const char *index_filename)
+{
+    AVFormatContext *ic = NULL;
+    AVIOContext *pb = NULL;
+    AVStream *st;
+    char *tmp_filename = NULL;
+    int nb_entries, nb_keyframes = 0;
+    int idx, ret;
+
+    if ((ret = avformat_open_input(&ic, media_filename, NULL, NULL)) < 0)
+        goto end;
+    if ((idx = find_video_stream(ic)) < 0) {
+        ret = idx;
+        goto end;
+    }
+    st = ic->streams[idx];
+    /* Matroska loads Cues stored after the clusters only on the first seek */
+    av_seek_frame(ic, idx, 0, AVSEEK_FLAG_BACKWARD);
+
+    nb_entries = avformat_index_get_entries_count(st);
+    for (int i = 0; i < nb_entries; i++)
+        if (avformat_index_get_entry(st, i)->flags & AVINDEX_KEYFRAME)
+            nb_keyframes++;
+    if (!nb_keyframes) {
+        av_log(NULL, AV_LOG_WARNING, "%s has no keyframe index to export\n", media_filename);
+        ret = AVERROR_INVALIDDATA;
+        goto end;
+    }
+
+    tmp_filename = av_asprintf("%s.tmp", index_filename);
+    if (!tmp_filename) {
+        ret = AVERROR(ENOMEM);
+        goto end;
+    }
+    if ((ret = avio_open(&pb, tmp_filename, AVIO_FLAG_WRITE)) < 0)
+        goto end;
+
+    avio_write(pb, (const unsigned char *)"KFIX", 4);
+    avio_w8(pb, KEYFRAME_INDEX_VERSION);
+    avio_w8(pb, 0);
+    avio_w8(pb, 0);
+    avio_w8(pb, 0);
+    avio_wl32(pb, st->time_base.num);
+    avio_wl32(pb, st->time_base.den);
+    avio_wl32(pb, nb_keyframes);
+    /* the demuxer keeps its index sorted by timestamp */
+    for (int i = 0; i < nb_entries; i++) {
+        const AVIndexEntry *e = avformat_index_get_entry(st, i);
+
+        if (!(e->flags & AVINDEX_KEYFRAME))
+            continue;
+        avio_wl64(pb, e->timestamp);
+        avio_wl64(pb, e->pos);
+    }
+    ret = avio_closep(&pb);
+    if (ret >= 0 && rename(tmp_filename, index_filename) < 0)
+        ret = AVERROR(errno);
+    if (ret >= 0)
+        av_log(NULL, AV_LOG_INFO, "Wrote %d keyframes to %s\n", nb_keyframes, index_filename);
+
+end:
+    if (pb)
+        avio_closep(&pb);
+    if (ret < 0 && tmp_filename)
+        unlink(tmp_filename);
+    av_free(tmp_filename);
+    avformat_close_input(&ic);
+    return ret;
+}
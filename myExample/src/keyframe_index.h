@@ -0,0 +1,25 @@
+#ifndef KEYFRAME_INDEX_H
+#define KEYFRAME_INDEX_H
+
+/*
+ * Keyframe index sidecar ("KFIX") next to a finished output file, so a
+ * player or clip extractor can map a timestamp to a byte offset with one
+ * small read instead of parsing the container. All fields little endian:
+ *
+ *   char     magic[4]   "KFIX"
+ *   uint8_t  version    1
+ *   uint8_t  reserved[3]
+ *   uint32_t tb_num, tb_den   time base of the timestamps
+ *   uint32_t count
+ *   count x { int64_t pts; uint64_t offset; }   sorted by pts
+ *
+ * offset is the file position of the cluster (or equivalent) starting with
+ * that keyframe, reading from there decodes without earlier data.
+ */
+#define KEYFRAME_INDEX_VERSION 1
+
+/* Read the index of the finished file media_filename through its demuxer
+ * and write it atomically to index_filename. */
+int keyframe_index_write(const char *media_filename, const char *index_filename);
+
+#endif /* KEYFRAME_INDEX_H */
@@ -0,0 +1,140 @@
+#include <pthread.h>
+#include <libavcodec/avcodec.h>
+#include <libavutil/avutil.h>
+#include "media_pool.h"
+
+typedef struct ObjectStack {
+    void **items;
+    int nb_items;
+    int capacity;
+    int64_t gets;
+    int64_t misses; /* gets that found the stack empty */
+} ObjectStack;
+
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static ObjectStack packets;
+static ObjectStack frames;
+
+static void *stack_pop(ObjectStack *s)
+{
+    void *item = NULL;
+
+    pthread_mutex_lock(&pool_lock);
+    s->gets++;
+    if (s->nb_items > 0)
+        item = s->items[--s->nb_items];
+    else
+        s->misses++;
+    pthread_mutex_unlock(&pool_lock);
+    return item;
+}
+
+/* returns 0 when the stack is full (or not set up) and the caller must free */
+static int stack_push(ObjectStack *s, void *item)
+{
+    int pushed = 0;
+
+    pthread_mutex_lock(&pool_lock);
+    if (s->nb_items < s->capacity) {
+        s->items[s->nb_items++] = item;
+        pushed = 1;
+    }
+    pthread_mutex_unlock(&pool_lock);
+    return pushed;
+}
+
+int media_pool_init(int nb_packets, int nb_frames)
+{
+    void **pkt_items = av_calloc(nb_packets, sizeof(*pkt_items));
+    void **frame_items = av_calloc(nb_frames, sizeof(*frame_items));
+    int i, j;
+
+    if (!pkt_items || !frame_items)
+        goto fail;
+    for (i = 0; i < nb_packets; i++)
+        if (!(pkt_items[i] = av_packet_alloc()))
+            goto fail;
+    for (j = 0; j < nb_frames; j++)
+        if (!(frame_items[j] = av_frame_alloc()))
+            goto fail;
+
+    media_pool_uninit();
+    pthread_mutex_lock(&pool_lock);
+    packets = (ObjectStack){ .items = pkt_items, .nb_items = nb_packets, .capacity = nb_packets };
+    frames = (ObjectStack){ .items = frame_items, .nb_items = nb_frames, .capacity = nb_frames };
+    pthread_mutex_unlock(&pool_lock);
+    return 0;
+
+fail:
+    for (i = 0; pkt_items && i < nb_packets; i++)
+        av_packet_free((AVPacket **)&pkt_items[i]);
+    for (j = 0; frame_items && j < nb_frames; j++)
+        av_frame_free((AVFrame **)&frame_items[j]);
+    av_free(pkt_items);
+    av_free(frame_items);
+    return AVERROR(ENOMEM);
+}
+
+void media_pool_uninit(void)
+{
+    ObjectStack old_packets, old_frames;
+
+    pthread_mutex_lock(&pool_lock);
+    old_packets = packets;
+    old_frames = frames;
+    packets = (ObjectStack){ 0 };
+    frames = (ObjectStack){ 0 };
+    pthread_mutex_unlock(&pool_lock);
+
+    for (int i = 0; i < old_packets.nb_items; i++)
+        av_packet_free((AVPacket **)&old_packets.items[i]);
+    for (int i = 0; i < old_frames.nb_items; i++)
+        av_frame_free((AVFrame **)&old_frames.items[i]);
+    av_free(old_packets.items);
+    av_free(old_frames.items);
+}
+
+AVPacket *media_pool_get_packet(void)
+{
+    AVPacket *pkt = stack_pop(&packets);
+
+    return pkt ? pkt : av_packet_alloc();
+}
+
+void media_pool_put_packet(AVPacket **pkt)
+{
+    if (!*pkt)
+        return;
+    av_packet_unref(*pkt);
+    if (stack_push(&packets, *pkt))
+        *pkt = NULL;
+    else
+        av_packet_free(pkt);
+}
+
+AVFrame *media_pool_get_frame(void)
+{
+    AVFrame *frame = stack_pop(&frames);
+
+    return frame ? frame : av_frame_alloc();
+}
+
+void media_pool_put_frame(AVFrame **frame)
+{
+    if (!*frame)
+        return;
+    av_frame_unref(*frame);
+    if (stack_push(&frames, *frame))
+        *frame = NULL;
+    else
+        av_frame_free(frame);
+}
+
+void media_pool_log_stats(void)
+{
+    pthread_mutex_lock(&pool_lock);
+    av_log(NULL, AV_LOG_INFO, "Media pool: %"PRId64" of %"PRId64" packets and "
+           "%"PRId64" of %"PRId64" frames had to be allocated\n",
+           packets.misses, packets.gets, frames.misses, frames.gets);
+    pthread_mutex_unlock(&pool_lock);
+}
@@ -0,0 +1,31 @@
+#ifndef MEDIA_POOL_H
+#define MEDIA_POOL_H
+
+#include <libavcodec/packet.h>
+#include <libavutil/frame.h>
+
+/*
+ * Process-wide free-lists of AVPacket and AVFrame structs, so the per-frame
+ * encode, remux and pipeline paths recycle a fixed set of preallocated
+ * objects instead of calling av_packet_alloc()/av_frame_alloc() for every
+ * frame. The pool only recycles the structs, the data buffers stay
+ * ref-counted and are released by the put functions.
+ *
+ * Safe to call from any thread. Without media_pool_init(), or when the
+ * pool runs dry, get/put fall back to plain alloc/free.
+ */
+int media_pool_init(int nb_packets, int nb_frames);
+void media_pool_uninit(void);
+
+AVPacket *media_pool_get_packet(void);
+/* unrefs the packet, returns it to the pool and sets *pkt to NULL */
+void media_pool_put_packet(AVPacket **pkt);
+
+AVFrame *media_pool_get_frame(void);
+/* unrefs the frame, returns it to the pool and sets *frame to NULL */
+void media_pool_put_frame(AVFrame **frame);
+
+/* log how often the pool had to fall back to the allocator */
+void media_pool_log_stats(void);
+
+#endif /* MEDIA_POOL_H */
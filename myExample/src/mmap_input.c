@@ -0,0 +1,319 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <libavcodec/avcodec.h>
+#include <libavutil/avutil.h>
+#include <libavutil/buffer.h>
+#include <libavutil/intreadwrite.h>
+#include "mmap_input.h"
+
+#define IO_BUFFER_SIZE (64 * 1024)
+/* prefetch this far ahead of the reader */
+#define READAHEAD_SIZE (8 * 1024 * 1024)
+/* drop pages this far behind it; packets still in flight there are only
+ * faulted in again from the file, the data cannot change */
+#define RELEASE_LAG (64 * 1024 * 1024)
+
+struct MmapInput {
+    int fd;
+    AVBufferRef *map; /* the whole file, zero-copy packets hold a reference */
+    const uint8_t *data;
+    size_t size;
+    size_t page_size;
+
+    AVIOContext *avio;
+    size_t io_pos;
+    size_t jpeg_pos;
+
+    size_t advised;  /* MADV_WILLNEED was given up to here */
+    size_t released; /* pages below here were dropped */
+
+    int64_t nb_packets;
+    int64_t nb_copied;
+};
+
+static void unmap(void *opaque, uint8_t *data)
+{
+    munmap(data, (size_t)(uintptr_t)opaque);
+}
+
+/* readahead and release around the furthest position read so far */
+static void advise(MmapInput *in, size_t pos)
+{
+    size_t start, end;
+
+    if (pos + READAHEAD_SIZE / 2 > in->advised && in->advised < in->size) {
+        start = in->advised & ~(in->page_size - 1);
+        end = FFMIN(pos + READAHEAD_SIZE, in->size);
+        madvise((void *)(in->data + start), end - start, MADV_WILLNEED);
+        in->advised = end;
+    }
+
+    if (pos > in->released + 2 * RELEASE_LAG) {
+        end = (pos - RELEASE_LAG) & ~(in->page_size - 1);
+        madvise((void *)(in->data + in->released), end - in->released, MADV_DONTNEED);
+        posix_fadvise(in->fd, in->released, end - in->released, POSIX_FADV_DONTNEED);
+        in->released = end;
+    }
+}
+
+static int io_read(void *opaque, uint8_t *buf, int buf_size)
+{
+    MmapInput *in = opaque;
+    size_t n = FFMIN((size_t)buf_size, in->size - in->io_pos);
+
+    if (!n)
+        return AVERROR_EOF;
+    memcpy(buf, in->data + in->io_pos, n);
+    in->io_pos += n;
+    advise(in, in->io_pos);
+    return n;
+}
+
+static int64_t io_seek(void *opaque, int64_t offset, int whence)
+{
+    MmapInput *in = opaque;
+
+    switch (whence & ~AVSEEK_FORCE) {
+    case AVSEEK_SIZE:
+        return in->size;
+    case SEEK_SET:
+        break;
+    case SEEK_CUR:
+        offset += in->io_pos;
+        break;
+    case SEEK_END:
+        offset += in->size;
+        break;
+    default:
+        return AVERROR(EINVAL);
+    }
+    if (offset < 0 || (uint64_t)offset > in->size)
+        return AVERROR(EINVAL);
+    in->io_pos = offset;
+    /* demuxers that look at the end of the file first: restart the
+     * readahead where reading continues, keep dropped pages accounted */
+    in->advised = in->io_pos;
+    if (in->io_pos < in->released)
+        in->released = in->io_pos & ~(in->page_size - 1);
+    return offset;
+}
+
+int mmap_input_open(MmapInput **pin, const char *filename)
+{
+    MmapInput *in;
+    struct stat st;
+    uint8_t *io_buffer;
+    void *data;
+    int ret;
+
+    *pin = NULL;
+    in = av_mallocz(sizeof(*in));
+    if (!in)
+        return AVERROR(ENOMEM);
+    in->page_size = sysconf(_SC_PAGESIZE);
+
+    in->fd = open(filename, O_RDONLY | O_CLOEXEC);
+    if (in->fd < 0) {
+        ret = AVERROR(errno);
+        goto fail;
+    }
+    if (fstat(in->fd, &st) < 0) {
+        ret = AVERROR(errno);
+        goto fail;
+    }
+    if (!S_ISREG(st.st_mode) || !st.st_size || (uint64_t)st.st_size > SIZE_MAX) {
+        ret = AVERROR(EINVAL);
+        goto fail;
+    }
+    in->size = st.st_size;
+
+    /* e.g. ENOMEM for a multi-GB file in a 32-bit address space */
+    data = mmap(NULL, in->size, PROT_READ, MAP_PRIVATE, in->fd, 0);
+    if (data == MAP_FAILED) {
+        ret = AVERROR(errno);
+        goto fail;
+    }
+    in->map = av_buffer_create(data, in->size, unmap, (void *)(uintptr_t)in->size,
+                               AV_BUFFER_FLAG_READONLY);
+    if (!in->map) {
+        munmap(data, in->size);
+        ret = AVERROR(ENOMEM);
+        goto fail;
+    }
+    in->data = data;
+    madvise(data, in->size, MADV_SEQUENTIAL);
+    posix_fadvise(in->fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    advise(in, 0);
+
+    io_buffer = av_malloc(IO_BUFFER_SIZE);
+    if (!io_buffer) {
+        ret = AVERROR(ENOMEM);
+        goto fail;
+    }
+    in->avio = avio_alloc_context(io_buffer, IO_BUFFER_SIZE, 0, in, io_read, NULL, io_seek);
+    if (!in->avio) {
+        av_free(io_buffer);
+        ret = AVERROR(ENOMEM);
+        goto fail;
+    }
+
+    *pin = in;
+    return 0;
+fail:
+    *pin = in;
+    mmap_input_close(pin);
+    return ret;
+}
+
+void mmap_input_close(MmapInput **pin)
+{
+    MmapInput *in = *pin;
+
+    if (!in)
+        return;
+    if (in->nb_packets)
+        av_log(NULL, AV_LOG_VERBOSE, "mmap input: %"PRId64" packets, %"PRId64" copied\n",
+               in->nb_packets, in->nb_copied);
+    if (in->avio)
+        av_freep(&in->avio->buffer);
+    avio_context_free(&in->avio);
+    /* unmapped once the last packet referencing it is gone */
+    av_buffer_unref(&in->map);
+    if (in->fd >= 0)
+        close(in->fd);
+    av_freep(pin);
+}
+
+AVIOContext *mmap_input_avio(MmapInput *in)
+{
+    return in->avio;
+}
+
+/* Size of the JPEG image starting with SOI at data. Marker segments are
+ * skipped by their length, so the EOI of an EXIF thumbnail does not end the
+ * image early. A truncated image extends to the end of the data. */
+static size_t jpeg_image_size(const uint8_t *data, size_t size)
+{
+    size_t pos = 2;
+
+    while (pos + 2 <= size) {
+        int marker;
+
+        if (data[pos] != 0xff)
+            break;
+        marker = data[pos + 1];
+        if (marker == 0xff) {        /* fill byte */
+            pos++;
+            continue;
+        }
+        if (marker == 0xd9)          /* EOI */
+            return pos + 2;
+        if (marker == 0x01 || (marker >= 0xd0 && marker <= 0xd7)) {
+            pos += 2;                /* TEM and RSTn have no length */
+            continue;
+        }
+        if (pos + 4 > size || AV_RB16(data + pos + 2) < 2)
+            break;
+        pos += 2 + AV_RB16(data + pos + 2);
+        if (marker != 0xda)
+            continue;
+
+        /* SOS: entropy-coded data runs up to the next marker that is
+         * neither a stuffed 0xff00 nor a restart marker */
+        while (pos + 1 < size) {
+            const uint8_t *ff = memchr(data + pos, 0xff, size - pos - 1);
+            int next;
+
+            if (!ff) {
+                pos = size;
+                break;
+            }
+            pos = ff - data;
+            next = data[pos + 1];
+            if (next && (next < 0xd0 || next > 0xd7))
+                break;
+            pos += 2;
+        }
+    }
+    if (pos >= size)
+        return size;
+
+    /* not a well-formed marker sequence, settle for the next EOI */
+    for (; pos + 1 < size; pos++)
+        if (data[pos] == 0xff && data[pos + 1] == 0xd9)
+            return pos + 2;
+    return size;
+}
+
+static int is_zero(const uint8_t *buf, size_t size)
+{
+    return !buf[0] && !memcmp(buf, buf + 1, size - 1);
+}
+
+int mmap_input_read_jpeg(MmapInput *in, AVPacket *pkt)
+{
+    size_t start = in->jpeg_pos, len;
+    int ret;
+
+    /* skip anything between the images */
+    while (1) {
+        const uint8_t *ff;
+
+        if (start + 1 >= in->size)
+            return AVERROR_EOF;
+        ff = memchr(in->data + start, 0xff, in->size - start - 1);
+        if (!ff)
+            return AVERROR_EOF;
+        start = ff - in->data;
+        if (in->data[start + 1] == 0xd8)
+            break;
+        start++;
+    }
+    len = jpeg_image_size(in->data + start, in->size - start);
+    if (len > INT_MAX - AV_INPUT_BUFFER_PADDING_SIZE)
+        return AVERROR_INVALIDDATA;
+
+    /* libavcodec wants AV_INPUT_BUFFER_PADDING_SIZE zeroed bytes after the
+     * data, or a damaged image can be misparsed. The mapping only has them
+     * where the file is zero filled after the image (cameras padding their
+     * frames to a block size); otherwise the image is copied into a padded
+     * packet. */
+    if (start + len + AV_INPUT_BUFFER_PADDING_SIZE <= in->size &&
+        is_zero(in->data + start + len, AV_INPUT_BUFFER_PADDING_SIZE)) {
+        pkt->buf = av_buffer_ref(in->map);
+        if (!pkt->buf)
+            return AVERROR(ENOMEM);
+        pkt->data = (uint8_t *)in->data + start;
+        pkt->size = len;
+    } else {
+        if ((ret = av_new_packet(pkt, len)) < 0)
+            return ret;
+        memcpy(pkt->data, in->data + start, len);
+        in->nb_copied++;
+    }
+    pkt->flags |= AV_PKT_FLAG_KEY;
+    pkt->pos = start;
+
+    in->jpeg_pos = start + len;
+    in->nb_packets++;
+    advise(in, in->jpeg_pos);
+    return 0;
+}
+
+int mmap_input_seek_jpeg(MmapInput *in, int64_t pos)
+{
+    if (pos < 0 || pos >= in->size)
+        return AVERROR(EINVAL);
+    in->jpeg_pos = pos;
+    /* readahead starts over from there, nothing before it is needed again */
+    in->advised = FFMAX(in->advised, (size_t)pos);
+    in->released = FFMAX(in->released, pos & ~(in->page_size - 1));
+    advise(in, in->jpeg_pos);
+    return 0;
+}
@@ -0,0 +1,40 @@
+#ifndef MMAP_INPUT_H
+#define MMAP_INPUT_H
+
+#include <libavcodec/packet.h>
+#include <libavformat/avio.h>
+
+/*
+ * Input file read through one read-only mapping of the whole file instead
+ * of read() calls into the AVIOContext buffer. The kernel is told the
+ * access is sequential, pages ahead of the reader are prefetched and pages
+ * far behind it are dropped again, as archives are read only once.
+ *
+ * For raw MJPEG the images can also be cut straight out of the mapping:
+ * mmap_input_read_jpeg() returns packets that reference the mapped pages
+ * when the file has the zeroed padding libavcodec needs after an image, and
+ * copies the image otherwise. The mapping stays alive until the last such
+ * packet is freed, even after mmap_input_close().
+ *
+ * A MmapInput is used from one thread at a time.
+ */
+typedef struct MmapInput MmapInput;
+
+/* AVERROR(EINVAL) for anything but a regular, non-empty file */
+int mmap_input_open(MmapInput **pin, const char *filename);
+void mmap_input_close(MmapInput **pin);
+
+/* AVIOContext reading from the mapping, for avformat_open_input() with
+ * AVFMT_FLAG_CUSTOM_IO; owned by the MmapInput */
+AVIOContext *mmap_input_avio(MmapInput *in);
+
+/* Next JPEG image (SOI to EOI) after the previous one, independent of the
+ * AVIOContext position. Only the data, flags and pos fields are set.
+ * Returns AVERROR_EOF when no image is left. */
+int mmap_input_read_jpeg(MmapInput *in, AVPacket *pkt);
+
+/* Continue mmap_input_read_jpeg() at byte offset pos, the pos of an earlier
+ * packet, e.g. to resume a job. */
+int mmap_input_seek_jpeg(MmapInput *in, int64_t pos);
+
+#endif /* MMAP_INPUT_H */
@@ -0,0 +1,173 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <libavutil/avstring.h>
+#include <libavutil/avutil.h>
+#include <libavutil/hash.h>
+#include <libavutil/mem.h>
+#include "rate_control.h"
+
+/* hashing a whole archive would cost as much I/O as the first pass saves,
+ * the start, the end and blocks spread over the middle identify it */
+#define KEY_EDGE_SIZE (1 << 20)
+#define KEY_BLOCK_SIZE (64 << 10)
+#define KEY_NB_BLOCKS 16
+
+int rate_control_setup(AVCodecContext *enc_ctx, AVDictionary **opts,
+                       enum RateControlPass pass, const char *stats_in)
+{
+    int ret;
+
+    switch (pass) {
+    case RC_PASS_SINGLE:
+        return 0;
+    case RC_PASS_FIRST:
+        enc_ctx->flags |= AV_CODEC_FLAG_PASS1;
+        /* overrides the speed of the final encode */
+        return av_dict_set_int(opts, "cpu-used", RC_FIRST_PASS_CPU_USED, 0);
+    case RC_PASS_SECOND:
+        if (!stats_in)
+            return AVERROR(EINVAL);
+        enc_ctx->flags |= AV_CODEC_FLAG_PASS2;
+        enc_ctx->stats_in = (char *)stats_in;
+        /* alternate references are what the lookahead is for */
+        if ((ret = av_dict_set(opts, "auto-alt-ref", "1", AV_DICT_DONT_OVERWRITE)) < 0)
+            return ret;
+        return 0;
+    }
+    return AVERROR(EINVAL);
+}
+
+static int hash_file_range(struct AVHashContext *hash, int fd, uint8_t *buf,
+                           int64_t pos, int size)
+{
+    ssize_t n = pread(fd, buf, size, pos);
+
+    if (n < 0)
+        return AVERROR(errno);
+    av_hash_update(hash, buf, n);
+    return 0;
+}
+
+int rate_control_key(const char *in_filename, const char *settings, char **key)
+{
+    struct AVHashContext *hash = NULL;
+    uint8_t hex[2 * AV_HASH_MAX_SIZE + 1];
+    uint8_t *buf = NULL;
+    struct stat st;
+    char *header;
+    int fd, ret;
+
+    fd = open(in_filename, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return AVERROR(errno);
+    if (fstat(fd, &st) < 0) {
+        ret = AVERROR(errno);
+        goto end;
+    }
+    if ((ret = av_hash_alloc(&hash, "SHA256")) < 0)
+        goto end;
+    buf = av_malloc(KEY_EDGE_SIZE);
+    header = av_asprintf("size=%"PRId64" %s %s\n", (int64_t)st.st_size, av_version_info(), settings);
+    if (!buf || !header) {
+        av_free(header);
+        ret = AVERROR(ENOMEM);
+        goto end;
+    }
+    av_hash_init(hash);
+    av_hash_update(hash, (const uint8_t *)header, strlen(header));
+    av_free(header);
+
+    ret = hash_file_range(hash, fd, buf, 0, KEY_EDGE_SIZE);
+    for (int i = 1; ret >= 0 && i <= KEY_NB_BLOCKS; i++)
+        ret = hash_file_range(hash, fd, buf, st.st_size / (KEY_NB_BLOCKS + 1) * i, KEY_BLOCK_SIZE);
+    if (ret >= 0)
+        ret = hash_file_range(hash, fd, buf, FFMAX(st.st_size - KEY_EDGE_SIZE, 0), KEY_EDGE_SIZE);
+    if (ret < 0)
+        goto end;
+
+    av_hash_final_hex(hash, hex, sizeof(hex));
+    if (!(*key = av_strdup((const char *)hex)))
+        ret = AVERROR(ENOMEM);
+end:
+    av_hash_freep(&hash);
+    av_free(buf);
+    close(fd);
+    return ret;
+}
+
+static char *stats_filename(const char *dir, const char *key)
+{
+    return av_asprintf("%s/%s.vp9stats", dir, key);
+}
+
+int rate_control_load_stats(const char *dir, const char *key, char **stats)
+{
+    char *filename = stats_filename(dir, key);
+    struct stat st;
+    size_t size;
+    FILE *f;
+    int ret = 0;
+
+    if (!filename)
+        return AVERROR(ENOMEM);
+    f = fopen(filename, "r");
+    av_free(filename);
+    if (!f)
+        return AVERROR(errno);
+    if (fstat(fileno(f), &st) < 0) {
+        ret = AVERROR(errno);
+    } else if (!st.st_size) {
+        ret = AVERROR_INVALIDDATA;
+    } else if (!(*stats = av_malloc(st.st_size + 1))) {
+        ret = AVERROR(ENOMEM);
+    } else {
+        size = fread(*stats, 1, st.st_size, f);
+        (*stats)[size] = '\0';
+        if (size != st.st_size) {
+            av_freep(stats);
+            ret = AVERROR(EIO);
+        }
+    }
+    fclose(f);
+    return ret;
+}
+
+int rate_control_store_stats(const char *dir, const char *key, const char *stats)
+{
+    char *filename = stats_filename(dir, key);
+    /* unique, two jobs of the same input may store at once */
+    char *tmp_filename = av_asprintf("%s/.%s.XXXXXX", dir, key);
+    size_t len = strlen(stats);
+    ssize_t written;
+    int fd = -1, ret = 0;
+
+    if (!filename || !tmp_filename) {
+        ret = AVERROR(ENOMEM);
+        goto end;
+    }
+    if ((fd = mkstemp(tmp_filename)) < 0) {
+        ret = AVERROR(errno);
+        goto end;
+    }
+    written = write(fd, stats, len);
+    if (written < 0 || fsync(fd) < 0)
+        ret = AVERROR(errno);
+    else if (written != len)
+        ret = AVERROR(EIO);
+    if (close(fd) < 0 && !ret)
+        ret = AVERROR(errno);
+    if (!ret && rename(tmp_filename, filename) < 0)
+        ret = AVERROR(errno);
+    if (ret < 0)
+        unlink(tmp_filename);
+end:
+    av_free(tmp_filename);
+    av_free(filename);
+    return ret;
+}
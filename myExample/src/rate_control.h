@@ -0,0 +1,42 @@
+#ifndef RATE_CONTROL_H
+#define RATE_CONTROL_H
+
+#include <libavcodec/avcodec.h>
+#include <libavutil/dict.h>
+
+/*
+ * libvpx-vp9 two-pass encoding. The first pass only analyses the video and
+ * leaves libvpx's per-frame statistics in enc_ctx->stats_out, the second
+ * pass spends the bitrate where those say the content needs it, with the
+ * lookahead (lag-in-frames) used for alternate reference frames.
+ *
+ * The statistics can be kept in a cache directory as <key>.vp9stats, the
+ * key is a hash of the input and the settings of the encode, so encoding
+ * the same input again (another ladder, a retried job) skips the first pass.
+ */
+enum RateControlPass {
+    RC_PASS_SINGLE,
+    RC_PASS_FIRST,
+    RC_PASS_SECOND,
+};
+
+/* libvpx-vp9 speed of the first pass, it only needs motion estimates */
+#define RC_FIRST_PASS_CPU_USED 4
+
+/* Set up an encoder for the pass before avcodec_open2(). stats_in is used
+ * by the second pass and must outlive enc_ctx, libavcodec does not free it. */
+int rate_control_setup(AVCodecContext *enc_ctx, AVDictionary **opts,
+                       enum RateControlPass pass, const char *stats_in);
+
+/* Hex key of the input (its size and samples of its contents) and of
+ * settings, the text of everything else the statistics depend on. */
+int rate_control_key(const char *in_filename, const char *settings, char **key);
+
+/* AVERROR(ENOENT) when dir has no statistics for key */
+int rate_control_load_stats(const char *dir, const char *key, char **stats);
+
+/* Written to a temporary file and renamed, so concurrent jobs of the same
+ * input never read a partial file. */
+int rate_control_store_stats(const char *dir, const char *key, const char *stats);
+
+#endif /* RATE_CONTROL_H */
@@ -0,0 +1,303 @@
+#include <dirent.h>
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <libavutil/avstring.h>
+#include <libavutil/avutil.h>
+#include <libavutil/cpu.h>
+#include <libavutil/mem.h>
+#include "async_writer.h"
+#include "frame_queue.h"
+#include "spool_daemon.h"
+
+#define JOB_SUFFIX ".job"
+#define RUNNING_SUFFIX ".running"
+/* how often the spool directory is scanned for new jobs */
+#define SPOOL_POLL_US 1000000
+
+typedef struct SpoolDaemon {
+    const char *dir;
+    const TranscodeParams *defaults;
+    int job_cores;     /* cores given to every job */
+    FrameQueue job_q;  /* char*, path of a claimed .running file */
+    atomic_int nb_claimed; /* claimed and not finished yet */
+} SpoolDaemon;
+
+typedef struct SpoolWorker {
+    SpoolDaemon *d;
+    pthread_t thread;
+} SpoolWorker;
+
+static volatile sig_atomic_t stop_requested;
+
+static void on_stop_signal(int sig)
+{
+    (void)sig;
+    stop_requested = 1;
+}
+
+static void free_path_item(void **item)
+{
+    av_freep(item);
+}
+
+static int has_suffix(const char *name, const char *suffix)
+{
+    size_t len = strlen(name), slen = strlen(suffix);
+    return len > slen && !strcmp(name + len - slen, suffix);
+}
+
+static int is_job_file(const struct dirent *entry)
+{
+    return entry->d_name[0] != '.' && has_suffix(entry->d_name, JOB_SUFFIX);
+}
+
+/* fill params from a job file, strings are owned by the caller */
+static int parse_job_file(const char *path, TranscodeParams *params,
+                          char **in_filename, char **out_filename,
+                          AVDictionary **encoder_opts)
+{
+    char line[4096];
+    FILE *f;
+    int ret = 0;
+
+    f = fopen(path, "r");
+    if (!f)
+        return AVERROR(errno);
+
+    while (ret >= 0 && fgets(line, sizeof(line), f)) {
+        char *key = line + strspn(line, " \t");
+        char *value, *end;
+
+        if (*key == '#' || *key == '\n' || !*key)
+            continue;
+        value = key + strcspn(key, " \t\n");
+        if (*value)
+            *value++ = '\0';
+        value += strspn(value, " \t");
+        end = value + strlen(value);
+        while (end > value && (end[-1] == '\n' || end[-1] == '\r' ||
+                               end[-1] == ' ' || end[-1] == '\t'))
+            *--end = '\0';
+
+        if (!strcmp(key, "input")) {
+            av_freep(in_filename);
+            if (!(*in_filename = av_strdup(value)))
+                ret = AVERROR(ENOMEM);
+            params->in_filename = *in_filename;
+        } else if (!strcmp(key, "output")) {
+            av_freep(out_filename);
+            if (!(*out_filename = av_strdup(value)))
+                ret = AVERROR(ENOMEM);
+            params->out_filename = *out_filename;
+        } else if (!strcmp(key, "chunks")) {
+            params->nb_chunk_encoders = atoi(value);
+        } else if (!strcmp(key, "chunk_seconds")) {
+            params->chunk_seconds = strtod(value, NULL);
+        } else if (!strcmp(key, "keep_chroma")) {
+            params->keep_chroma = atoi(value);
+        } else if (!strcmp(key, "sync")) {
+            if ((ret = async_writer_parse_sync(value)) >= 0)
+                params->output_sync = ret;
+        } else if (!strcmp(key, "fast_start")) {
+            params->fast_start = atoi(value);
+        } else if (!strcmp(key, "segment_seconds")) {
+            params->segment_seconds = strtod(value, NULL);
+        } else if (!strcmp(key, "checkpoint")) {
+            params->checkpoint = atoi(value);
+        } else if (!strcmp(key, "two_pass")) {
+            params->two_pass = atoi(value);
+        } else if (!strcmp(key, "dedup")) {
+            params->dedup_threshold = atoi(value);
+        } else if (!strcmp(key, "renditions")) {
+            ret = transcode_parse_renditions(params, value);
+        } else if (!strcmp(key, "options")) {
+            ret = av_dict_parse_string(encoder_opts, value, "=", ":", 0);
+        } else {
+            av_log(NULL, AV_LOG_ERROR, "%s: unknown key '%s'\n", path, key);
+            ret = AVERROR(EINVAL);
+        }
+    }
+    fclose(f);
+
+    if (ret >= 0 && (!*in_filename || !*out_filename)) {
+        av_log(NULL, AV_LOG_ERROR, "%s: input and output are required\n", path);
+        ret = AVERROR(EINVAL);
+    }
+    if (ret >= 0 && params->chunk_seconds <= 0)
+        ret = AVERROR(EINVAL);
+    if (ret >= 0 && params->dedup_threshold > 255) {
+        av_log(NULL, AV_LOG_ERROR, "%s: dedup must be at most 255\n", path);
+        ret = AVERROR(EINVAL);
+    }
+    return ret;
+}
+
+/* rename <name>.running to <name>.<state> */
+static void finish_job_file(const char *running_path, const char *state)
+{
+    size_t base_len = strlen(running_path) - strlen(RUNNING_SUFFIX);
+    char *final_path = av_asprintf("%.*s.%s", (int)base_len, running_path, state);
+
+    if (!final_path || rename(running_path, final_path) < 0)
+        av_log(NULL, AV_LOG_ERROR, "Cannot mark %s as %s\n", running_path, state);
+    av_free(final_path);
+}
+
+static int run_job(SpoolDaemon *d, const char *path)
+{
+    TranscodeParams params = *d->defaults;
+    AVDictionary *encoder_opts = NULL;
+    char *in_filename = NULL, *out_filename = NULL;
+    int ret;
+
+    params.in_filename = NULL;
+    params.out_filename = NULL;
+    params.nb_cores = d->job_cores;
+
+    /* job options are applied on top of the daemon's -x options */
+    ret = av_dict_copy(&encoder_opts, d->defaults->encoder_opts, 0);
+    if (ret >= 0)
+        ret = parse_job_file(path, &params, &in_filename, &out_filename, &encoder_opts);
+    if (ret < 0) {
+        av_log(NULL, AV_LOG_ERROR, "Invalid job file %s: %s\n", path, av_err2str(ret));
+        goto end;
+    }
+    params.encoder_opts = encoder_opts;
+
+    av_log(NULL, AV_LOG_INFO, "Job %s: %s -> %s on %d cores\n",
+           path, params.in_filename, params.out_filename, params.nb_cores);
+    ret = transcode_run(&params);
+
+end:
+    av_dict_free(&encoder_opts);
+    av_free(in_filename);
+    av_free(out_filename);
+    return ret;
+}
+
+static void *spool_worker_thread(void *arg)
+{
+    SpoolWorker *w = arg;
+    SpoolDaemon *d = w->d;
+    char *path;
+
+    while (frame_queue_pop(&d->job_q, (void **)&path) >= 0) {
+        int ret = run_job(d, path);
+
+        finish_job_file(path, ret < 0 ? "failed" : "done");
+        av_log(NULL, AV_LOG_INFO, "Job %s %s\n", path, ret < 0 ? "failed" : "done");
+        av_free(path);
+        atomic_fetch_sub(&d->nb_claimed, 1);
+    }
+    return NULL;
+}
+
+/* claim new jobs while there is an idle worker for them */
+static int scan_spool(SpoolDaemon *d, int nb_workers)
+{
+    struct dirent **entries;
+    int nb_entries, i, ret = 0;
+
+    nb_entries = scandir(d->dir, &entries, is_job_file, alphasort);
+    if (nb_entries < 0) {
+        ret = AVERROR(errno);
+        av_log(NULL, AV_LOG_ERROR, "Cannot read spool directory %s\n", d->dir);
+        return ret;
+    }
+
+    for (i = 0; i < nb_entries; i++) {
+        const char *name = entries[i]->d_name;
+        char *job_path, *running_path;
+
+        if (ret < 0 || atomic_load(&d->nb_claimed) >= nb_workers)
+            goto next;
+
+        job_path = av_asprintf("%s/%s", d->dir, name);
+        running_path = av_asprintf("%s/%.*s" RUNNING_SUFFIX, d->dir,
+                                   (int)(strlen(name) - strlen(JOB_SUFFIX)), name);
+        if (!job_path || !running_path) {
+            ret = AVERROR(ENOMEM);
+        } else if (rename(job_path, running_path) < 0) {
+            /* another daemon on the same spool got there first */
+            av_freep(&running_path);
+        } else {
+            atomic_fetch_add(&d->nb_claimed, 1);
+            if ((ret = frame_queue_push(&d->job_q, running_path)) >= 0) {
+                running_path = NULL;
+            } else {
+                /* unclaim it, so this or another daemon picks it up again */
+                if (rename(running_path, job_path) < 0)
+                    av_log(NULL, AV_LOG_ERROR, "Cannot give back job %s, stranded as %s\n",
+                           job_path, running_path);
+                atomic_fetch_sub(&d->nb_claimed, 1);
+            }
+        }
+        av_free(job_path);
+        av_free(running_path);
+next:
+        free(entries[i]);
+    }
+    free(entries);
+    return ret;
+}
+
+int spool_daemon_run(const char *spool_dir, int nb_workers,
+                     const TranscodeParams *defaults)
+{
+    SpoolDaemon d = { 0 };
+    SpoolWorker *workers = NULL;
+    struct sigaction sa = { 0 };
+    int nb_started = 0, i, ret;
+
+    d.dir = spool_dir;
+    d.defaults = defaults;
+    d.job_cores = defaults->nb_cores > 0 ? defaults->nb_cores
+                                         : FFMAX(av_cpu_count() / nb_workers, 1);
+    atomic_init(&d.nb_claimed, 0);
+
+    sa.sa_handler = on_stop_signal;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+
+    if ((ret = frame_queue_init(&d.job_q, nb_workers)) < 0)
+        return ret;
+    workers = av_calloc(nb_workers, sizeof(*workers));
+    if (!workers) {
+        ret = AVERROR(ENOMEM);
+        goto end;
+    }
+    for (i = 0; i < nb_workers; i++) {
+        workers[i].d = &d;
+        if (pthread_create(&workers[i].thread, NULL, spool_worker_thread, &workers[i])) {
+            ret = AVERROR(EAGAIN);
+            goto end;
+        }
+        nb_started++;
+    }
+
+    av_log(NULL, AV_LOG_INFO, "Watching %s, %d jobs at once, %d cores per job\n",
+           spool_dir, nb_workers, d.job_cores);
+    while (!stop_requested) {
+        if ((ret = scan_spool(&d, nb_workers)) < 0)
+            break;
+        usleep(SPOOL_POLL_US);
+    }
+    if (stop_requested)
+        av_log(NULL, AV_LOG_INFO, "Stopping, waiting for %d running jobs\n",
+               atomic_load(&d.nb_claimed));
+
+end:
+    frame_queue_finish(&d.job_q);
+    for (i = 0; i < nb_started; i++)
+        pthread_join(workers[i].thread, NULL);
+    av_free(workers);
+    frame_queue_destroy(&d.job_q, free_path_item);
+    return ret;
+}
@@ -0,0 +1,33 @@
+#ifndef SPOOL_DAEMON_H
+#define SPOOL_DAEMON_H
+
+#include "transcode.h"
+
+/*
+ * Daemon mode: watch spool_dir for "<name>.job" files and run up to
+ * nb_workers of them at once, each on its share of the CPU cores.
+ *
+ * A job file holds "key value" lines, '#' starts a comment:
+ *   input <file>
+ *   output <file>
+ *   chunks <encoders>
+ *   chunk_seconds <seconds>
+ *   keep_chroma <0|1>
+ *   sync <none|close|buffer>
+ *   fast_start <0|1>
+ *   segment_seconds <seconds>
+ *   checkpoint <0|1>
+ *   two_pass <0|1>
+ *   dedup <luma levels, 0-255>
+ *   renditions <WxH[@bitrate],...>
+ *   options <key=value[:key=value...]>
+ * Missing keys are taken from defaults. A job is claimed by renaming it to
+ * "<name>.running" and ends up as "<name>.done" or "<name>.failed", so
+ * several daemons can share one spool directory.
+ *
+ * Runs until SIGINT or SIGTERM, then finishes the running jobs.
+ */
+int spool_daemon_run(const char *spool_dir, int nb_workers,
+                     const TranscodeParams *defaults);
+
+#endif /* SPOOL_DAEMON_H */
@@ -35,74 +35,274 @@
 #include <libavformat/avformat.h>
 #include <libavfilter/buffersink.h>
 #include <libavfilter/buffersrc.h>
+#include <libavutil/avstring.h>
+#include <libavutil/bprint.h>
 #include <libavutil/channel_layout.h>
+#include <libavutil/cpu.h>
+#include <libavutil/imgutils.h>
 #include <libavutil/opt.h>
+#include <libavutil/parseutils.h>
 #include <libavutil/pixdesc.h>
+#include <libavutil/time.h>
+#include <libavutil/timestamp.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "async_log.h"
+#include "async_writer.h"
+#include "checkpoint.h"
+#include "decode_pool.h"
+#include "frame_dedup.h"
+#include "frame_queue.h"
+#include "keyframe_index.h"
+#include "media_pool.h"
+#include "mmap_input.h"
+#include "rate_control.h"
+#include "spool_daemon.h"
+#include "transcode.h"
+#include "video_debugging.h"
+#include "vp9_tuning.h"
+#include "yuv_convert.h"
+
+/* depth of every inter-stage queue, in frames or packets */
+#define PIPELINE_QUEUE_SIZE 8
+/* preallocated AVPacket/AVFrame structs, enough for all queues to be full */
+#define MEDIA_POOL_PACKETS 64
+#define MEDIA_POOL_FRAMES 64
+/* upper bound for decoder threads or frame-parallel decoders */
+#define MAX_DECODE_THREADS 16
+/* live mode: WebM clusters are written out once they hold this many bytes */
+#define LIVE_CLUSTER_SIZE 32768
+/* default length of one independently encoded chunk in chunked mode */
+#define DEFAULT_CHUNK_SECONDS 5
+/* live mode: ingest to mux latency above this is reported as a warning */
+#define DEFAULT_LATENCY_BUDGET_MS 500
+/* how often the -s stats line is written */
+#define DEFAULT_STATS_INTERVAL_MS 1000
+/* with params->dedup_threshold, the longest a kept frame stands in for static ones */
+#define DEDUP_MAX_GAP_SECONDS 1
 
-static AVFormatContext *ifmt_ctx;
-static AVFormatContext *ofmt_ctx;
 typedef struct FilteringContext {
-    AVFilterContext *buffersink_ctx;
+    /* one sink per output, a ladder splits and scales in the graph */
+    AVFilterContext *buffersink_ctx[TRANSCODE_MAX_RENDITIONS];
+    int nb_sinks;
     AVFilterContext *buffersrc_ctx;
     AVFilterGraph *filter_graph;
 
-    AVPacket *enc_pkt;
-    AVFrame *filtered_frame;
+    /* the graph would not change the frames, they go to the encoder as they are */
+    int passthrough;
+    /* a "null" graph that would only do 4:2:2 -> 4:2:0, yuv_convert_frame()
+     * does it in place on the decoder's frame instead */
+    int convert;
+    /* yuv420p buffers for frames the decoder still references, see convert_frame() */
+    AVBufferPool *convert_pool;
+    int convert_pool_size;
+    /* pixel data accounting between decoder and encoder, filter thread only */
+    int64_t nb_frames;
+    int64_t copied_bytes;    /* same format, new buffer */
+    int64_t converted_bytes; /* pixel format or size changed */
 } FilteringContext;
-static FilteringContext *filter_ctx;
+
+/* How an input stream gets into the outputs. */
+enum StreamMode {
+    STREAM_DROP,      /* the output format cannot carry it */
+    STREAM_COPY,      /* packets are remuxed as they are */
+    STREAM_TRANSCODE, /* video to VP9, audio to Opus or Vorbis */
+};
 
 typedef struct StreamContext {
+    enum StreamMode mode;
+    int out_index; /* stream index in every output, -1 when dropped */
+
+    /* NULL unless transcoded */
     AVCodecContext *dec_ctx;
-    AVCodecContext *enc_ctx;
 
-    AVFrame *dec_frame;
+    /* frame-parallel decoding when dec_ctx cannot thread by itself,
+     * dec_ctx then only describes the stream */
+    DecodePool *dec_pool;
+
+    /* video with params->dedup_threshold >= 0: repeated packets are dropped
+     * by the decode stage (intra-only codecs), static frames by the filter stage */
+    FrameDedup *packet_dedup;
+    FrameDedup *frame_dedup;
 } StreamContext;
-static StreamContext *stream_ctx;
-StreamContext *stream;
-AVPacket *packet = NULL;
 
-static int open_input_file(const char *filename)
+/* One output file with its own encoders, a rendition of the ladder. */
+typedef struct OutputFile {
+    char *filename;
+    int width, height;          /* video size of the rendition, 0 = as decoded */
+    AVDictionary *encoder_opts; /* params->encoder_opts, plus the rendition's bitrate */
+    int nb_cores;               /* share of the job's cores for the video encoders */
+
+    AVFormatContext *ofmt_ctx;
+    AVCodecContext **enc_ctx;   /* per input stream, NULL unless transcoded */
+    /* ofmt_ctx->pb is an async_writer.h context */
+    int async_output;
+} OutputFile;
+
+/* first input packet of a segment */
+typedef struct SegmentStart {
+    int64_t segment;
+    int64_t pos;   /* byte offset in the input, -1 if unknown */
+    int64_t pts;   /* input stream time base, before the resume offset */
+    int64_t frame; /* input frames before it */
+} SegmentStart;
+
+/*
+ * Segmented output with params->checkpoint. The demuxer notes where every
+ * segment starts in the input; when the segment muxer closes a segment file
+ * the manifest and <manifest>.ckpt are rewritten from that. A resumed job
+ * seeks the input to the first missing segment and shifts the timestamps by
+ * the time before it, so segments are cut and numbered as in the first run.
+ */
+typedef struct JobCheckpoint {
+    char *filename;
+    Checkpoint ckpt;           /* completed segments, segment close only */
+    int stream_index;          /* the input video stream, the only one mapped */
+    int64_t resume_segment;    /* first segment of this run */
+    int64_t resume_pts;        /* earlier input packets are dropped */
+    int64_t resume_offset;     /* subtracted from the input timestamps */
+
+    pthread_mutex_t lock;      /* the fields below, demuxer vs. segment close */
+    SegmentStart *starts;      /* segments of this run, in order */
+    int nb_starts;
+    int64_t nb_frames;         /* input video packets so far */
+    int64_t input_end;         /* end of the last one, input time base */
+} JobCheckpoint;
+
+/* Everything one transcode owns, so several can run in one process. */
+typedef struct TranscodeJob {
+    const TranscodeParams *params;
+    int nb_cores; /* resolved params->nb_cores */
+
+    AVFormatContext *ifmt_ctx;
+    StreamContext *stream_ctx;   /* per input stream */
+    FilteringContext *filter_ctx; /* per input stream, used when transcoded */
+    OutputFile outputs[TRANSCODE_MAX_RENDITIONS];
+    int nb_outputs;
+
+    /* regular input files are mapped, ifmt_ctx reads through the mapping */
+    MmapInput *mmap_in;
+    /* raw MJPEG: packets are cut from the mapping instead of av_read_frame() */
+    int mmap_packets;
+    int64_t nb_mmap_packets;
+
+    JobCheckpoint *checkpoint; /* NULL unless params->checkpoint */
+
+    /* with params->two_pass the job runs twice, the first pass only encodes
+     * the video to a null output for the statistics of each output's encoder */
+    enum RateControlPass pass;
+    char **pass_stats;         /* per output, written by the first pass */
+} TranscodeJob;
+
+/*
+ * Demux, decode, filter, encode and mux each run on their own thread and
+ * hand ref-counted packets/frames to the next stage through a FrameQueue:
+ *
+ *   demux -> demux_q -> decode -> decode_q -> filter -> filter_q -> encode -> mux_q -> mux
+ *
+ * Every transcoded stream has its own decode and filter thread, and one
+ * encode thread per output, so audio never waits for the video encoder.
+ * Copied streams go from the demuxer straight to the mux_q of every
+ * output. With a ladder the filter thread feeds one filter_q per output,
+ * so the input is decoded once and the renditions are encoded in parallel.
+ *
+ * Every stage owns the libav context it works on, so no context is shared
+ * between threads. The first stage that fails stores its error and aborts
+ * all queues, which unblocks and stops the other stages.
+ */
+typedef struct Pipeline Pipeline;
+
+typedef struct PipelineStream {
+    Pipeline *p;
+    int index;           /* input stream */
+    FrameQueue demux_q;  /* AVPacket*, demuxed */
+    FrameQueue decode_q; /* AVFrame*, decoded */
+} PipelineStream;
+
+typedef struct PipelineOutput {
+    Pipeline *p;
+    OutputFile *of;
+    FrameQueue mux_q;         /* AVPacket*, encoded or copied, in packet time base */
+    atomic_int nb_producers;  /* threads still pushing to mux_q, the last one finishes it */
+
+    /* live mode, ingest to mux latency of the frames written so far (us),
+     * only touched by the mux thread */
+    int64_t nb_latency;
+    int64_t latency_sum;
+    int64_t latency_max;
+    int64_t nb_over_budget;
+} PipelineOutput;
+
+/* one transcoded stream of one output */
+typedef struct PipelineEncoder {
+    PipelineOutput *po;
+    int index;           /* input stream */
+    FrameQueue filter_q; /* AVFrame*, filtered */
+
+    /* segment the last keyframe was forced for, encode thread only */
+    int64_t segment_index;
+} PipelineEncoder;
+
+struct Pipeline {
+    PipelineStream *streams;   /* per input stream, queues of transcoded ones only */
+    int nb_streams;
+    PipelineOutput outputs[TRANSCODE_MAX_RENDITIONS];
+    int nb_outputs;
+    PipelineEncoder *encoders; /* [output * nb_streams + stream] */
+
+    TranscodeJob *job;
+    atomic_int error;
+    StageStats *stats; /* NULL unless stats were requested */
+};
+
+/* av_read_frame(), or the next image of a mapped raw MJPEG file */
+static int read_input_packet(TranscodeJob *job, AVPacket *pkt)
 {
+    AVStream *st = job->ifmt_ctx->streams[0];
+    AVRational frame_dur;
     int ret;
 
-    ifmt_ctx = NULL;
-    if ((ret = avformat_open_input(&ifmt_ctx, filename, NULL, NULL)) < 0) {
-        av_log(NULL, AV_LOG_ERROR, "Cannot open input file\n");
-        return ret;
-    }
+    if (!job->mmap_packets)
+        return av_read_frame(job->ifmt_ctx, pkt);
 
-    if ((ret = avformat_find_stream_info(ifmt_ctx, NULL)) < 0) {
-        av_log(NULL, AV_LOG_ERROR, "Cannot find stream information\n");
+    if ((ret = mmap_input_read_jpeg(job->mmap_in, pkt)) < 0)
         return ret;
-    }
-
-    const int stream_mapping_size = ifmt_ctx->nb_streams; //should be 1
-    if(stream_mapping_size!= 1){
-        fprintf(stderr, "err Too much streams in inFile\n");
-        ret = AVERROR_UNKNOWN;
-        return AVERROR(ret);
-    }
-
-    stream_ctx = av_calloc(ifmt_ctx->nb_streams, sizeof(*stream_ctx));
-    if (!stream_ctx)
-        return AVERROR(ENOMEM);
+    /* timestamps as the raw demuxer makes them, from the frame rate */
+    frame_dur = av_inv_q(job->stream_ctx[0].dec_ctx->framerate);
+    pkt->stream_index = 0;
+    pkt->pts = pkt->dts = av_rescale_q(job->nb_mmap_packets++, frame_dur, st->time_base);
+    pkt->duration = av_rescale_q(1, frame_dur, st->time_base);
+    return 0;
+}
 
-    AVStream *stream = ifmt_ctx->streams[0];
+/* Allocate and open a decoder for one input stream. Every chunk worker gets
+ * its own, so this must not touch the demuxer state. nb_threads = 0 lets
+ * libavcodec use all cores. */
+static int open_decoder(AVStream *stream, AVRational framerate, int nb_threads,
+                        AVCodecContext **pdec_ctx)
+{
     const AVCodec *dec = avcodec_find_decoder(stream->codecpar->codec_id);
     AVCodecContext *codec_ctx;
+    int ret;
+
     if (!dec) {
-        av_log(NULL, AV_LOG_ERROR, "Failed to find decoder for stream #%u\n", 0);
+        av_log(NULL, AV_LOG_ERROR, "Failed to find decoder for stream #%u\n", stream->index);
         return AVERROR_DECODER_NOT_FOUND;
     }
     codec_ctx = avcodec_alloc_context3(dec);
     if (!codec_ctx) {
-        av_log(NULL, AV_LOG_ERROR, "Failed to allocate the decoder context for stream #%u\n", 0);
+        av_log(NULL, AV_LOG_ERROR, "Failed to allocate the decoder context for stream #%u\n", stream->index);
         return AVERROR(ENOMEM);
     }
     ret = avcodec_parameters_to_context(codec_ctx, stream->codecpar);
     if (ret < 0) {
         av_log(NULL, AV_LOG_ERROR, "Failed to copy decoder parameters to input decoder context "
-                                   "for stream #%u\n", 0);
+                                   "for stream #%u\n", stream->index);
+        avcodec_free_context(&codec_ctx);
         return ret;
     }
 
@@ -110,128 +310,645 @@ static int open_input_file(const char *filename)
      * This is highly recommended, but not mandatory. */
     codec_ctx->pkt_timebase = stream->time_base;
 
+    /* frame threads where the decoder has them, slice threads otherwise */
+    codec_ctx->thread_count = nb_threads;
+    codec_ctx->thread_type = FF_THREAD_FRAME | FF_THREAD_SLICE;
+    /* hand the live arrival time of a packet on to its frame */
+    codec_ctx->flags |= AV_CODEC_FLAG_COPY_OPAQUE;
+
     /* Reencode video & audio and remux subtitles etc. */
     if (codec_ctx->codec_type == AVMEDIA_TYPE_VIDEO
         || codec_ctx->codec_type == AVMEDIA_TYPE_AUDIO) {
         if (codec_ctx->codec_type == AVMEDIA_TYPE_VIDEO)
-            codec_ctx->framerate = av_guess_frame_rate(ifmt_ctx, stream, NULL);
+            codec_ctx->framerate = framerate;
         /* Open decoder */
         ret = avcodec_open2(codec_ctx, dec, NULL);
         if (ret < 0) {
-            av_log(NULL, AV_LOG_ERROR, "Failed to open decoder for stream #%u\n", 0);
+            av_log(NULL, AV_LOG_ERROR, "Failed to open decoder for stream #%u\n", stream->index);
+            avcodec_free_context(&codec_ctx);
+            return ret;
+        }
+    }
+
+    *pdec_ctx = codec_ctx;
+    return 0;
+}
+
+/* the muxer of every output: WebM, unless the output is named otherwise */
+static const AVOutputFormat *output_format(const TranscodeParams *params)
+{
+    const AVOutputFormat *ofmt = NULL;
+
+    if (params->segment_seconds <= 0 && strcmp(params->out_filename, "-"))
+        ofmt = av_guess_format(NULL, params->out_filename, NULL);
+    return ofmt ? ofmt : av_guess_format("webm", NULL, NULL);
+}
+
+/* Video is always encoded to VP9. Audio the output can carry (Opus, Vorbis
+ * for WebM) and other streams it can carry (WebVTT) are copied, other
+ * audio is transcoded and anything else dropped. */
+static enum StreamMode pick_stream_mode(const AVOutputFormat *ofmt, const AVStream *stream)
+{
+    enum AVMediaType type = stream->codecpar->codec_type;
+    int supported = avformat_query_codec(ofmt, stream->codecpar->codec_id,
+                                         FF_COMPLIANCE_NORMAL) == 1;
+
+    if (stream->disposition & AV_DISPOSITION_ATTACHED_PIC)
+        return STREAM_DROP;
+    if (type == AVMEDIA_TYPE_VIDEO)
+        return STREAM_TRANSCODE;
+    if (type == AVMEDIA_TYPE_AUDIO)
+        return supported ? STREAM_COPY : STREAM_TRANSCODE;
+    return supported ? STREAM_COPY : STREAM_DROP;
+}
+
+static int open_decode_pool(StreamContext *sc, AVStream *stream, int nb_threads)
+{
+    AVCodecContext *dec_ctx = sc->dec_ctx;
+    int ret = 0;
+
+    if (nb_threads > 1 && decode_pool_supported(dec_ctx->codec)) {
+        /* e.g. MJPEG: no frame threads, but every packet decodes on its own */
+        AVCodecContext *pool_ctxs[MAX_DECODE_THREADS] = { NULL };
+
+        for (int i = 0; i < nb_threads; i++) {
+            ret = open_decoder(stream, dec_ctx->framerate, 1, &pool_ctxs[i]);
+            if (ret < 0)
+                break;
+        }
+        if (ret >= 0)
+            ret = decode_pool_alloc(&sc->dec_pool, pool_ctxs, nb_threads);
+        for (int i = 0; i < nb_threads; i++)
+            avcodec_free_context(&pool_ctxs[i]);
+        if (ret < 0)
             return ret;
+        av_log(NULL, AV_LOG_INFO, "Decoding stream #%u on %d frame-parallel %s decoders\n",
+               stream->index, nb_threads, dec_ctx->codec->name);
+    } else {
+        av_log(NULL, AV_LOG_INFO, "Decoding stream #%u with %d %s threads\n", stream->index,
+               dec_ctx->thread_count,
+               dec_ctx->active_thread_type == FF_THREAD_FRAME ? "frame" :
+               dec_ctx->active_thread_type == FF_THREAD_SLICE ? "slice" : "no");
+    }
+    return 0;
+}
+
+static int64_t dedup_max_gap(const AVStream *stream)
+{
+    return av_rescale_q(DEDUP_MAX_GAP_SECONDS, (AVRational){ 1, 1 }, stream->time_base);
+}
+
+/* A repeated MJPEG image can be dropped before it is decoded, a frame with
+ * no visible change only after. */
+static int open_dedup(StreamContext *sc, const AVStream *stream, int threshold)
+{
+    const AVCodecDescriptor *desc = avcodec_descriptor_get(stream->codecpar->codec_id);
+
+    if (desc && (desc->props & AV_CODEC_PROP_INTRA_ONLY) &&
+        !(sc->packet_dedup = frame_dedup_alloc(threshold, dedup_max_gap(stream))))
+        return AVERROR(ENOMEM);
+    if (!(sc->frame_dedup = frame_dedup_alloc(threshold, dedup_max_gap(stream))))
+        return AVERROR(ENOMEM);
+    av_log(NULL, AV_LOG_INFO, "Stream #%d: frames within %d luma levels of the last encoded one "
+           "are dropped (%s kernel)%s\n", stream->index, threshold, frame_dedup_kernel_name(),
+           sc->packet_dedup ? ", repeated images before decoding" : "");
+    return 0;
+}
+
+static int open_input_file(TranscodeJob *job, const char *filename)
+{
+    const TranscodeParams *params = job->params;
+    AVFormatContext *ifmt_ctx = NULL;
+    const AVInputFormat *ifmt = NULL;
+    const AVOutputFormat *ofmt;
+    AVDictionary *opts = NULL;
+    StreamContext *stream_ctx;
+    AVCodecContext *dec_ctx;
+    int nb_out_streams = 0;
+    int ret;
+
+    if (params->live) {
+        /* a pipe or socket cannot be probed without delaying the first
+         * frame, cameras send raw MJPEG */
+        ifmt = av_find_input_format("mjpeg");
+        if (!strcmp(filename, "-"))
+            filename = "pipe:0";
+        av_dict_set(&opts, "fflags", "nobuffer", 0);
+        av_dict_set(&opts, "probesize", "32", 0);
+        av_dict_set(&opts, "analyzeduration", "0", 0);
+    }
+    /* raw MJPEG carries no frame rate */
+    if (params->framerate)
+        av_dict_set(&opts, "framerate", params->framerate, 0);
+
+    if (!params->live && params->mmap_input) {
+        ret = mmap_input_open(&job->mmap_in, filename);
+        if (ret >= 0 && !(job->ifmt_ctx = avformat_alloc_context()))
+            ret = AVERROR(ENOMEM);
+        if (ret < 0) {
+            av_log(NULL, AV_LOG_VERBOSE, "Cannot map %s (%s), reading it with read()\n",
+                   filename, av_err2str(ret));
+            mmap_input_close(&job->mmap_in);
+        } else {
+            job->ifmt_ctx->pb = mmap_input_avio(job->mmap_in);
+            job->ifmt_ctx->flags |= AVFMT_FLAG_CUSTOM_IO;
         }
     }
-    stream_ctx[0].dec_ctx = codec_ctx;
 
-    stream_ctx[0].dec_frame = av_frame_alloc();
-    if (!stream_ctx[0].dec_frame)
+    ret = avformat_open_input(&job->ifmt_ctx, filename, ifmt, &opts);
+    av_dict_free(&opts);
+    if (ret < 0) {
+        av_log(NULL, AV_LOG_ERROR, "Cannot open input file\n");
+        return ret;
+    }
+
+    ifmt_ctx = job->ifmt_ctx;
+    if ((ret = avformat_find_stream_info(ifmt_ctx, NULL)) < 0) {
+        av_log(NULL, AV_LOG_ERROR, "Cannot find stream information\n");
+        return ret;
+    }
+
+    stream_ctx = job->stream_ctx = av_calloc(ifmt_ctx->nb_streams, sizeof(*stream_ctx));
+    if (!stream_ctx)
         return AVERROR(ENOMEM);
 
+    ofmt = output_format(params);
+    for (unsigned i = 0; i < ifmt_ctx->nb_streams; i++) {
+        AVStream *stream = ifmt_ctx->streams[i];
+        StreamContext *sc = &stream_ctx[i];
+        int nb_threads = 1;
+
+        sc->mode = pick_stream_mode(ofmt, stream);
+        /* the first pass only has statistics for the encoded video */
+        if (job->pass == RC_PASS_FIRST && (sc->mode != STREAM_TRANSCODE ||
+                                           stream->codecpar->codec_type != AVMEDIA_TYPE_VIDEO))
+            sc->mode = STREAM_DROP;
+        sc->out_index = sc->mode == STREAM_DROP ? -1 : nb_out_streams++;
+        av_log(NULL, sc->mode == STREAM_DROP ? AV_LOG_WARNING : AV_LOG_INFO,
+               "Stream #%u (%s): %s\n", i, avcodec_get_name(stream->codecpar->codec_id),
+               sc->mode == STREAM_TRANSCODE ? "transcoded" :
+               sc->mode == STREAM_COPY ? "copied" : "dropped");
+        if (sc->mode != STREAM_TRANSCODE)
+            continue;
+
+        if (stream->codecpar->codec_type == AVMEDIA_TYPE_VIDEO)
+            nb_threads = FFMIN(job->nb_cores, MAX_DECODE_THREADS);
+        ret = open_decoder(stream, av_guess_frame_rate(ifmt_ctx, stream, NULL),
+                           nb_threads, &sc->dec_ctx);
+        if (ret < 0)
+            return ret;
+        if ((ret = open_decode_pool(sc, stream, nb_threads)) < 0)
+            return ret;
+        if (params->dedup_threshold >= 0 && stream->codecpar->codec_type == AVMEDIA_TYPE_VIDEO &&
+            (ret = open_dedup(sc, stream, params->dedup_threshold)) < 0)
+            return ret;
+    }
+    if (!nb_out_streams) {
+        av_log(NULL, AV_LOG_ERROR, "%s has no stream the output can carry\n", filename);
+        return AVERROR_STREAM_NOT_FOUND;
+    }
+
+    /* the raw MJPEG demuxer only splits images, which the mapping can do
+     * without copying them into packets */
+    dec_ctx = stream_ctx[0].dec_ctx;
+    if (job->mmap_in && !strcmp(ifmt_ctx->iformat->name, "mjpeg") && dec_ctx &&
+        dec_ctx->framerate.num > 0 && dec_ctx->framerate.den > 0) {
+        av_log(NULL, AV_LOG_INFO, "Reading %s images from the mapping\n", filename);
+        job->mmap_packets = 1;
+    }
+
     av_dump_format(ifmt_ctx, 0, filename, 0);
     return 0;
 }
 
-static int open_output_file(const char *filename)
+/* The yuvj formats only differ from the yuv ones in being full range, which
+ * encoders take as color_range instead. */
+static enum AVPixelFormat pix_fmt_strip_jpeg(enum AVPixelFormat pix_fmt)
+{
+    switch (pix_fmt) {
+    case AV_PIX_FMT_YUVJ420P: return AV_PIX_FMT_YUV420P;
+    case AV_PIX_FMT_YUVJ422P: return AV_PIX_FMT_YUV422P;
+    case AV_PIX_FMT_YUVJ444P: return AV_PIX_FMT_YUV444P;
+    case AV_PIX_FMT_YUVJ440P: return AV_PIX_FMT_YUV440P;
+    default:                  return pix_fmt;
+    }
+}
+
+/* With keep_chroma the encoder format closest to the decoder's, so 4:2:2
+ * MJPEG is encoded as 4:2:2 (VP9 profile 1) without a conversion pass. */
+static void pick_encoder_pix_fmt(const AVCodec *encoder, AVCodecContext *dec_ctx,
+                                 int keep_chroma, AVCodecContext *enc_ctx)
+{
+    enum AVPixelFormat src_fmt = pix_fmt_strip_jpeg(dec_ctx->pix_fmt);
+
+    if (!encoder->pix_fmts) {
+        enc_ctx->pix_fmt = dec_ctx->pix_fmt;
+        return;
+    }
+    if (!keep_chroma) {
+        /* take first format from list of supported formats */
+        enc_ctx->pix_fmt = encoder->pix_fmts[0];
+        return;
+    }
+
+    enc_ctx->pix_fmt = avcodec_find_best_pix_fmt_of_list(encoder->pix_fmts, src_fmt, 0, NULL);
+    if (enc_ctx->pix_fmt == src_fmt &&
+        (src_fmt != dec_ctx->pix_fmt || dec_ctx->color_range == AVCOL_RANGE_JPEG))
+        enc_ctx->color_range = AVCOL_RANGE_JPEG;
+    if (enc_ctx->pix_fmt != src_fmt)
+        av_log(NULL, AV_LOG_WARNING, "%s has no %s, encoding %s instead\n", encoder->name,
+               av_get_pix_fmt_name(src_fmt), av_get_pix_fmt_name(enc_ctx->pix_fmt));
+    else
+        av_log(NULL, AV_LOG_INFO, "Encoding %s %s range as the decoder outputs it\n",
+               av_get_pix_fmt_name(enc_ctx->pix_fmt),
+               enc_ctx->color_range == AVCOL_RANGE_JPEG ? "full" : "limited");
+}
+
+/* Allocate and open the VP9 encoder for a decoded stream. The chunked mode
+ * opens one per chunk, so all of them must come out identical. nb_cores is
+ * the share of the host this encoder may use for its threads. */
+static int open_encoder(AVCodecContext *dec_ctx, int width, int height, int global_header,
+                        int nb_cores, int live, int keep_chroma,
+                        const AVDictionary *encoder_opts, enum RateControlPass pass,
+                        const char *stats_in, AVCodecContext **penc_ctx)
+{
+    AVCodecContext *enc_ctx;
+    const AVCodec *encoder;
+    AVDictionary *opt = NULL;
+    int ret;
+
+    /* in this example, we choose transcoding to same codec */
+    encoder = avcodec_find_encoder(AV_CODEC_ID_VP9);
+    if (!encoder) {
+        av_log(NULL, AV_LOG_FATAL, "Necessary encoder not found\n");
+        return AVERROR_INVALIDDATA;
+    }
+    enc_ctx = avcodec_alloc_context3(encoder);
+    if (!enc_ctx) {
+        av_log(NULL, AV_LOG_FATAL, "Failed to allocate the encoder context\n");
+        return AVERROR(ENOMEM);
+    }
+
+    /* In this example, we transcode to same properties (picture size,
+     * sample rate etc.). These properties can be changed for output
+     * streams easily using filters */
+    if (dec_ctx->codec_type == AVMEDIA_TYPE_VIDEO) {
+        AVRational sar = dec_ctx->sample_aspect_ratio;
+
+        enc_ctx->height = height;
+        enc_ctx->width = width;
+        /* scale keeps the display aspect ratio, so the pixels change shape */
+        if (width != dec_ctx->width || height != dec_ctx->height)
+            sar = av_mul_q(sar.num ? sar : (AVRational){ 1, 1 },
+                           (AVRational){ dec_ctx->width * height, dec_ctx->height * width });
+        enc_ctx->sample_aspect_ratio = sar;
+        pick_encoder_pix_fmt(encoder, dec_ctx, keep_chroma, enc_ctx);
+        /* video time_base can be set to whatever is handy and supported by encoder */
+        enc_ctx->time_base = av_inv_q(dec_ctx->framerate);
+        //enc_ctx->color_primaries= AVCOL_PRI_BT709;
+        //enc_ctx->bit_rate= 2000000; //means
+    }
+
+    if (global_header)
+        enc_ctx->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
+    /* latency is measured with the arrival time carried in opaque_ref */
+    if (encoder->capabilities & AV_CODEC_CAP_ENCODER_REORDERED_OPAQUE)
+        enc_ctx->flags |= AV_CODEC_FLAG_COPY_OPAQUE;
+    else if (live)
+        av_log(NULL, AV_LOG_WARNING, "%s cannot pass frame opaque data, "
+               "latency will not be reported\n", encoder->name);
+
+    ret = av_dict_copy(&opt, encoder_opts, 0);
+    if (ret >= 0)
+        ret = av_dict_set(&opt, "crf", "20", AV_DICT_DONT_OVERWRITE);
+    if (ret >= 0 && dec_ctx->codec_type == AVMEDIA_TYPE_VIDEO)
+        ret = vp9_tuning_set_defaults(&opt, enc_ctx->width, enc_ctx->height, nb_cores, live);
+    if (ret >= 0)
+        ret = rate_control_setup(enc_ctx, &opt, pass, stats_in);
+    if (ret < 0) {
+        av_dict_free(&opt);
+        avcodec_free_context(&enc_ctx);
+        return ret;
+    }
+    /* Third parameter can be used to pass settings to encoder */
+    ret = avcodec_open2(enc_ctx, encoder, &opt);
+    av_dict_free(&opt);
+    if (ret < 0) {
+        av_log(NULL, AV_LOG_ERROR, "Cannot open video encoder\n");
+        avcodec_free_context(&enc_ctx);
+        return ret;
+    }
+
+    *penc_ctx = enc_ctx;
+    return 0;
+}
+
+/* Opus where FFmpeg was built with libopus, Vorbis otherwise */
+static const AVCodec *find_audio_encoder(void)
+{
+    static const char *const names[] = { "libopus", "libvorbis", "vorbis" };
+    const AVCodec *encoder;
+
+    for (int i = 0; i < FF_ARRAY_ELEMS(names); i++) {
+        if ((encoder = avcodec_find_encoder_by_name(names[i])))
+            return encoder;
+    }
+    return NULL;
+}
+
+/* the encoder's rate closest above the decoder's, e.g. 44100 -> 48000 for Opus */
+static int pick_sample_rate(const AVCodec *encoder, int sample_rate)
+{
+    int above = 0, highest = 0;
+
+    if (!encoder->supported_samplerates)
+        return sample_rate;
+    for (const int *rate = encoder->supported_samplerates; *rate; rate++) {
+        if (*rate >= sample_rate && (!above || *rate < above))
+            above = *rate;
+        highest = FFMAX(highest, *rate);
+    }
+    return above ? above : highest;
+}
+
+static int open_audio_encoder(AVCodecContext *dec_ctx, int global_header,
+                              AVCodecContext **penc_ctx)
+{
+    const AVCodec *encoder = find_audio_encoder();
+    AVCodecContext *enc_ctx;
+    int ret;
+
+    if (!encoder) {
+        av_log(NULL, AV_LOG_FATAL, "Neither an Opus nor a Vorbis encoder was found\n");
+        return AVERROR_ENCODER_NOT_FOUND;
+    }
+    enc_ctx = avcodec_alloc_context3(encoder);
+    if (!enc_ctx) {
+        av_log(NULL, AV_LOG_FATAL, "Failed to allocate the encoder context\n");
+        return AVERROR(ENOMEM);
+    }
+
+    enc_ctx->sample_rate = pick_sample_rate(encoder, dec_ctx->sample_rate);
+    if (dec_ctx->ch_layout.order == AV_CHANNEL_ORDER_UNSPEC)
+        av_channel_layout_default(&enc_ctx->ch_layout, dec_ctx->ch_layout.nb_channels);
+    else if ((ret = av_channel_layout_copy(&enc_ctx->ch_layout, &dec_ctx->ch_layout)) < 0)
+        goto fail;
+    /* take first format from list of supported formats */
+    enc_ctx->sample_fmt = encoder->sample_fmts ? encoder->sample_fmts[0] : dec_ctx->sample_fmt;
+    enc_ctx->time_base = (AVRational){ 1, enc_ctx->sample_rate };
+    if (global_header)
+        enc_ctx->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
+    /* the native Vorbis encoder */
+    if (encoder->capabilities & AV_CODEC_CAP_EXPERIMENTAL)
+        enc_ctx->strict_std_compliance = FF_COMPLIANCE_EXPERIMENTAL;
+
+    if ((ret = avcodec_open2(enc_ctx, encoder, NULL)) < 0) {
+        av_log(NULL, AV_LOG_ERROR, "Cannot open audio encoder %s\n", encoder->name);
+        goto fail;
+    }
+
+    *penc_ctx = enc_ctx;
+    return 0;
+fail:
+    avcodec_free_context(&enc_ctx);
+    return ret;
+}
+
+/* With cues_to_front the muxer reopens the output at the end to read it
+ * back while moving the data, everything it wrote must be in the file. */
+static int io_open_drained(AVFormatContext *s, AVIOContext **pb, const char *url,
+                           int flags, AVDictionary **options)
+{
+    int ret;
+
+    if ((flags & AVIO_FLAG_READ) && (ret = async_writer_drain(s->pb)) < 0)
+        return ret;
+    return avio_open2(pb, url, flags, &s->interrupt_callback, options);
+}
+
+/* Segment files and the manifest (written to a temporary file and renamed
+ * by the segment muxer) go through the async writer as well. The segment
+ * muxer passes these callbacks and opaque on to its per-segment muxers. */
+static int io_open_segment(AVFormatContext *s, AVIOContext **pb, const char *url,
+                           int flags, AVDictionary **options)
+{
+    const TranscodeJob *job = s->opaque;
+    const char *proto = avio_find_protocol_name(url);
+
+    if ((flags & AVIO_FLAG_WRITE) && proto && !strcmp(proto, "file")) {
+        av_strstart(url, "file:", &url);
+        return async_writer_open(pb, url, job->params->output_sync);
+    }
+    return avio_open2(pb, url, flags, &s->interrupt_callback, options);
+}
+
+static int checkpoint_segment_done(TranscodeJob *job, const char *url);
+
+static int io_close_segment(AVFormatContext *s, AVIOContext *pb)
+{
+    TranscodeJob *job = s->opaque;
+    int ret;
+
+    if (async_writer_is_async(pb))
+        ret = async_writer_close(&pb);
+    else
+        ret = avio_close(pb);
+    /* a segment file is complete (and synced, as configured) */
+    if (ret >= 0 && job->checkpoint && av_match_ext(s->url, "webm"))
+        ret = checkpoint_segment_done(job, s->url);
+    return ret;
+}
+
+/* "dir/out.m3u8" -> "dir/out_%05d.webm" */
+static char *segment_filename_pattern(const char *manifest)
 {
+    const char *slash = strrchr(manifest, '/');
+    const char *dot = strrchr(slash ? slash : manifest, '.');
+    int base_len = dot ? dot - manifest : strlen(manifest);
+    AVBPrint bp;
+    char *pattern;
+
+    av_bprint_init(&bp, 0, AV_BPRINT_SIZE_UNLIMITED);
+    /* the pattern goes through av_get_frame_filename() */
+    for (int i = 0; i < base_len; i++)
+        av_bprintf(&bp, manifest[i] == '%' ? "%%%%" : "%c", manifest[i]);
+    av_bprintf(&bp, "_%%05d.webm");
+    if (av_bprint_finalize(&bp, &pattern) < 0)
+        return NULL;
+    return pattern;
+}
+
+/* Force a keyframe on the first frame of every segment, so segments can be
+ * cut at exactly the requested duration. */
+static void mark_segment_start(AVFrame *frame, AVRational time_base, double segment_seconds,
+                               int64_t *segment_index)
+{
+    int64_t index;
+
+    if (segment_seconds <= 0 || frame->pts == AV_NOPTS_VALUE)
+        return;
+    index = av_rescale_q(frame->pts, time_base, AV_TIME_BASE_Q) /
+            (int64_t)(segment_seconds * AV_TIME_BASE);
+    if (index != *segment_index) {
+        frame->pict_type = AV_PICTURE_TYPE_I;
+        *segment_index = index;
+    }
+}
+
+static int open_output_file(TranscodeJob *job, int index)
+{
+    AVFormatContext *ifmt_ctx = job->ifmt_ctx;
+    AVFormatContext *ofmt_ctx = NULL;
+    StreamContext *stream_ctx = job->stream_ctx;
+    OutputFile *of = &job->outputs[index];
+    const TranscodeParams *params = job->params;
+    const char *filename = of->filename;
+    const char *format_name = NULL;
+    AVDictionary *mux_opts = NULL;
     AVStream *out_stream;
     AVStream *in_stream;
     AVCodecContext *dec_ctx, *enc_ctx;
-    const AVCodec *encoder;
+    char *segment_pattern = NULL;
+    int nb_video = 0;
     int ret;
 
-    ofmt_ctx = NULL;
-    avformat_alloc_output_context2(&ofmt_ctx, NULL, NULL, filename);
+    if (job->pass == RC_PASS_FIRST) {
+        /* nothing of the first pass is written but the statistics */
+        format_name = "null";
+    } else if (params->segment_seconds > 0) {
+        /* filename is the manifest, its type follows from the extension
+         * (m3u8, csv, ffconcat or a plain list) */
+        segment_pattern = segment_filename_pattern(filename);
+        if (!segment_pattern)
+            return AVERROR(ENOMEM);
+        if (job->checkpoint) {
+            /* the manifest is written from the checkpoint instead, and a
+             * resumed job continues the numbering and the timeline */
+            av_dict_set_int(&mux_opts, "segment_start_number", job->checkpoint->resume_segment, 0);
+            av_dict_set(&mux_opts, "initial_offset",
+                        av_asprintf("%.6f", job->checkpoint->resume_segment * params->segment_seconds),
+                        AV_DICT_DONT_STRDUP_VAL);
+        } else {
+            av_dict_set(&mux_opts, "segment_list", filename, 0);
+        }
+        av_dict_set(&mux_opts, "segment_format", "webm", 0);
+        av_dict_set(&mux_opts, "segment_time",
+                    av_asprintf("%g", params->segment_seconds), AV_DICT_DONT_STRDUP_VAL);
+        filename = segment_pattern;
+        format_name = "segment";
+    } else if (params->live && !strcmp(filename, "-")) {
+        filename = "pipe:1";
+        format_name = "webm";
+    }
+    avformat_alloc_output_context2(&of->ofmt_ctx, NULL, format_name, filename);
+    av_free(segment_pattern);
+    ofmt_ctx = of->ofmt_ctx;
     if (!ofmt_ctx) {
         av_log(NULL, AV_LOG_ERROR, "Could not create output context\n");
+        av_dict_free(&mux_opts);
         return AVERROR_UNKNOWN;
     }
-
-    out_stream = avformat_new_stream(ofmt_ctx, NULL);
-    if (!out_stream) {
-        av_log(NULL, AV_LOG_ERROR, "Failed allocating output stream\n");
-        return AVERROR_UNKNOWN;
+    if (params->segment_seconds > 0 && job->pass != RC_PASS_FIRST) {
+        ofmt_ctx->opaque = job;
+        ofmt_ctx->io_open = io_open_segment;
+        ofmt_ctx->io_close2 = io_close_segment;
     }
 
-    in_stream = ifmt_ctx->streams[0];
-    dec_ctx = stream_ctx[0].dec_ctx;
+    for (unsigned i = 0; i < ifmt_ctx->nb_streams; i++)
+        nb_video += stream_ctx[i].mode == STREAM_TRANSCODE &&
+                    stream_ctx[i].dec_ctx->codec_type == AVMEDIA_TYPE_VIDEO;
 
-    if (dec_ctx->codec_type == AVMEDIA_TYPE_VIDEO
-        || dec_ctx->codec_type == AVMEDIA_TYPE_AUDIO) {
-        /* in this example, we choose transcoding to same codec */
-        encoder = avcodec_find_encoder(AV_CODEC_ID_VP9);
-        if (!encoder) {
-            av_log(NULL, AV_LOG_FATAL, "Necessary encoder not found\n");
-            return AVERROR_INVALIDDATA;
-        }
-        enc_ctx = avcodec_alloc_context3(encoder);
-        if (!enc_ctx) {
-            av_log(NULL, AV_LOG_FATAL, "Failed to allocate the encoder context\n");
-            return AVERROR(ENOMEM);
-        }
+    /* output streams in input order, without the dropped ones */
+    for (unsigned i = 0; i < ifmt_ctx->nb_streams; i++) {
+        int global_header = ofmt_ctx->oformat->flags & AVFMT_GLOBALHEADER;
 
-        /* In this example, we transcode to same properties (picture size,
-         * sample rate etc.). These properties can be changed for output
-         * streams easily using filters */
-        if (dec_ctx->codec_type == AVMEDIA_TYPE_VIDEO) {
-            enc_ctx->height = dec_ctx->height;
-            enc_ctx->width = dec_ctx->width;
-            enc_ctx->sample_aspect_ratio = dec_ctx->sample_aspect_ratio;
-            /* take first format from list of supported formats */
-            if (encoder->pix_fmts)
-                enc_ctx->pix_fmt = encoder->pix_fmts[0];
-            else
-                enc_ctx->pix_fmt = dec_ctx->pix_fmt;
-            /* video time_base can be set to whatever is handy and supported by encoder */
-            enc_ctx->time_base = av_inv_q(dec_ctx->framerate);
-            //enc_ctx->color_primaries= AVCOL_PRI_BT709;
-            //enc_ctx->bit_rate= 2000000; //means
+        if (stream_ctx[i].mode == STREAM_DROP)
+            continue;
+        out_stream = avformat_new_stream(ofmt_ctx, NULL);
+        if (!out_stream) {
+            av_log(NULL, AV_LOG_ERROR, "Failed allocating output stream\n");
+            return AVERROR_UNKNOWN;
         }
 
-        if (ofmt_ctx->oformat->flags & AVFMT_GLOBALHEADER)
-            enc_ctx->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
-
-        AVDictionary* opt = NULL;
-        av_dict_set(&opt, "crf", "20", 0);
-        /* Third parameter can be used to pass settings to encoder */
-        ret = avcodec_open2(enc_ctx, encoder, &opt);
-        if (ret < 0) {
-            av_log(NULL, AV_LOG_ERROR, "Cannot open video encoder for stream #%u\n", 0);
-            return ret;
-        }
-        ret = avcodec_parameters_from_context(out_stream->codecpar, enc_ctx);
-        if (ret < 0) {
-            av_log(NULL, AV_LOG_ERROR, "Failed to copy encoder parameters to output stream #%u\n", 0);
-            return ret;
-        }
+        in_stream = ifmt_ctx->streams[i];
+        dec_ctx = stream_ctx[i].dec_ctx;
 
-        out_stream->time_base = enc_ctx->time_base;
-        stream_ctx[0].enc_ctx = enc_ctx;
-    } else if (dec_ctx->codec_type == AVMEDIA_TYPE_UNKNOWN) {
-        av_log(NULL, AV_LOG_FATAL, "Elementary stream #%d is of unknown type, cannot proceed\n", 0);
-        return AVERROR_INVALIDDATA;
-    } else {
-        /* if this stream must be remuxed */
-        ret = avcodec_parameters_copy(out_stream->codecpar, in_stream->codecpar);
-        if (ret < 0) {
-            av_log(NULL, AV_LOG_ERROR, "Copying parameters for stream #%u failed\n", 0);
-            return ret;
+        if (stream_ctx[i].mode == STREAM_TRANSCODE) {
+            if (dec_ctx->codec_type == AVMEDIA_TYPE_VIDEO)
+                ret = open_encoder(dec_ctx, of->width ? of->width : dec_ctx->width,
+                                   of->height ? of->height : dec_ctx->height, global_header,
+                                   FFMAX(of->nb_cores / nb_video, 1), params->live,
+                                   params->keep_chroma, of->encoder_opts, job->pass,
+                                   job->pass_stats ? job->pass_stats[index] : NULL, &enc_ctx);
+            else
+                ret = open_audio_encoder(dec_ctx, global_header, &enc_ctx);
+            if (ret < 0)
+                return ret;
+            of->enc_ctx[i] = enc_ctx;
+
+            ret = avcodec_parameters_from_context(out_stream->codecpar, enc_ctx);
+            if (ret < 0) {
+                av_log(NULL, AV_LOG_ERROR, "Failed to copy encoder parameters to output stream #%u\n", i);
+                return ret;
+            }
+
+            out_stream->time_base = enc_ctx->time_base;
+        } else {
+            /* if this stream must be remuxed */
+            ret = avcodec_parameters_copy(out_stream->codecpar, in_stream->codecpar);
+            if (ret < 0) {
+                av_log(NULL, AV_LOG_ERROR, "Copying parameters for stream #%u failed\n", i);
+                return ret;
+            }
+            /* the input container's tag means nothing to the output's */
+            out_stream->codecpar->codec_tag = 0;
+            out_stream->time_base = in_stream->time_base;
         }
-        out_stream->time_base = in_stream->time_base;
+        out_stream->disposition = in_stream->disposition;
+        av_dict_copy(&out_stream->metadata, in_stream->metadata, 0);
     }
 
-    av_dump_format(ofmt_ctx, 0, filename, 1);
+    av_dump_format(ofmt_ctx, index, ofmt_ctx->url, 1);
 
     if (!(ofmt_ctx->oformat->flags & AVFMT_NOFILE)) {
-        ret = avio_open(&ofmt_ctx->pb, filename, AVIO_FLAG_WRITE);
+        const char *proto = avio_find_protocol_name(filename);
+        const char *path = filename;
+
+        /* Local files are written from their own thread. Live output stays
+         * on avio_open(): the big write buffers would hold back what a
+         * reader of the growing file sees. */
+        if (!params->live && proto && !strcmp(proto, "file")) {
+            av_strstart(filename, "file:", &path);
+            ret = async_writer_open(&ofmt_ctx->pb, path, params->output_sync);
+            of->async_output = ret >= 0;
+        } else {
+            ret = avio_open(&ofmt_ctx->pb, filename, AVIO_FLAG_WRITE);
+        }
         if (ret < 0) {
             av_log(NULL, AV_LOG_ERROR, "Could not open output file '%s'", filename);
             return ret;
         }
     }
 
+    if (params->live && params->segment_seconds <= 0) {
+        /* no cues/duration to seek back for, and a cluster only reaches
+         * the output when it is closed, so keep clusters short */
+        av_dict_set(&mux_opts, "live", "1", 0);
+        av_dict_set_int(&mux_opts, "cluster_time_limit",
+                        FFMAX(params->latency_budget_ms / 4, 0), 0);
+        av_dict_set_int(&mux_opts, "cluster_size_limit", LIVE_CLUSTER_SIZE, 0);
+        ofmt_ctx->flags |= AVFMT_FLAG_FLUSH_PACKETS;
+    }
+    if (params->fast_start && job->pass != RC_PASS_FIRST) {
+        /* players can seek right away without a read at the end of the file */
+        av_dict_set(&mux_opts, "cues_to_front", "1", 0);
+        if (of->async_output)
+            ofmt_ctx->io_open = io_open_drained;
+    }
+
     /* init muxer, write output file header */
-    ret = avformat_write_header(ofmt_ctx, NULL);
+    ret = avformat_write_header(ofmt_ctx, &mux_opts);
+    av_dict_free(&mux_opts);
     if (ret < 0) {
         av_log(NULL, AV_LOG_ERROR, "Error occurred when opening output file\n");
         return ret;
@@ -240,20 +957,23 @@ static int open_output_file(const char *filename)
     return 0;
 }
 
+/* filter_spec reads from [in] and writes to [out], or to [out0], [out1], ...
+ * with more than one encoder, each sink delivers its encoder's format
+ * (and for audio its frame size) */
 static int init_filter(FilteringContext* fctx, AVCodecContext *dec_ctx,
-                       AVCodecContext *enc_ctx, const char *filter_spec)
+                       AVCodecContext **enc_ctxs, int nb_sinks, const char *filter_spec)
 {
     char args[512];
     int ret = 0;
     const AVFilter *buffersrc = NULL;
     const AVFilter *buffersink = NULL;
     AVFilterContext *buffersrc_ctx = NULL;
-    AVFilterContext *buffersink_ctx = NULL;
+    AVFilterContext *buffersink_ctx[TRANSCODE_MAX_RENDITIONS] = { NULL };
     AVFilterInOut *outputs = avfilter_inout_alloc();
-    AVFilterInOut *inputs  = avfilter_inout_alloc();
+    AVFilterInOut *inputs  = NULL;
     AVFilterGraph *filter_graph = avfilter_graph_alloc();
 
-    if (!outputs || !inputs || !filter_graph) {
+    if (!outputs || !filter_graph) {
         ret = AVERROR(ENOMEM);
         goto end;
     }
@@ -281,21 +1001,74 @@ static int init_filter(FilteringContext* fctx, AVCodecContext *dec_ctx,
             goto end;
         }
 
-        ret = avfilter_graph_create_filter(&buffersink_ctx, buffersink, "out",
-                                           NULL, NULL, filter_graph);
-        if (ret < 0) {
-            av_log(NULL, AV_LOG_ERROR, "Cannot create buffer sink\n");
+        for (int i = 0; i < nb_sinks; i++) {
+            snprintf(args, sizeof(args), nb_sinks > 1 ? "out%d" : "out", i);
+            ret = avfilter_graph_create_filter(&buffersink_ctx[i], buffersink, args,
+                                               NULL, NULL, filter_graph);
+            if (ret < 0) {
+                av_log(NULL, AV_LOG_ERROR, "Cannot create buffer sink\n");
+                goto end;
+            }
+
+            ret = av_opt_set_bin(buffersink_ctx[i], "pix_fmts",
+                                 (uint8_t*)&enc_ctxs[i]->pix_fmt, sizeof(enc_ctxs[i]->pix_fmt),
+                                 AV_OPT_SEARCH_CHILDREN);
+            if (ret < 0) {
+                av_log(NULL, AV_LOG_ERROR, "Cannot set output pixel format\n");
+                goto end;
+            }
+        }
+    } else if (dec_ctx->codec_type == AVMEDIA_TYPE_AUDIO) {
+        char layout[64];
+
+        buffersrc = avfilter_get_by_name("abuffer");
+        buffersink = avfilter_get_by_name("abuffersink");
+        if (!buffersrc || !buffersink) {
+            av_log(NULL, AV_LOG_ERROR, "filtering source or sink element not found\n");
+            ret = AVERROR_UNKNOWN;
             goto end;
         }
 
-        ret = av_opt_set_bin(buffersink_ctx, "pix_fmts",
-                             (uint8_t*)&enc_ctx->pix_fmt, sizeof(enc_ctx->pix_fmt),
-                             AV_OPT_SEARCH_CHILDREN);
+        if (dec_ctx->ch_layout.order == AV_CHANNEL_ORDER_UNSPEC)
+            av_channel_layout_default(&dec_ctx->ch_layout, dec_ctx->ch_layout.nb_channels);
+        av_channel_layout_describe(&dec_ctx->ch_layout, layout, sizeof(layout));
+        snprintf(args, sizeof(args),
+                 "time_base=%d/%d:sample_rate=%d:sample_fmt=%s:channel_layout=%s",
+                 dec_ctx->pkt_timebase.num, dec_ctx->pkt_timebase.den, dec_ctx->sample_rate,
+                 av_get_sample_fmt_name(dec_ctx->sample_fmt), layout);
+
+        ret = avfilter_graph_create_filter(&buffersrc_ctx, buffersrc, "in",
+                                           args, NULL, filter_graph);
         if (ret < 0) {
-            av_log(NULL, AV_LOG_ERROR, "Cannot set output pixel format\n");
+            av_log(NULL, AV_LOG_ERROR, "Cannot create audio buffer source\n");
             goto end;
         }
-    }else {
+
+        for (int i = 0; i < nb_sinks; i++) {
+            snprintf(args, sizeof(args), nb_sinks > 1 ? "out%d" : "out", i);
+            ret = avfilter_graph_create_filter(&buffersink_ctx[i], buffersink, args,
+                                               NULL, NULL, filter_graph);
+            if (ret < 0) {
+                av_log(NULL, AV_LOG_ERROR, "Cannot create audio buffer sink\n");
+                goto end;
+            }
+
+            av_channel_layout_describe(&enc_ctxs[i]->ch_layout, layout, sizeof(layout));
+            if ((ret = av_opt_set_bin(buffersink_ctx[i], "sample_fmts",
+                                      (uint8_t*)&enc_ctxs[i]->sample_fmt,
+                                      sizeof(enc_ctxs[i]->sample_fmt),
+                                      AV_OPT_SEARCH_CHILDREN)) < 0 ||
+                (ret = av_opt_set(buffersink_ctx[i], "ch_layouts", layout,
+                                  AV_OPT_SEARCH_CHILDREN)) < 0 ||
+                (ret = av_opt_set_bin(buffersink_ctx[i], "sample_rates",
+                                      (uint8_t*)&enc_ctxs[i]->sample_rate,
+                                      sizeof(enc_ctxs[i]->sample_rate),
+                                      AV_OPT_SEARCH_CHILDREN)) < 0) {
+                av_log(NULL, AV_LOG_ERROR, "Cannot set the audio output format\n");
+                goto end;
+            }
+        }
+    } else {
         ret = AVERROR_UNKNOWN;
         goto end;
     }
@@ -305,17 +1078,30 @@ static int init_filter(FilteringContext* fctx, AVCodecContext *dec_ctx,
     outputs->filter_ctx = buffersrc_ctx;
     outputs->pad_idx    = 0;
     outputs->next       = NULL;
-
-    inputs->name       = av_strdup("out");
-    inputs->filter_ctx = buffersink_ctx;
-    inputs->pad_idx    = 0;
-    inputs->next       = NULL;
-
-    if (!outputs->name || !inputs->name) {
+    if (!outputs->name) {
         ret = AVERROR(ENOMEM);
         goto end;
     }
 
+    /* built back to front, so the list is in sink order */
+    for (int i = nb_sinks - 1; i >= 0; i--) {
+        AVFilterInOut *input = avfilter_inout_alloc();
+
+        if (!input) {
+            ret = AVERROR(ENOMEM);
+            goto end;
+        }
+        input->name       = av_strdup(buffersink_ctx[i]->name);
+        input->filter_ctx = buffersink_ctx[i];
+        input->pad_idx    = 0;
+        input->next       = inputs;
+        inputs = input;
+        if (!input->name) {
+            ret = AVERROR(ENOMEM);
+            goto end;
+        }
+    }
+
     if ((ret = avfilter_graph_parse_ptr(filter_graph, filter_spec,
                                         &inputs, &outputs, NULL)) < 0)
         goto end;
@@ -323,277 +1109,2235 @@ static int init_filter(FilteringContext* fctx, AVCodecContext *dec_ctx,
     if ((ret = avfilter_graph_config(filter_graph, NULL)) < 0)
         goto end;
 
+    /* e.g. Opus and Vorbis take fixed-size frames */
+    for (int i = 0; i < nb_sinks; i++) {
+        if (dec_ctx->codec_type == AVMEDIA_TYPE_AUDIO &&
+            !(enc_ctxs[i]->codec->capabilities & AV_CODEC_CAP_VARIABLE_FRAME_SIZE))
+            av_buffersink_set_frame_size(buffersink_ctx[i], enc_ctxs[i]->frame_size);
+    }
+
     /* Fill FilteringContext */
     fctx->buffersrc_ctx = buffersrc_ctx;
-    fctx->buffersink_ctx = buffersink_ctx;
+    for (int i = 0; i < nb_sinks; i++)
+        fctx->buffersink_ctx[i] = buffersink_ctx[i];
+    fctx->nb_sinks = nb_sinks;
     fctx->filter_graph = filter_graph;
+    filter_graph = NULL;
 
 end:
     avfilter_inout_free(&inputs);
     avfilter_inout_free(&outputs);
+    avfilter_graph_free(&filter_graph);
 
     return ret;
 }
 
-static int init_filters(void)
+/* A "null" graph between decoder and encoder with the same frame layout
+ * would only add a buffersrc/buffersink round trip per frame. */
+static int filter_is_passthrough(const char *filter_spec, AVCodecContext *dec_ctx,
+                                 AVCodecContext *enc_ctx)
 {
-    const char *filter_spec;
-    int ret;
-    filter_ctx = av_malloc_array(ifmt_ctx->nb_streams, sizeof(*filter_ctx));
-    if (!filter_ctx)
-        return AVERROR(ENOMEM);
-
-    filter_ctx[0].buffersrc_ctx  = NULL;
-    filter_ctx[0].buffersink_ctx = NULL;
-    filter_ctx[0].filter_graph   = NULL;
-
-    if (ifmt_ctx->streams[0]->codecpar->codec_type == AVMEDIA_TYPE_VIDEO)
-        filter_spec = "null"; /* passthrough (dummy) filter for video */
-    else
-        filter_spec = "anull"; /* passthrough (dummy) filter for audio */
-    ret = init_filter(&filter_ctx[0], stream_ctx[0].dec_ctx,
-                      stream_ctx[0].enc_ctx, filter_spec);
-    if (ret)
-        return ret;
-
-    filter_ctx[0].enc_pkt = av_packet_alloc();
-    if (!filter_ctx[0].enc_pkt)
-        return AVERROR(ENOMEM);
+    if (dec_ctx->codec_type != AVMEDIA_TYPE_VIDEO || strcmp(filter_spec, "null"))
+        return 0;
+    if (dec_ctx->pix_fmt != enc_ctx->pix_fmt &&
+        (pix_fmt_strip_jpeg(dec_ctx->pix_fmt) != enc_ctx->pix_fmt ||
+         enc_ctx->color_range != AVCOL_RANGE_JPEG))
+        return 0;
+    return dec_ctx->width == enc_ctx->width && dec_ctx->height == enc_ctx->height;
+}
 
-    filter_ctx[0].filtered_frame = av_frame_alloc();
-    if (!filter_ctx[0].filtered_frame)
-        return AVERROR(ENOMEM);
-    return 0;
+/* Passthrough frames from a yuvj decoder go to a full range yuv encoder,
+ * relabel them with the encoder's format. */
+static void frame_as_encoder_format(AVFrame *frame, const AVCodecContext *enc_ctx)
+{
+    if (frame->format == enc_ctx->pix_fmt)
+        return;
+    frame->color_range = AVCOL_RANGE_JPEG;
+    frame->format = enc_ctx->pix_fmt;
 }
 
-static int encode_write_frame(int flush)
+static int filter_can_convert(const char *filter_spec, AVCodecContext *dec_ctx,
+                              AVCodecContext *enc_ctx)
 {
-    FilteringContext *filter = &filter_ctx[0];
-    AVFrame *filt_frame = flush ? NULL : filter->filtered_frame;
-    AVPacket *enc_pkt = filter->enc_pkt;
-    int ret;
+    if (dec_ctx->codec_type != AVMEDIA_TYPE_VIDEO || strcmp(filter_spec, "null"))
+        return 0;
+    return yuv_convert_supported(dec_ctx->pix_fmt, enc_ctx->pix_fmt) &&
+           dec_ctx->width == enc_ctx->width && dec_ctx->height == enc_ctx->height;
+}
 
-    av_log(NULL, AV_LOG_INFO, "Encoding frame\n");
-    /* encode filtered frame */
-    av_packet_unref(enc_pkt);
+/* "null" ("anull") for one output at the decoded size, otherwise split into
+ * one branch per output: [in]split=2[s0][s1];[s0]null[out0];[s1]scale=...
+ * Audio branches are all "anull", the sinks convert to the encoder. */
+static char *stream_filter_spec(TranscodeJob *job, int index)
+{
+    AVCodecContext *dec_ctx = job->stream_ctx[index].dec_ctx;
+    int video = dec_ctx->codec_type == AVMEDIA_TYPE_VIDEO;
+    AVBPrint bp;
+    char *spec;
+
+    av_bprint_init(&bp, 0, AV_BPRINT_SIZE_UNLIMITED);
+    if (job->nb_outputs > 1) {
+        av_bprintf(&bp, "[in]%ssplit=%d", video ? "" : "a", job->nb_outputs);
+        for (int i = 0; i < job->nb_outputs; i++)
+            av_bprintf(&bp, "[s%d]", i);
+    }
+    for (int i = 0; i < job->nb_outputs; i++) {
+        const OutputFile *of = &job->outputs[i];
+
+        if (job->nb_outputs > 1)
+            av_bprintf(&bp, ";[s%d]", i);
+        if (!video)
+            av_bprintf(&bp, "anull");
+        else if (!of->width || (of->width == dec_ctx->width && of->height == dec_ctx->height))
+            av_bprintf(&bp, "null");
+        else
+            av_bprintf(&bp, "scale=%d:%d", of->width, of->height);
+        if (job->nb_outputs > 1)
+            av_bprintf(&bp, "[out%d]", i);
+    }
+    if (av_bprint_finalize(&bp, &spec) < 0)
+        return NULL;
+    return spec;
+}
+
+static int init_stream_filter(TranscodeJob *job, int index)
+{
+    AVCodecContext *dec_ctx = job->stream_ctx[index].dec_ctx;
+    AVCodecContext *enc_ctxs[TRANSCODE_MAX_RENDITIONS];
+    FilteringContext *filter = &job->filter_ctx[index];
+    char *filter_spec;
+    int ret;
+
+    if (!(filter_spec = stream_filter_spec(job, index)))
+        return AVERROR(ENOMEM);
+
+    for (int i = 0; i < job->nb_outputs; i++)
+        enc_ctxs[i] = job->outputs[i].enc_ctx[index];
+
+    if (job->nb_outputs == 1 && filter_is_passthrough(filter_spec, dec_ctx, enc_ctxs[0])) {
+        av_log(NULL, AV_LOG_INFO, "Stream #%u: no filtering needed, decoded frames go "
+               "straight to the encoder\n", index);
+        filter->passthrough = 1;
+        ret = 0;
+    } else if (job->nb_outputs == 1 && filter_can_convert(filter_spec, dec_ctx, enc_ctxs[0])) {
+        av_log(NULL, AV_LOG_INFO, "Stream #%u: %s -> %s converted in place (%s kernel)\n", index,
+               av_get_pix_fmt_name(dec_ctx->pix_fmt),
+               av_get_pix_fmt_name(enc_ctxs[0]->pix_fmt),
+               yuv_convert_kernel_name());
+        filter->convert = 1;
+        ret = 0;
+    } else {
+        av_log(NULL, AV_LOG_VERBOSE, "Stream #%u filter graph: %s\n", index, filter_spec);
+        ret = init_filter(filter, dec_ctx, enc_ctxs, job->nb_outputs, filter_spec);
+    }
+    av_free(filter_spec);
+    return ret;
+}
+
+static int init_filters(TranscodeJob *job)
+{
+    int ret;
+
+    job->filter_ctx = av_calloc(job->ifmt_ctx->nb_streams, sizeof(*job->filter_ctx));
+    if (!job->filter_ctx)
+        return AVERROR(ENOMEM);
+
+    for (unsigned i = 0; i < job->ifmt_ctx->nb_streams; i++) {
+        if (job->stream_ctx[i].mode == STREAM_TRANSCODE &&
+            (ret = init_stream_filter(job, i)) < 0)
+            return ret;
+    }
+    return 0;
+}
+
+static void free_packet_item(void **item)
+{
+    media_pool_put_packet((AVPacket **)item);
+}
+
+static void free_frame_item(void **item)
+{
+    media_pool_put_frame((AVFrame **)item);
+}
+
+static int is_transcoded(const Pipeline *p, int index)
+{
+    return p->job->stream_ctx[index].mode == STREAM_TRANSCODE;
+}
+
+static PipelineEncoder *pipeline_encoder(Pipeline *p, int output, int index)
+{
+    return &p->encoders[output * p->nb_streams + index];
+}
+
+/* Queues are zeroed until initialized, which frame_queue_destroy() allows,
+ * so pipeline_uninit() can clean up after a partial init. */
+static int pipeline_init(Pipeline *p, TranscodeJob *job)
+{
+    int nb_copied = 0;
+    int ret;
+
+    p->job = job;
+    atomic_init(&p->error, 0);
+    p->nb_streams = job->ifmt_ctx->nb_streams;
+    p->streams = av_calloc(p->nb_streams, sizeof(*p->streams));
+    p->encoders = av_calloc(job->nb_outputs * p->nb_streams, sizeof(*p->encoders));
+    if (!p->streams || !p->encoders)
+        return AVERROR(ENOMEM);
+
+    for (int i = 0; i < p->nb_streams; i++) {
+        PipelineStream *ps = &p->streams[i];
+
+        ps->p = p;
+        ps->index = i;
+        nb_copied += job->stream_ctx[i].mode == STREAM_COPY;
+        if (is_transcoded(p, i) &&
+            ((ret = frame_queue_init(&ps->demux_q, PIPELINE_QUEUE_SIZE)) < 0 ||
+             (ret = frame_queue_init(&ps->decode_q, PIPELINE_QUEUE_SIZE)) < 0))
+            return ret;
+    }
+    for (int i = 0; i < job->nb_outputs; i++) {
+        PipelineOutput *po = &p->outputs[i];
+        int nb_producers = !!nb_copied; /* the demuxer */
+
+        po->p = p;
+        po->of = &job->outputs[i];
+        p->nb_outputs++;
+        for (int j = 0; j < p->nb_streams; j++) {
+            PipelineEncoder *pe = pipeline_encoder(p, i, j);
+
+            if (!is_transcoded(p, j))
+                continue;
+            pe->po = po;
+            pe->index = j;
+            pe->segment_index = -1;
+            nb_producers++;
+            if ((ret = frame_queue_init(&pe->filter_q, PIPELINE_QUEUE_SIZE)) < 0)
+                return ret;
+        }
+        atomic_init(&po->nb_producers, nb_producers);
+        if ((ret = frame_queue_init(&po->mux_q, PIPELINE_QUEUE_SIZE)) < 0)
+            return ret;
+    }
+    return 0;
+}
+
+static void pipeline_uninit(Pipeline *p)
+{
+    /* the reporter looks at the queues */
+    if (p->stats != p->job->params->stats)
+        stage_stats_free(&p->stats);
+    for (int i = 0; p->streams && i < p->nb_streams; i++) {
+        frame_queue_destroy(&p->streams[i].demux_q, free_packet_item);
+        frame_queue_destroy(&p->streams[i].decode_q, free_frame_item);
+    }
+    for (int i = 0; i < p->nb_outputs; i++) {
+        for (int j = 0; p->encoders && j < p->nb_streams; j++)
+            frame_queue_destroy(&pipeline_encoder(p, i, j)->filter_q, free_frame_item);
+        frame_queue_destroy(&p->outputs[i].mux_q, free_packet_item);
+    }
+    av_freep(&p->streams);
+    av_freep(&p->encoders);
+}
+
+/* remember the first error and stop every stage */
+static void pipeline_fail(Pipeline *p, int err)
+{
+    int expected = 0;
+
+    if (err == AVERROR_EXIT)
+        return;
+    atomic_compare_exchange_strong(&p->error, &expected, err);
+    for (int i = 0; i < p->nb_streams; i++) {
+        if (!is_transcoded(p, i))
+            continue;
+        frame_queue_abort(&p->streams[i].demux_q);
+        frame_queue_abort(&p->streams[i].decode_q);
+        for (int j = 0; j < p->nb_outputs; j++)
+            frame_queue_abort(&pipeline_encoder(p, j, i)->filter_q);
+    }
+    for (int i = 0; i < p->nb_outputs; i++)
+        frame_queue_abort(&p->outputs[i].mux_q);
+}
+
+/* an encoder (or the demuxer for the copied streams) is done with po */
+static void output_producer_done(PipelineOutput *po)
+{
+    if (atomic_fetch_sub(&po->nb_producers, 1) == 1)
+        frame_queue_finish(&po->mux_q);
+}
+
+/* Live mode: remember when a packet was read. The time travels in
+ * opaque_ref through decoder, filters and encoder to the muxer. */
+static int stamp_arrival(AVPacket *packet)
+{
+    av_buffer_unref(&packet->opaque_ref);
+    packet->opaque_ref = av_buffer_alloc(sizeof(int64_t));
+    if (!packet->opaque_ref)
+        return AVERROR(ENOMEM);
+    *(int64_t *)packet->opaque_ref->data = av_gettime_relative();
+    return 0;
+}
+
+static void account_latency(PipelineOutput *po, int64_t pts, int64_t arrival)
+{
+    int64_t latency = av_gettime_relative() - arrival;
+    int64_t budget = po->p->job->params->latency_budget_ms * 1000;
+
+    po->nb_latency++;
+    po->latency_sum += latency;
+    po->latency_max = FFMAX(po->latency_max, latency);
+    if (budget > 0 && latency > budget) {
+        po->nb_over_budget++;
+        ALOG_RATELIMIT(AV_LOG_WARNING, 1000,
+                       "Frame pts %s: latency %.1f ms over the %d ms budget\n",
+                       av_ts2str(pts), latency / 1000.0, po->p->job->params->latency_budget_ms);
+    } else {
+        ALOG(AV_LOG_INFO, "Frame pts %s: latency %.1f ms\n",
+             av_ts2str(pts), latency / 1000.0);
+    }
+}
+
+/* Note where segments start and drop what a resumed job already has.
+ * Returns 1 to drop the packet. */
+static int checkpoint_input_packet(TranscodeJob *job, AVPacket *pkt)
+{
+    JobCheckpoint *jc = job->checkpoint;
+    AVStream *st = job->ifmt_ctx->streams[pkt->stream_index];
+    int64_t segment;
+    int ret = 0;
+
+    if (pkt->pts == AV_NOPTS_VALUE)
+        return 0;
+    /* a seek by timestamp may land before the first missing segment */
+    if (pkt->pts < jc->resume_pts)
+        return 1;
+    segment = av_rescale_q(pkt->pts, st->time_base, AV_TIME_BASE_Q) /
+              (int64_t)(job->params->segment_seconds * AV_TIME_BASE);
+
+    pthread_mutex_lock(&jc->lock);
+    if (!jc->nb_starts || jc->starts[jc->nb_starts - 1].segment < segment) {
+        if ((ret = av_reallocp_array(&jc->starts, jc->nb_starts + 1, sizeof(*jc->starts))) < 0)
+            jc->nb_starts = 0;
+        else
+            jc->starts[jc->nb_starts++] = (SegmentStart){ segment, pkt->pos, pkt->pts, jc->nb_frames };
+    }
+    jc->nb_frames++;
+    jc->input_end = FFMAX(jc->input_end, pkt->pts + pkt->duration);
+    pthread_mutex_unlock(&jc->lock);
+
+    pkt->pts -= jc->resume_offset;
+    if (pkt->dts != AV_NOPTS_VALUE)
+        pkt->dts -= jc->resume_offset;
+    return ret;
+}
+
+/* Segment <output>_NNNNN.webm is on disk: list it in the manifest and
+ * checkpoint the start of the next one. After the last segment only the
+ * manifest is updated, finish_checkpoint() ends the job. */
+static int checkpoint_segment_done(TranscodeJob *job, const char *url)
+{
+    JobCheckpoint *jc = job->checkpoint;
+    AVRational tb = job->ifmt_ctx->streams[jc->stream_index]->time_base;
+    const char *number = strrchr(url, '_');
+    SegmentStart start = { -1 }, next = { -1 };
+    int64_t segment = number ? strtoll(number + 1, NULL, 10) : -1;
+    int64_t end;
+    int ret;
+
+    /* copies, the demuxer may grow the array meanwhile */
+    pthread_mutex_lock(&jc->lock);
+    for (int i = 0; i < jc->nb_starts; i++) {
+        if (jc->starts[i].segment == segment) {
+            start = jc->starts[i];
+            if (i + 1 < jc->nb_starts)
+                next = jc->starts[i + 1];
+            break;
+        }
+    }
+    end = next.segment >= 0 ? next.pts : jc->input_end;
+    pthread_mutex_unlock(&jc->lock);
+    if (start.segment < 0 || segment != jc->ckpt.next_segment) {
+        av_log(NULL, AV_LOG_WARNING, "Segment %s does not follow the checkpoint, not recorded\n", url);
+        return 0;
+    }
 
+    if ((ret = checkpoint_add_segment(&jc->ckpt, av_basename(url), start.pts * av_q2d(tb),
+                                      end * av_q2d(tb))) < 0)
+        return ret;
+    jc->ckpt.next_segment = segment + 1;
+    if ((ret = checkpoint_write_manifest(job->outputs[0].filename, &jc->ckpt, 0)) < 0) {
+        av_log(NULL, AV_LOG_ERROR, "Cannot write manifest %s\n", job->outputs[0].filename);
+        return ret;
+    }
+    if (next.segment < 0)
+        return 0;
+    jc->ckpt.input_pos = next.pos;
+    jc->ckpt.input_pts = next.pts;
+    jc->ckpt.input_frame = next.frame;
+    if ((ret = checkpoint_write(jc->filename, &jc->ckpt)) < 0)
+        av_log(NULL, AV_LOG_ERROR, "Cannot write checkpoint %s\n", jc->filename);
+    return ret;
+}
+
+/* A copied packet goes to the mux_q of every output, the last one gets the
+ * packet itself, the others a new reference. */
+static int copy_packet(Pipeline *p, AVPacket *packet)
+{
+    AVStream *st = p->job->ifmt_ctx->streams[packet->stream_index];
+    int ret;
+
+    packet->stream_index = p->job->stream_ctx[packet->stream_index].out_index;
+    packet->time_base = st->time_base;
+    for (int i = 0; i < p->nb_outputs; i++) {
+        AVPacket *out = packet;
+
+        if (i < p->nb_outputs - 1) {
+            if (!(out = media_pool_get_packet()))
+                return AVERROR(ENOMEM);
+            if ((ret = av_packet_ref(out, packet)) < 0) {
+                media_pool_put_packet(&out);
+                return ret;
+            }
+            out->time_base = packet->time_base;
+        }
+        if ((ret = frame_queue_push(&p->outputs[i].mux_q, out)) < 0) {
+            if (out != packet)
+                media_pool_put_packet(&out);
+            return ret;
+        }
+    }
+    return 0;
+}
+
+static void *demux_thread(void *arg)
+{
+    Pipeline *p = arg;
+    AVPacket *packet;
+    int has_copied = 0;
+    int ret;
+
+    while (1) {
+        int64_t start = stage_stats_now();
+        StreamContext *sc;
+
+        packet = media_pool_get_packet();
+        if (!packet) {
+            ret = AVERROR(ENOMEM);
+            goto fail;
+        }
+        ret = read_input_packet(p->job, packet);
+        if (ret < 0) {
+            media_pool_put_packet(&packet);
+            break;
+        }
+        ALOG(AV_LOG_DEBUG, "Demuxer gave frame of stream_index %u\n",
+             packet->stream_index);
+
+        /* streams that show up after the header are not mapped */
+        sc = packet->stream_index < p->nb_streams ?
+             &p->job->stream_ctx[packet->stream_index] : NULL;
+        if (!sc || sc->mode == STREAM_DROP) {
+            media_pool_put_packet(&packet);
+            continue;
+        }
+        if (p->job->checkpoint && (ret = checkpoint_input_packet(p->job, packet)) != 0) {
+            media_pool_put_packet(&packet);
+            if (ret < 0)
+                goto fail;
+            continue;
+        }
+        if ((p->job->params->live || p->stats) && (ret = stamp_arrival(packet)) < 0) {
+            media_pool_put_packet(&packet);
+            goto fail;
+        }
+        stage_stats_record(p->stats, STAGE_DEMUX, start);
+
+        if (sc->mode == STREAM_COPY)
+            ret = copy_packet(p, packet);
+        else
+            ret = frame_queue_push(&p->streams[packet->stream_index].demux_q, packet);
+        if (ret < 0) {
+            media_pool_put_packet(&packet);
+            goto fail;
+        }
+    }
+    if (ret != AVERROR_EOF)
+        goto fail;
+
+    for (int i = 0; i < p->nb_streams; i++) {
+        if (is_transcoded(p, i))
+            frame_queue_finish(&p->streams[i].demux_q);
+        has_copied |= p->job->stream_ctx[i].mode == STREAM_COPY;
+    }
+    for (int i = 0; has_copied && i < p->nb_outputs; i++)
+        output_producer_done(&p->outputs[i]);
+    return NULL;
+fail:
+    pipeline_fail(p, ret);
+    return NULL;
+}
+
+static int receive_decoded_frames(PipelineStream *ps, AVCodecContext *dec_ctx)
+{
+    AVFrame *frame;
+    int ret;
+
+    while (1) {
+        frame = media_pool_get_frame();
+        if (!frame)
+            return AVERROR(ENOMEM);
+
+        ret = avcodec_receive_frame(dec_ctx, frame);
+        if (ret < 0) {
+            media_pool_put_frame(&frame);
+            if (ret == AVERROR_EOF || ret == AVERROR(EAGAIN))
+                return 0;
+            return ret;
+        }
+
+        frame->pts = frame->best_effort_timestamp;
+        if ((ret = frame_queue_push(&ps->decode_q, frame)) < 0) {
+            media_pool_put_frame(&frame);
+            return ret;
+        }
+    }
+}
+
+static int receive_pool_frames(PipelineStream *ps, DecodePool *pool)
+{
+    AVFrame *frame;
+    int ret;
+
+    while ((ret = decode_pool_receive_frame(pool, &frame)) >= 0) {
+        frame->pts = frame->best_effort_timestamp;
+        if ((ret = frame_queue_push(&ps->decode_q, frame)) < 0) {
+            media_pool_put_frame(&frame);
+            return ret;
+        }
+    }
+    if (ret == AVERROR_EOF || ret == AVERROR(EAGAIN))
+        return 0;
+    return ret;
+}
+
+/* packet == NULL flushes the decoder */
+static int decode_packet(PipelineStream *ps, StreamContext *stream, AVPacket *packet)
+{
+    int ret;
+
+    if (stream->dec_pool) {
+        while ((ret = decode_pool_send_packet(stream->dec_pool, packet)) == AVERROR(EAGAIN)) {
+            if ((ret = receive_pool_frames(ps, stream->dec_pool)) < 0)
+                return ret;
+        }
+        if (ret < 0)
+            return ret;
+        return receive_pool_frames(ps, stream->dec_pool);
+    }
+
+    if ((ret = avcodec_send_packet(stream->dec_ctx, packet)) < 0)
+        return ret;
+    return receive_decoded_frames(ps, stream->dec_ctx);
+}
+
+static void *decode_thread(void *arg)
+{
+    PipelineStream *ps = arg;
+    Pipeline *p = ps->p;
+    StreamContext *stream = &p->job->stream_ctx[ps->index];
+    AVPacket *packet;
+    int ret;
+
+    while ((ret = frame_queue_pop(&ps->demux_q, (void **)&packet)) >= 0) {
+        int64_t start = stage_stats_now();
+
+        if (stream->packet_dedup && (ret = frame_dedup_packet(stream->packet_dedup, packet))) {
+            media_pool_put_packet(&packet);
+            if (ret < 0)
+                goto fail;
+            ALOG(AV_LOG_TRACE, "Repeated image, not decoded\n");
+            continue;
+        }
+        ALOG(AV_LOG_DEBUG, "Going to reencode&filter the frame\n");
+
+        ret = decode_packet(ps, stream, packet);
+        media_pool_put_packet(&packet);
+        stage_stats_record(p->stats, STAGE_DECODE, start);
+        if (ret < 0) {
+            av_log(NULL, AV_LOG_ERROR, "Decoding failed\n");
+            goto fail;
+        }
+    }
+    if (ret != AVERROR_EOF)
+        goto fail;
+
+    /* a run of repeats up to the end still needs its last image, or the
+     * output ends where the run started */
+    if (stream->packet_dedup) {
+        if (!(packet = media_pool_get_packet())) {
+            ret = AVERROR(ENOMEM);
+            goto fail;
+        }
+        ret = 0;
+        if (frame_dedup_tail_packet(stream->packet_dedup, packet))
+            ret = decode_packet(ps, stream, packet);
+        media_pool_put_packet(&packet);
+        if (ret < 0)
+            goto fail;
+    }
+
+    /* flush decoder */
+    av_log(NULL, AV_LOG_INFO, "Flushing stream %u decoder\n", ps->index);
+    ret = decode_packet(ps, stream, NULL);
+    if (ret < 0) {
+        av_log(NULL, AV_LOG_ERROR, "Flushing decoding failed\n");
+        goto fail;
+    }
+
+    frame_queue_finish(&ps->decode_q);
+    return NULL;
+fail:
+    pipeline_fail(p, ret);
+    return NULL;
+}
+
+/* Account for the pixel data between an input and an output frame of the
+ * filter stage. A frame that still points at decoded, the decoder's buffer,
+ * cost nothing, anything else was either converted or copied. A NULL in
+ * counts as a conversion. */
+static void account_frame_copy(FilteringContext *filter, const uint8_t *decoded,
+                               const AVFrame *in, const AVFrame *out)
+{
+    int size;
+
+    /* audio is not worth counting */
+    if (out->nb_samples)
+        return;
+    filter->nb_frames++;
+    if (decoded && out->data[0] == decoded)
+        return;
+
+    size = av_image_get_buffer_size(out->format, out->width, out->height, 1);
+    if (size < 0)
+        return;
+    if (!in || out->format != in->format || out->width != in->width ||
+        out->height != in->height)
+        filter->converted_bytes += size;
+    else
+        filter->copied_bytes += size;
+    ALOG(AV_LOG_DEBUG, "Filter stage: %d bytes of pixel data written for frame %"PRId64"\n",
+         size, filter->nb_frames);
+}
+
+/* Convert a decoded frame to the encoder's yuv420p, in place when the
+ * filter stage holds the only reference. Otherwise (mjpegdec keeps its
+ * last picture referenced) the frame is converted out of place into a
+ * buffer of the filter's pool and replaced by it. */
+static int convert_frame(FilteringContext *filter, AVFrame *frame)
+{
+    AVFrame *converted;
+    int size, ret;
+
+    if (av_frame_is_writable(frame))
+        return yuv_convert_frame(frame);
+
+    size = av_image_get_buffer_size(AV_PIX_FMT_YUV420P, frame->width, frame->height, 32);
+    if (size < 0)
+        return size;
+    if (!filter->convert_pool || filter->convert_pool_size != size) {
+        av_buffer_pool_uninit(&filter->convert_pool);
+        if (!(filter->convert_pool = av_buffer_pool_init(size, NULL)))
+            return AVERROR(ENOMEM);
+        filter->convert_pool_size = size;
+    }
+    if (!(converted = media_pool_get_frame()))
+        return AVERROR(ENOMEM);
+    converted->format = AV_PIX_FMT_YUV420P;
+    converted->width = frame->width;
+    converted->height = frame->height;
+    if (!(converted->buf[0] = av_buffer_pool_get(filter->convert_pool)))
+        ret = AVERROR(ENOMEM);
+    else
+        ret = av_image_fill_arrays(converted->data, converted->linesize, converted->buf[0]->data,
+                                   AV_PIX_FMT_YUV420P, frame->width, frame->height, 32);
+    if (ret >= 0)
+        ret = yuv_convert_frame_to(converted, frame);
+    if (ret < 0) {
+        media_pool_put_frame(&converted);
+        return ret;
+    }
+    av_frame_unref(frame);
+    av_frame_move_ref(frame, converted);
+    media_pool_put_frame(&converted);
+    return 0;
+}
+
+/* frame == NULL flushes the filter graph */
+static int filter_frame(PipelineStream *ps, AVFrame *frame)
+{
+    Pipeline *p = ps->p;
+    FilteringContext *filter = &p->job->filter_ctx[ps->index];
+    AVFrame *filtered_frame;
+    const uint8_t *decoded;
+    int ret;
+
+    if (filter->passthrough || filter->convert) {
+        if (!frame)
+            return 0;
+        filtered_frame = media_pool_get_frame();
+        if (!filtered_frame)
+            return AVERROR(ENOMEM);
+        /* hand over the decoder's buffer reference, the pixels stay put */
+        decoded = frame->data[0];
+        av_frame_move_ref(filtered_frame, frame);
+        if (filter->convert && (ret = convert_frame(filter, filtered_frame)) < 0) {
+            av_log(NULL, AV_LOG_ERROR, "Error converting the decoded frame\n");
+            media_pool_put_frame(&filtered_frame);
+            return ret;
+        }
+        if (filter->passthrough)
+            frame_as_encoder_format(filtered_frame, p->job->outputs[0].enc_ctx[ps->index]);
+        filtered_frame->time_base = p->job->stream_ctx[ps->index].dec_ctx->pkt_timebase;
+        filtered_frame->pict_type = AV_PICTURE_TYPE_NONE;
+        /* a converted frame counts as written whether or not it got a new buffer */
+        account_frame_copy(filter, filter->convert ? NULL : decoded, NULL, filtered_frame);
+        if ((ret = frame_queue_push(&pipeline_encoder(p, 0, ps->index)->filter_q,
+                                    filtered_frame)) < 0)
+            media_pool_put_frame(&filtered_frame);
+        return ret;
+    }
+
+    ALOG(AV_LOG_TRACE, "Pushing decoded frame to filters\n");
+    /* push the decoded frame into the filtergraph. The graph gets its own
+     * reference (no pixel copy, decoder frames are always ref-counted) and
+     * we keep ours to see whether the output still uses the same buffer.
+     * MJPEG does not change format mid-stream, so skip that check for video;
+     * audio may change its sample format or channel layout. */
+    ret = av_buffersrc_add_frame_flags(filter->buffersrc_ctx, frame,
+                                       AV_BUFFERSRC_FLAG_KEEP_REF |
+                                       (p->job->stream_ctx[ps->index].dec_ctx->codec_type ==
+                                        AVMEDIA_TYPE_VIDEO ? AV_BUFFERSRC_FLAG_NO_CHECK_FORMAT : 0));
+    if (ret < 0) {
+        av_log(NULL, AV_LOG_ERROR, "Error while feeding the filtergraph\n");
+        return ret;
+    }
+
+    /* pull filtered frames from every sink of the filtergraph */
+    for (int i = 0; i < filter->nb_sinks; i++) {
+        while (1) {
+            ALOG(AV_LOG_TRACE, "Pulling filtered frame from filters\n");
+            filtered_frame = media_pool_get_frame();
+            if (!filtered_frame)
+                return AVERROR(ENOMEM);
+
+            ret = av_buffersink_get_frame(filter->buffersink_ctx[i], filtered_frame);
+            if (ret < 0) {
+                media_pool_put_frame(&filtered_frame);
+                /* if no more frames for output - returns AVERROR(EAGAIN)
+                 * if flushed and no more frames for output - returns AVERROR_EOF
+                 * rewrite retcode to 0 to show it as normal procedure completion
+                 */
+                if (ret == AVERROR(EAGAIN) || ret == AVERROR_EOF)
+                    ret = 0;
+                break;
+            }
+
+            account_frame_copy(filter, frame ? frame->data[0] : NULL, frame, filtered_frame);
+            filtered_frame->time_base = av_buffersink_get_time_base(filter->buffersink_ctx[i]);
+            filtered_frame->pict_type = AV_PICTURE_TYPE_NONE;
+            if ((ret = frame_queue_push(&pipeline_encoder(p, i, ps->index)->filter_q,
+                                        filtered_frame)) < 0) {
+                media_pool_put_frame(&filtered_frame);
+                return ret;
+            }
+        }
+        if (ret < 0)
+            return ret;
+    }
+
+    return 0;
+}
+
+static void *filter_thread(void *arg)
+{
+    PipelineStream *ps = arg;
+    Pipeline *p = ps->p;
+    FrameDedup *dedup = p->job->stream_ctx[ps->index].frame_dedup;
+    AVFrame *frame;
+    int ret;
+
+    while ((ret = frame_queue_pop(&ps->decode_q, (void **)&frame)) >= 0) {
+        int64_t start = stage_stats_now();
+
+        if (dedup && (ret = frame_dedup_frame(dedup, frame))) {
+            media_pool_put_frame(&frame);
+            if (ret < 0)
+                goto fail;
+            continue;
+        }
+        ret = filter_frame(ps, frame);
+        media_pool_put_frame(&frame);
+        stage_stats_record(p->stats, STAGE_FILTER, start);
+        if (ret < 0)
+            goto fail;
+    }
+    if (ret != AVERROR_EOF)
+        goto fail;
+
+    /* the last static frame, so the output lasts as long as the input */
+    if (dedup) {
+        if (!(frame = media_pool_get_frame())) {
+            ret = AVERROR(ENOMEM);
+            goto fail;
+        }
+        ret = 0;
+        if (frame_dedup_tail_frame(dedup, frame))
+            ret = filter_frame(ps, frame);
+        media_pool_put_frame(&frame);
+        if (ret < 0)
+            goto fail;
+    }
+
+    /* flush filter */
+    if ((ret = filter_frame(ps, NULL)) < 0) {
+        av_log(NULL, AV_LOG_ERROR, "Flushing filter failed\n");
+        goto fail;
+    }
+
+    for (int i = 0; i < p->nb_outputs; i++)
+        frame_queue_finish(&pipeline_encoder(p, i, ps->index)->filter_q);
+    return NULL;
+fail:
+    pipeline_fail(p, ret);
+    return NULL;
+}
+
+/* filt_frame == NULL flushes the encoder */
+static int encode_write_frame(PipelineEncoder *pe, AVFrame *filt_frame)
+{
+    PipelineOutput *po = pe->po;
+    AVCodecContext *enc_ctx = po->of->enc_ctx[pe->index];
+    AVPacket *enc_pkt;
+    int ret;
+
+    ALOG(AV_LOG_TRACE, "Encoding frame\n");
+    /* encode filtered frame */
     if (filt_frame && filt_frame->pts != AV_NOPTS_VALUE)
         filt_frame->pts = av_rescale_q(filt_frame->pts, filt_frame->time_base,
-                                       stream->enc_ctx->time_base);
+                                       enc_ctx->time_base);
+    if (filt_frame && enc_ctx->codec_type == AVMEDIA_TYPE_VIDEO)
+        mark_segment_start(filt_frame, enc_ctx->time_base, po->p->job->params->segment_seconds,
+                           &pe->segment_index);
+
+    ret = avcodec_send_frame(enc_ctx, filt_frame);
+    if (ret < 0)
+        return ret;
+
+    while (1) {
+        enc_pkt = media_pool_get_packet();
+        if (!enc_pkt)
+            return AVERROR(ENOMEM);
+
+        ret = avcodec_receive_packet(enc_ctx, enc_pkt);
+        if (ret < 0) {
+            media_pool_put_packet(&enc_pkt);
+            if (ret == AVERROR(EAGAIN) || ret == AVERROR_EOF)
+                return 0;
+            return ret;
+        }
+
+        /* prepare packet for muxing, the mux stage rescales to the stream time base */
+        enc_pkt->stream_index = po->p->job->stream_ctx[pe->index].out_index;
+        enc_pkt->time_base = enc_ctx->time_base;
+        if ((ret = frame_queue_push(&po->mux_q, enc_pkt)) < 0) {
+            media_pool_put_packet(&enc_pkt);
+            return ret;
+        }
+    }
+}
+
+static int flush_encoder(PipelineEncoder *pe)
+{
+    if (!(pe->po->of->enc_ctx[pe->index]->codec->capabilities & AV_CODEC_CAP_DELAY))
+        return 0;
+
+    av_log(NULL, AV_LOG_INFO, "Flushing stream #%u encoder of %s\n", pe->index,
+           pe->po->of->filename);
+    return encode_write_frame(pe, NULL);
+}
+
+static void *encode_thread(void *arg)
+{
+    PipelineEncoder *pe = arg;
+    Pipeline *p = pe->po->p;
+    AVFrame *frame;
+    int ret;
+
+    while ((ret = frame_queue_pop(&pe->filter_q, (void **)&frame)) >= 0) {
+        int64_t start = stage_stats_now();
+
+        ret = encode_write_frame(pe, frame);
+        media_pool_put_frame(&frame);
+        stage_stats_record(p->stats, STAGE_ENCODE, start);
+        if (ret < 0)
+            goto fail;
+    }
+    if (ret != AVERROR_EOF)
+        goto fail;
+
+    /* flush encoder */
+    if ((ret = flush_encoder(pe)) < 0) {
+        av_log(NULL, AV_LOG_ERROR, "Flushing encoder failed\n");
+        goto fail;
+    }
+
+    output_producer_done(pe->po);
+    return NULL;
+fail:
+    pipeline_fail(p, ret);
+    return NULL;
+}
+
+static void *mux_thread(void *arg)
+{
+    PipelineOutput *po = arg;
+    Pipeline *p = po->p;
+    AVFormatContext *ofmt_ctx = po->of->ofmt_ctx;
+    AVPacket *enc_pkt;
+    int ret;
+
+    while ((ret = frame_queue_pop(&po->mux_q, (void **)&enc_pkt)) >= 0) {
+        int64_t arrival = AV_NOPTS_VALUE, pts = enc_pkt->pts;
+        int64_t start = stage_stats_now();
+        int video = ofmt_ctx->streams[enc_pkt->stream_index]->codecpar->codec_type ==
+                    AVMEDIA_TYPE_VIDEO;
+
+        if (enc_pkt->opaque_ref)
+            arrival = *(int64_t *)enc_pkt->opaque_ref->data;
+        av_packet_rescale_ts(enc_pkt, enc_pkt->time_base,
+                             ofmt_ctx->streams[enc_pkt->stream_index]->time_base);
+
+        ALOG(AV_LOG_TRACE, "Muxing frame\n");
+        /* mux encoded frame, packets of the streams are interleaved by the muxer */
+        ret = av_interleaved_write_frame(ofmt_ctx, enc_pkt);
+        media_pool_put_packet(&enc_pkt);
+        if (ret < 0)
+            goto fail;
+        stage_stats_record(p->stats, STAGE_MUX, start);
+        /* latency is that of the video frames */
+        if (arrival != AV_NOPTS_VALUE && video) {
+            stage_stats_record(p->stats, STAGE_PIPELINE, arrival);
+            if (p->job->params->live)
+                account_latency(po, pts, arrival);
+        }
+    }
+    if (ret != AVERROR_EOF)
+        goto fail;
+
+    return NULL;
+fail:
+    pipeline_fail(p, ret);
+    return NULL;
+}
+
+/* the deepest queue of a stage, over streams and outputs */
+static int pipeline_queue_depth(void *opaque, enum StatsStage stage)
+{
+    Pipeline *p = opaque;
+    int depth = 0;
+
+    if (stage != STAGE_DECODE && stage != STAGE_FILTER && stage != STAGE_ENCODE &&
+        stage != STAGE_MUX)
+        return -1;
+    for (int i = 0; i < p->nb_streams; i++) {
+        if (!is_transcoded(p, i))
+            continue;
+        if (stage == STAGE_DECODE)
+            depth = FFMAX(depth, frame_queue_size(&p->streams[i].demux_q));
+        else if (stage == STAGE_FILTER)
+            depth = FFMAX(depth, frame_queue_size(&p->streams[i].decode_q));
+        for (int j = 0; stage == STAGE_ENCODE && j < p->nb_outputs; j++)
+            depth = FFMAX(depth, frame_queue_size(&pipeline_encoder(p, j, i)->filter_q));
+    }
+    for (int i = 0; stage == STAGE_MUX && i < p->nb_outputs; i++)
+        depth = FFMAX(depth, frame_queue_size(&p->outputs[i].mux_q));
+    return depth;
+}
+
+/* demux, decode and filter per transcoded stream, mux per output and
+ * encode per transcoded stream of every output */
+static int start_pipeline_threads(Pipeline *p, pthread_t *threads, int *nb_threads)
+{
+    int ret;
+
+    if ((ret = pthread_create(&threads[(*nb_threads)++], NULL, demux_thread, p)))
+        goto fail;
+    for (int i = 0; i < p->nb_streams; i++) {
+        if (!is_transcoded(p, i))
+            continue;
+        if ((ret = pthread_create(&threads[(*nb_threads)++], NULL, decode_thread,
+                                  &p->streams[i])) ||
+            (ret = pthread_create(&threads[(*nb_threads)++], NULL, filter_thread,
+                                  &p->streams[i])))
+            goto fail;
+        for (int j = 0; j < p->nb_outputs; j++) {
+            if ((ret = pthread_create(&threads[(*nb_threads)++], NULL, encode_thread,
+                                      pipeline_encoder(p, j, i))))
+                goto fail;
+        }
+    }
+    for (int i = 0; i < p->nb_outputs; i++) {
+        if ((ret = pthread_create(&threads[(*nb_threads)++], NULL, mux_thread,
+                                  &p->outputs[i])))
+            goto fail;
+    }
+    return 0;
+fail:
+    /* the one that failed was not started */
+    (*nb_threads)--;
+    return AVERROR(ret);
+}
 
-    ret = avcodec_send_frame(stream->enc_ctx, filt_frame);
+static int run_pipeline(TranscodeJob *job)
+{
+    pthread_t *threads = NULL;
+    Pipeline p = { 0 };
+    int nb_threads = 0;
+    int ret;
+
+    if ((ret = pipeline_init(&p, job)) < 0)
+        goto end;
+    if (job->params->stats)
+        p.stats = job->params->stats;
+    else if (job->params->stats_sink &&
+             (ret = stage_stats_alloc(&p.stats, job->params->stats_sink,
+                                      job->params->stats_interval_ms,
+                                      pipeline_queue_depth, &p)) < 0)
+        goto end;
+
+    threads = av_calloc(1 + p.nb_streams * (2 + p.nb_outputs) + p.nb_outputs, sizeof(*threads));
+    if (!threads) {
+        ret = AVERROR(ENOMEM);
+        goto end;
+    }
+    if ((ret = start_pipeline_threads(&p, threads, &nb_threads)) < 0) {
+        av_log(NULL, AV_LOG_ERROR, "Cannot create pipeline thread\n");
+        pipeline_fail(&p, ret);
+    }
+    for (int i = 0; i < nb_threads; i++)
+        pthread_join(threads[i], NULL);
+
+    ret = atomic_load(&p.error);
+    for (int i = 0; i < p.nb_outputs; i++) {
+        PipelineOutput *po = &p.outputs[i];
+
+        if (po->nb_latency)
+            av_log(NULL, AV_LOG_INFO, "Latency of %s: %"PRId64" frames, avg %.1f ms, "
+                   "max %.1f ms, %"PRId64" over budget\n", po->of->filename, po->nb_latency,
+                   po->latency_sum / 1000.0 / po->nb_latency, po->latency_max / 1000.0,
+                   po->nb_over_budget);
+    }
+end:
+    av_free(threads);
+    pipeline_uninit(&p);
+    return ret;
+}
+
+/*
+ * Chunked mode: MJPEG is intra-only, so the input can be cut at any packet.
+ * The demux thread groups packets into chunks of chunk_frames, the workers
+ * encode each chunk with a fresh VP9 encoder (which starts with a keyframe)
+ * and the mux thread writes the chunks back in input order. Frame
+ * timestamps are carried through unchanged, so the joined stream keeps the
+ * input timing.
+ */
+typedef struct Chunk {
+    int index;
+    AVPacket **in_pkts;  /* MJPEG packets of this chunk */
+    int nb_in_pkts;
+    AVPacket **out_pkts; /* VP9 packets, in encoder time base */
+    int nb_out_pkts;
+
+    /* keyframes at segment starts, see mark_segment_start() */
+    double segment_seconds;
+    int64_t segment_index;
+
+    /* protected by ChunkedEncoder.lock */
+    int done;
+    int error;
+} Chunk;
+
+typedef struct ChunkedEncoder {
+    FrameQueue work_q;  /* Chunk*, waiting for a worker */
+    FrameQueue order_q; /* Chunk*, in input order, waiting for the muxer */
+    TranscodeJob *job;
+    Chunk *held;        /* chunk the muxer stopped waiting for */
+    char *filter_spec;  /* "null", or a scale to the output size */
+    int chunk_frames;
+    int global_header;
+    int encoder_cores;
+
+    pthread_mutex_t lock;
+    pthread_cond_t chunk_done;
+    atomic_int error;
+} ChunkedEncoder;
+
+typedef struct ChunkWorker {
+    ChunkedEncoder *ce;
+    AVCodecContext *dec_ctx;
+    pthread_t thread;
+} ChunkWorker;
+
+static void free_packet_list(AVPacket ***pkts, int *nb_pkts)
+{
+    for (int i = 0; i < *nb_pkts; i++)
+        media_pool_put_packet(&(*pkts)[i]);
+    av_freep(pkts);
+    *nb_pkts = 0;
+}
+
+static void chunk_free(Chunk **pchunk)
+{
+    Chunk *chunk = *pchunk;
+
+    if (!chunk)
+        return;
+    free_packet_list(&chunk->in_pkts, &chunk->nb_in_pkts);
+    free_packet_list(&chunk->out_pkts, &chunk->nb_out_pkts);
+    av_freep(pchunk);
+}
+
+static void free_chunk_item(void **item)
+{
+    chunk_free((Chunk **)item);
+}
+
+static void chunked_fail(ChunkedEncoder *ce, int err)
+{
+    int expected = 0;
+
+    if (err == AVERROR_EXIT)
+        return;
+    atomic_compare_exchange_strong(&ce->error, &expected, err);
+    frame_queue_abort(&ce->work_q);
+    frame_queue_abort(&ce->order_q);
+
+    pthread_mutex_lock(&ce->lock);
+    pthread_cond_broadcast(&ce->chunk_done);
+    pthread_mutex_unlock(&ce->lock);
+}
+
+/* frame == NULL flushes the encoder */
+static int chunk_encode_frame(Chunk *chunk, AVCodecContext *enc_ctx, AVFrame *frame)
+{
+    AVPacket *enc_pkt;
+    int ret;
+
+    if (frame)
+        mark_segment_start(frame, enc_ctx->time_base, chunk->segment_seconds,
+                           &chunk->segment_index);
+    ret = avcodec_send_frame(enc_ctx, frame);
+    if (ret < 0)
+        return ret;
+
+    while (1) {
+        enc_pkt = media_pool_get_packet();
+        if (!enc_pkt)
+            return AVERROR(ENOMEM);
+
+        ret = avcodec_receive_packet(enc_ctx, enc_pkt);
+        if (ret < 0) {
+            media_pool_put_packet(&enc_pkt);
+            if (ret == AVERROR(EAGAIN) || ret == AVERROR_EOF)
+                return 0;
+            return ret;
+        }
+
+        enc_pkt->stream_index = 0;
+        enc_pkt->time_base = enc_ctx->time_base;
+        ret = av_dynarray_add_nofree(&chunk->out_pkts, &chunk->nb_out_pkts, enc_pkt);
+        if (ret < 0) {
+            media_pool_put_packet(&enc_pkt);
+            return ret;
+        }
+    }
+}
+
+/* frame == NULL flushes the filter graph and the encoder */
+static int chunk_filter_encode(Chunk *chunk, FilteringContext *fctx, AVCodecContext *dec_ctx,
+                               AVCodecContext *enc_ctx, AVFrame *frame)
+{
+    AVFrame *filt_frame;
+    int ret;
+
+    if (fctx->passthrough || fctx->convert) {
+        if (frame && fctx->convert && (ret = convert_frame(fctx, frame)) < 0)
+            return ret;
+        if (frame && fctx->passthrough)
+            frame_as_encoder_format(frame, enc_ctx);
+        if (frame && frame->pts != AV_NOPTS_VALUE)
+            frame->pts = av_rescale_q(frame->pts, dec_ctx->pkt_timebase, enc_ctx->time_base);
+        if (frame)
+            frame->pict_type = AV_PICTURE_TYPE_NONE;
+        return chunk_encode_frame(chunk, enc_ctx, frame);
+    }
+
+    ret = av_buffersrc_add_frame_flags(fctx->buffersrc_ctx, frame, 0);
+    if (ret < 0) {
+        av_log(NULL, AV_LOG_ERROR, "Error while feeding the filtergraph\n");
+        return ret;
+    }
+
+    filt_frame = media_pool_get_frame();
+    if (!filt_frame)
+        return AVERROR(ENOMEM);
+
+    while ((ret = av_buffersink_get_frame(fctx->buffersink_ctx[0], filt_frame)) >= 0) {
+        if (filt_frame->pts != AV_NOPTS_VALUE)
+            filt_frame->pts = av_rescale_q(filt_frame->pts,
+                                           av_buffersink_get_time_base(fctx->buffersink_ctx[0]),
+                                           enc_ctx->time_base);
+        filt_frame->pict_type = AV_PICTURE_TYPE_NONE;
+        ret = chunk_encode_frame(chunk, enc_ctx, filt_frame);
+        av_frame_unref(filt_frame);
+        if (ret < 0)
+            break;
+    }
+    media_pool_put_frame(&filt_frame);
+    if (ret < 0 && ret != AVERROR(EAGAIN) && ret != AVERROR_EOF)
+        return ret;
+
+    if (!frame)
+        return chunk_encode_frame(chunk, enc_ctx, NULL);
+    return 0;
+}
+
+static int encode_chunk(ChunkWorker *w, Chunk *chunk)
+{
+    const OutputFile *of = &w->ce->job->outputs[0];
+    const StreamContext *sc = &w->ce->job->stream_ctx[0];
+    const AVStream *stream = w->ce->job->ifmt_ctx->streams[0];
+    FrameDedup *packet_dedup = NULL, *frame_dedup = NULL;
+    FilteringContext fctx = { 0 };
+    AVCodecContext *enc_ctx = NULL;
+    AVFrame *frame = NULL;
+    int ret;
+
+    chunk->segment_seconds = w->ce->job->params->segment_seconds;
+    chunk->segment_index = -1;
+
+    /* a new encoder per chunk, so every chunk starts with a keyframe */
+    if ((ret = open_encoder(w->dec_ctx, of->width ? of->width : w->dec_ctx->width,
+                            of->height ? of->height : w->dec_ctx->height, w->ce->global_header,
+                            w->ce->encoder_cores, 0, w->ce->job->params->keep_chroma,
+                            of->encoder_opts, RC_PASS_SINGLE, NULL, &enc_ctx)) < 0)
+        goto end;
+    fctx.passthrough = filter_is_passthrough(w->ce->filter_spec, w->dec_ctx, enc_ctx);
+    fctx.convert = filter_can_convert(w->ce->filter_spec, w->dec_ctx, enc_ctx);
+    if (!fctx.passthrough && !fctx.convert &&
+        (ret = init_filter(&fctx, w->dec_ctx, &enc_ctx, 1, w->ce->filter_spec)) < 0)
+        goto end;
+
+    frame = media_pool_get_frame();
+    if (!frame) {
+        ret = AVERROR(ENOMEM);
+        goto end;
+    }
+    /* every chunk starts from its own first frame, like its encoder */
+    if ((sc->packet_dedup &&
+         !(packet_dedup = frame_dedup_alloc(w->ce->job->params->dedup_threshold, dedup_max_gap(stream)))) ||
+        (sc->frame_dedup &&
+         !(frame_dedup = frame_dedup_alloc(w->ce->job->params->dedup_threshold, dedup_max_gap(stream))))) {
+        ret = AVERROR(ENOMEM);
+        goto end;
+    }
+
+    /* the extra iteration sends NULL and drains the decoder */
+    for (int i = 0; i <= chunk->nb_in_pkts; i++) {
+        AVPacket *pkt = i < chunk->nb_in_pkts ? chunk->in_pkts[i] : NULL;
+
+        /* the last image is always decoded, it ends the chunk */
+        if (pkt && packet_dedup && i + 1 < chunk->nb_in_pkts &&
+            (ret = frame_dedup_packet(packet_dedup, pkt))) {
+            if (ret < 0)
+                goto end;
+            continue;
+        }
+        ret = avcodec_send_packet(w->dec_ctx, pkt);
+        if (ret < 0) {
+            av_log(NULL, AV_LOG_ERROR, "Decoding failed\n");
+            goto end;
+        }
+
+        while ((ret = avcodec_receive_frame(w->dec_ctx, frame)) >= 0) {
+            frame->pts = frame->best_effort_timestamp;
+            if (frame_dedup && (ret = frame_dedup_frame(frame_dedup, frame))) {
+                av_frame_unref(frame);
+                if (ret < 0)
+                    goto end;
+                continue;
+            }
+            ret = chunk_filter_encode(chunk, &fctx, w->dec_ctx, enc_ctx, frame);
+            av_frame_unref(frame);
+            if (ret < 0)
+                goto end;
+        }
+        if (ret != AVERROR(EAGAIN) && ret != AVERROR_EOF)
+            goto end;
+    }
 
-    if (ret < 0)
-        return ret;
+    if (frame_dedup && frame_dedup_tail_frame(frame_dedup, frame)) {
+        ret = chunk_filter_encode(chunk, &fctx, w->dec_ctx, enc_ctx, frame);
+        av_frame_unref(frame);
+        if (ret < 0)
+            goto end;
+    }
+    ret = chunk_filter_encode(chunk, &fctx, w->dec_ctx, enc_ctx, NULL);
+    if (ret >= 0)
+        av_log(NULL, AV_LOG_INFO, "Chunk %d: %d frames in, %d packets out, "
+               "%"PRId64" repeated and %"PRId64" static frames dropped\n",
+               chunk->index, chunk->nb_in_pkts, chunk->nb_out_pkts,
+               packet_dedup ? frame_dedup_nb_dropped(packet_dedup) : 0,
+               frame_dedup ? frame_dedup_nb_dropped(frame_dedup) : 0);
 
-    while (ret >= 0) {
-        ret = avcodec_receive_packet(stream->enc_ctx, enc_pkt);
+end:
+    /* reuse the decoder for the next chunk */
+    avcodec_flush_buffers(w->dec_ctx);
+    free_packet_list(&chunk->in_pkts, &chunk->nb_in_pkts);
+    media_pool_put_frame(&frame);
+    frame_dedup_free(&packet_dedup);
+    frame_dedup_free(&frame_dedup);
+    avfilter_graph_free(&fctx.filter_graph);
+    av_buffer_pool_uninit(&fctx.convert_pool);
+    avcodec_free_context(&enc_ctx);
+    return ret;
+}
 
-        if (ret == AVERROR(EAGAIN) || ret == AVERROR_EOF)
-            return 0;
+static void *chunk_worker_thread(void *arg)
+{
+    ChunkWorker *w = arg;
+    ChunkedEncoder *ce = w->ce;
+    Chunk *chunk;
+    int ret;
 
-        /* prepare packet for muxing */
-        enc_pkt->stream_index = 0;
-        av_packet_rescale_ts(enc_pkt,
-                             stream->enc_ctx->time_base,
-                             ofmt_ctx->streams[0]->time_base);
+    while ((ret = frame_queue_pop(&ce->work_q, (void **)&chunk)) >= 0) {
+        ret = encode_chunk(w, chunk);
 
-        av_log(NULL, AV_LOG_DEBUG, "Muxing frame\n");
-        /* mux encoded frame */
-        ret = av_interleaved_write_frame(ofmt_ctx, enc_pkt);
+        pthread_mutex_lock(&ce->lock);
+        chunk->error = ret < 0 ? ret : 0;
+        chunk->done = 1;
+        pthread_cond_broadcast(&ce->chunk_done);
+        pthread_mutex_unlock(&ce->lock);
+        if (ret < 0)
+            goto fail;
     }
+    if (ret != AVERROR_EOF)
+        goto fail;
 
-    return ret;
+    return NULL;
+fail:
+    chunked_fail(ce, ret);
+    return NULL;
 }
 
-static int filter_encode_write_frame(AVFrame *frame)
+/* once on order_q the chunk belongs to the muxer side, even if the push to
+ * work_q fails because the run was aborted */
+static int submit_chunk(ChunkedEncoder *ce, Chunk **pchunk)
 {
-    FilteringContext *filter = &filter_ctx[0];
     int ret;
 
-    av_log(NULL, AV_LOG_INFO, "Pushing decoded frame to filters\n");
-    /* push the decoded frame into the filtergraph */
-    ret = av_buffersrc_add_frame_flags(filter->buffersrc_ctx,
-                                       frame, 0);
-    if (ret < 0) {
-        av_log(NULL, AV_LOG_ERROR, "Error while feeding the filtergraph\n");
+    if ((ret = frame_queue_push(&ce->order_q, *pchunk)) < 0)
         return ret;
-    }
+    ret = frame_queue_push(&ce->work_q, *pchunk);
+    *pchunk = NULL;
+    return ret;
+}
+
+static void *chunk_demux_thread(void *arg)
+{
+    ChunkedEncoder *ce = arg;
+    Chunk *chunk = NULL;
+    AVPacket *packet;
+    int nb_chunks = 0;
+    int ret;
 
-    /* pull filtered frames from the filtergraph */
     while (1) {
-        av_log(NULL, AV_LOG_INFO, "Pulling filtered frame from filters\n");
-        ret = av_buffersink_get_frame(filter->buffersink_ctx,
-                                      filter->filtered_frame);
+        if (!chunk) {
+            chunk = av_mallocz(sizeof(*chunk));
+            if (!chunk) {
+                ret = AVERROR(ENOMEM);
+                goto fail;
+            }
+            chunk->index = nb_chunks++;
+        }
+
+        packet = media_pool_get_packet();
+        if (!packet) {
+            ret = AVERROR(ENOMEM);
+            goto fail;
+        }
+        ret = read_input_packet(ce->job, packet);
         if (ret < 0) {
-            /* if no more frames for output - returns AVERROR(EAGAIN)
-             * if flushed and no more frames for output - returns AVERROR_EOF
-             * rewrite retcode to 0 to show it as normal procedure completion
-             */
-            if (ret == AVERROR(EAGAIN) || ret == AVERROR_EOF)
-                ret = 0;
+            media_pool_put_packet(&packet);
             break;
         }
+        ret = av_dynarray_add_nofree(&chunk->in_pkts, &chunk->nb_in_pkts, packet);
+        if (ret < 0) {
+            media_pool_put_packet(&packet);
+            goto fail;
+        }
+
+        if (chunk->nb_in_pkts == ce->chunk_frames &&
+            (ret = submit_chunk(ce, &chunk)) < 0)
+            goto fail;
+    }
+    if (ret != AVERROR_EOF)
+        goto fail;
+
+    if (chunk->nb_in_pkts && (ret = submit_chunk(ce, &chunk)) < 0)
+        goto fail;
+    chunk_free(&chunk);
+
+    frame_queue_finish(&ce->work_q);
+    frame_queue_finish(&ce->order_q);
+    return NULL;
+fail:
+    chunk_free(&chunk);
+    chunked_fail(ce, ret);
+    return NULL;
+}
+
+static int write_chunk(AVFormatContext *ofmt_ctx, Chunk *chunk)
+{
+    int ret;
+
+    for (int i = 0; i < chunk->nb_out_pkts; i++) {
+        AVPacket *enc_pkt = chunk->out_pkts[i];
+
+        av_packet_rescale_ts(enc_pkt, enc_pkt->time_base,
+                             ofmt_ctx->streams[enc_pkt->stream_index]->time_base);
+        if ((ret = av_interleaved_write_frame(ofmt_ctx, enc_pkt)) < 0)
+            return ret;
+    }
+    return 0;
+}
+
+static void *chunk_mux_thread(void *arg)
+{
+    ChunkedEncoder *ce = arg;
+    Chunk *chunk;
+    int done, ret;
+
+    while ((ret = frame_queue_pop(&ce->order_q, (void **)&chunk)) >= 0) {
+        pthread_mutex_lock(&ce->lock);
+        while (!chunk->done && !atomic_load(&ce->error))
+            pthread_cond_wait(&ce->chunk_done, &ce->lock);
+        done = chunk->done;
+        ret = chunk->error;
+        pthread_mutex_unlock(&ce->lock);
+
+        if (!done) {
+            /* a worker may still hold it, free it after the threads are joined */
+            ce->held = chunk;
+            return NULL;
+        }
+        if (ret >= 0)
+            ret = write_chunk(ce->job->outputs[0].ofmt_ctx, chunk);
+        chunk_free(&chunk);
+        if (ret < 0)
+            goto fail;
+    }
+    if (ret != AVERROR_EOF)
+        goto fail;
 
-        filter->filtered_frame->time_base = av_buffersink_get_time_base(filter->buffersink_ctx);;
-        filter->filtered_frame->pict_type = AV_PICTURE_TYPE_NONE;
-        ret = encode_write_frame(0);
-        av_frame_unref(filter->filtered_frame);
+    return NULL;
+fail:
+    chunked_fail(ce, ret);
+    return NULL;
+}
+
+static int run_chunked(TranscodeJob *job, int nb_workers, double chunk_seconds)
+{
+    AVCodecContext *dec_ctx = job->stream_ctx[0].dec_ctx;
+    ChunkedEncoder ce = { 0 };
+    ChunkWorker *workers = NULL;
+    pthread_t demux_tid, mux_tid;
+    int nb_started = 0, demux_started = 0, mux_started = 0;
+    int ret;
+
+    ce.chunk_frames = FFMAX(1, (int)(chunk_seconds * av_q2d(dec_ctx->framerate) + 0.5));
+    ce.job = job;
+    ce.global_header = !!(job->outputs[0].ofmt_ctx->oformat->flags & AVFMT_GLOBALHEADER);
+    /* the parallel encoders share the job's cores */
+    ce.encoder_cores = FFMAX(job->nb_cores / nb_workers, 1);
+    atomic_init(&ce.error, 0);
+    pthread_mutex_init(&ce.lock, NULL);
+    pthread_cond_init(&ce.chunk_done, NULL);
+
+    if (!(ce.filter_spec = stream_filter_spec(job, 0))) {
+        ret = AVERROR(ENOMEM);
+        goto end;
+    }
+
+    /* order_q bounds the number of chunks held in memory */
+    if ((ret = frame_queue_init(&ce.work_q, nb_workers)) < 0 ||
+        (ret = frame_queue_init(&ce.order_q, 2 * nb_workers)) < 0)
+        goto end;
+
+    workers = av_calloc(nb_workers, sizeof(*workers));
+    if (!workers) {
+        ret = AVERROR(ENOMEM);
+        goto end;
+    }
+    for (int i = 0; i < nb_workers; i++) {
+        workers[i].ce = &ce;
+        /* the chunks already keep the cores busy */
+        ret = open_decoder(job->ifmt_ctx->streams[0], dec_ctx->framerate, 1, &workers[i].dec_ctx);
         if (ret < 0)
+            goto end;
+    }
+
+    av_log(NULL, AV_LOG_INFO, "Encoding %d-frame chunks on %d encoders\n",
+           ce.chunk_frames, nb_workers);
+
+    for (int i = 0; i < nb_workers; i++) {
+        if ((ret = pthread_create(&workers[i].thread, NULL, chunk_worker_thread, &workers[i]))) {
+            chunked_fail(&ce, AVERROR(ret));
             break;
+        }
+        nb_started++;
+    }
+    if (nb_started == nb_workers) {
+        if ((ret = pthread_create(&mux_tid, NULL, chunk_mux_thread, &ce)))
+            chunked_fail(&ce, AVERROR(ret));
+        else
+            mux_started = 1;
+    }
+    if (mux_started) {
+        if ((ret = pthread_create(&demux_tid, NULL, chunk_demux_thread, &ce)))
+            chunked_fail(&ce, AVERROR(ret));
+        else
+            demux_started = 1;
     }
 
+    if (demux_started)
+        pthread_join(demux_tid, NULL);
+    for (int i = 0; i < nb_started; i++)
+        pthread_join(workers[i].thread, NULL);
+    if (mux_started)
+        pthread_join(mux_tid, NULL);
+
+    ret = atomic_load(&ce.error);
+end:
+    for (int i = 0; workers && i < nb_workers; i++)
+        avcodec_free_context(&workers[i].dec_ctx);
+    av_free(workers);
+    frame_queue_destroy(&ce.work_q, NULL);
+    frame_queue_destroy(&ce.order_q, free_chunk_item);
+    chunk_free(&ce.held);
+    av_free(ce.filter_spec);
+    pthread_cond_destroy(&ce.chunk_done);
+    pthread_mutex_destroy(&ce.lock);
     return ret;
 }
 
-static int flush_encoder()
+void transcode_params_default(TranscodeParams *params)
 {
-    if (!(stream_ctx[0].enc_ctx->codec->capabilities &
-          AV_CODEC_CAP_DELAY))
-        return 0;
-
-    av_log(NULL, AV_LOG_INFO, "Flushing stream #%u encoder\n", 0);
-    return encode_write_frame(1);
+    memset(params, 0, sizeof(*params));
+    params->in_filename = "input.yuvj422p";
+    params->out_filename = "VideoOut.webm";
+    params->chunk_seconds = DEFAULT_CHUNK_SECONDS;
+    params->latency_budget_ms = DEFAULT_LATENCY_BUDGET_MS;
+    params->stats_interval_ms = DEFAULT_STATS_INTERVAL_MS;
+    params->mmap_input = 1;
+    params->output_sync = ASYNC_WRITER_SYNC_CLOSE;
+    params->dedup_threshold = -1;
 }
 
-int encode(AVFormatContext *avfc, AVStream *dec_video_avs, AVStream *enc_video_avs, AVCodecContext *video_avcc, int index) {
-    AVPacket *output_packet = av_packet_alloc();
-    int response = avcodec_send_frame(video_avcc, stream_ctx[0].dec_frame);
+int transcode_parse_renditions(TranscodeParams *params, const char *spec)
+{
+    char *list = av_strdup(spec), *token, *saveptr = NULL;
+    int ret = 0;
 
-    while (response >= 0) {
-        response = avcodec_receive_packet(video_avcc, output_packet);
-        if (response == AVERROR(EAGAIN) || response == AVERROR_EOF) {
+    if (!list)
+        return AVERROR(ENOMEM);
+    params->nb_renditions = 0;
+    for (token = av_strtok(list, ",", &saveptr); token && ret >= 0;
+         token = av_strtok(NULL, ",", &saveptr)) {
+        TranscodeRendition *r = &params->renditions[params->nb_renditions];
+        char *rate = strchr(token, '@'), *end;
+        double bit_rate = 0;
+
+        if (params->nb_renditions == TRANSCODE_MAX_RENDITIONS) {
+            ret = AVERROR(ERANGE);
             break;
-        } else if (response < 0) {
-            return -1;
         }
+        if (rate) {
+            *rate++ = '\0';
+            bit_rate = strtod(rate, &end);
+            if (*end == 'k' || *end == 'M')
+                bit_rate *= *end++ == 'k' ? 1e3 : 1e6;
+            if (end == rate || *end || bit_rate <= 0)
+                ret = AVERROR(EINVAL);
+        }
+        if (ret >= 0)
+            ret = av_parse_video_size(&r->width, &r->height, token);
+        r->bit_rate = bit_rate;
+        params->nb_renditions++;
+    }
+    av_free(list);
+    if (ret >= 0 && !params->nb_renditions)
+        ret = AVERROR(EINVAL);
+    if (ret < 0)
+        av_log(NULL, AV_LOG_ERROR, "Invalid renditions '%s', expected <W>x<H>[@<bitrate>],...\n",
+               spec);
+    return ret;
+}
+
+/* "dir/out.webm" -> "dir/out_1280x720.webm" */
+static char *rendition_filename(const char *filename, const TranscodeRendition *r)
+{
+    const char *slash = strrchr(filename, '/');
+    const char *dot = strrchr(slash ? slash : filename, '.');
+    int base_len = dot ? dot - filename : strlen(filename);
 
-        output_packet->stream_index = index;
-        output_packet->duration = enc_video_avs->time_base.den / enc_video_avs->time_base.num / dec_video_avs->avg_frame_rate.num * dec_video_avs->avg_frame_rate.den;
+    return av_asprintf("%.*s_%dx%d%s", base_len, filename, r->width, r->height,
+                       dot ? dot : "");
+}
+
+/* One output at the decoded size, or one per rendition. The encoders get
+ * cores in proportion to the pixels they encode. */
+static int init_outputs(TranscodeJob *job)
+{
+    const TranscodeParams *params = job->params;
+    int64_t total_pixels = 0;
+    int ret;
 
-        av_packet_rescale_ts(output_packet, dec_video_avs->time_base, enc_video_avs->time_base);
-        response = av_interleaved_write_frame(avfc, output_packet);
+    job->nb_outputs = FFMAX(params->nb_renditions, 1);
+    for (int i = 0; i < params->nb_renditions; i++)
+        total_pixels += (int64_t)params->renditions[i].width * params->renditions[i].height;
+    for (int i = 0; i < job->nb_outputs; i++) {
+        const TranscodeRendition *r = params->nb_renditions ? &params->renditions[i] : NULL;
+        OutputFile *of = &job->outputs[i];
+
+        of->enc_ctx = av_calloc(job->ifmt_ctx->nb_streams, sizeof(*of->enc_ctx));
+        of->filename = r ? rendition_filename(params->out_filename, r) :
+                           av_strdup(params->out_filename);
+        if (!of->enc_ctx || !of->filename)
+            return AVERROR(ENOMEM);
+        of->nb_cores = job->nb_cores;
+        if ((ret = av_dict_copy(&of->encoder_opts, params->encoder_opts, 0)) < 0)
+            return ret;
+        if (!r)
+            continue;
+
+        of->width = r->width;
+        of->height = r->height;
+        of->nb_cores = FFMAX(job->nb_cores * of->width * (int64_t)of->height / total_pixels, 1);
+        /* with crf still set, libvpx runs in constrained quality mode */
+        if (r->bit_rate && (ret = av_dict_set_int(&of->encoder_opts, "b", r->bit_rate, 0)) < 0)
+            return ret;
+        if (params->nb_renditions)
+            av_log(NULL, AV_LOG_INFO, "Rendition %dx%d on %d cores -> %s\n",
+                   of->width, of->height, of->nb_cores, of->filename);
     }
-    av_packet_unref(output_packet);
-    av_packet_free(&output_packet);
     return 0;
 }
 
-int main(int argc, char **argv)
+/* After av_write_trailer() the error of closing is the last write error. */
+static int close_output(OutputFile *of)
+{
+    int ret = 0;
+
+    if (!of->ofmt_ctx)
+        return 0;
+    if (of->async_output)
+        ret = async_writer_close(&of->ofmt_ctx->pb);
+    else if (!(of->ofmt_ctx->oformat->flags & AVFMT_NOFILE))
+        ret = avio_closep(&of->ofmt_ctx->pb);
+    of->async_output = 0;
+    return ret;
+}
+
+/* What the segments depend on; a checkpoint of another configuration (or
+ * of another input of a different size) is not resumed. */
+static char *checkpoint_config(const TranscodeJob *job, int index)
+{
+    const AVCodecContext *dec_ctx = job->stream_ctx[index].dec_ctx;
+    const OutputFile *of = &job->outputs[0];
+    char *options = NULL, *config;
+
+    if (av_dict_get_string(of->encoder_opts, &options, '=', ':') < 0)
+        return NULL;
+    config = av_asprintf("input_size=%"PRId64" video=%dx%d,%s,%d/%d output=%dx%d "
+                         "segment=%g keep_chroma=%d dedup=%d options=%s",
+                         avio_size(job->ifmt_ctx->pb), dec_ctx->width, dec_ctx->height,
+                         av_get_pix_fmt_name(dec_ctx->pix_fmt), dec_ctx->framerate.num,
+                         dec_ctx->framerate.den, of->width, of->height,
+                         job->params->segment_seconds, job->params->keep_chroma,
+                         job->params->dedup_threshold, options ? options : "");
+    av_free(options);
+    return config;
+}
+
+static void free_checkpoint(JobCheckpoint **pjc)
+{
+    JobCheckpoint *jc = *pjc;
+
+    if (!jc)
+        return;
+    checkpoint_free(&jc->ckpt);
+    pthread_mutex_destroy(&jc->lock);
+    av_freep(&jc->starts);
+    av_freep(&jc->filename);
+    av_freep(pjc);
+}
+
+/* Go on from <manifest>.ckpt if there is one, after init_outputs() and
+ * before the output is opened. */
+static int init_checkpoint(TranscodeJob *job)
+{
+    const TranscodeParams *params = job->params;
+    JobCheckpoint *jc;
+    Checkpoint *ckpt;
+    AVStream *st;
+    char *config;
+    int index = -1, nb_mapped = 0;
+    int ret;
+
+    for (unsigned i = 0; i < job->ifmt_ctx->nb_streams; i++) {
+        if (job->stream_ctx[i].mode == STREAM_DROP)
+            continue;
+        nb_mapped++;
+        if (job->stream_ctx[i].mode == STREAM_TRANSCODE &&
+            job->stream_ctx[i].dec_ctx->codec_type == AVMEDIA_TYPE_VIDEO)
+            index = i;
+    }
+    if (params->segment_seconds <= 0 || params->live || params->nb_chunk_encoders > 1 ||
+        job->nb_outputs != 1 || nb_mapped != 1 || index < 0 ||
+        !(job->mmap_packets || (job->ifmt_ctx->pb->seekable & AVIO_SEEKABLE_NORMAL))) {
+        av_log(NULL, AV_LOG_ERROR, "Checkpoints need segmented output of one seekable "
+               "video-only input, in one rendition, not live or chunked\n");
+        return AVERROR(EINVAL);
+    }
+
+    jc = job->checkpoint = av_mallocz(sizeof(*jc));
+    if (!jc)
+        return AVERROR(ENOMEM);
+    if ((ret = pthread_mutex_init(&jc->lock, NULL))) {
+        av_freep(&job->checkpoint);
+        return AVERROR(ret);
+    }
+    jc->stream_index = index;
+    jc->resume_pts = INT64_MIN;
+    ckpt = &jc->ckpt;
+    st = job->ifmt_ctx->streams[index];
+    jc->filename = av_asprintf("%s.ckpt", job->outputs[0].filename);
+    config = checkpoint_config(job, index);
+    if (!jc->filename || !config) {
+        av_free(config);
+        return AVERROR(ENOMEM);
+    }
+
+    ret = checkpoint_read(jc->filename, ckpt);
+    if (ret == AVERROR(ENOENT)) {
+        /* a new job */
+        ckpt->config = config;
+        return 0;
+    }
+    if (ret >= 0 && strcmp(ckpt->config, config)) {
+        av_log(NULL, AV_LOG_ERROR, "%s was written for another input or configuration:\n"
+               "  %s\nnow:\n  %s\nRemove it to start over\n", jc->filename, ckpt->config, config);
+        ret = AVERROR(EINVAL);
+    }
+    av_free(config);
+    if (ret < 0 || !ckpt->next_segment)
+        return ret;
+
+    jc->resume_segment = ckpt->next_segment;
+    jc->resume_pts = ckpt->input_pts;
+    jc->resume_offset = av_rescale_q((int64_t)(jc->resume_segment * params->segment_seconds * AV_TIME_BASE),
+                                     AV_TIME_BASE_Q, st->time_base);
+    jc->nb_frames = ckpt->input_frame;
+    if (job->mmap_packets) {
+        /* the images are cut from the mapping, timestamps follow from their number */
+        ret = mmap_input_seek_jpeg(job->mmap_in, ckpt->input_pos);
+        job->nb_mmap_packets = ckpt->input_frame;
+    } else {
+        ret = avformat_seek_file(job->ifmt_ctx, index, INT64_MIN, ckpt->input_pts, ckpt->input_pts, 0);
+        if (ret < 0 && ckpt->input_pos >= 0)
+            ret = av_seek_frame(job->ifmt_ctx, -1, ckpt->input_pos, AVSEEK_FLAG_BYTE);
+    }
+    if (ret < 0) {
+        av_log(NULL, AV_LOG_ERROR, "Cannot seek %s to resume at segment %"PRId64"\n",
+               params->in_filename, jc->resume_segment);
+        return ret;
+    }
+    av_log(NULL, AV_LOG_INFO, "Resuming %s at segment %"PRId64" (%s s, byte %"PRId64")\n",
+           params->in_filename, jc->resume_segment,
+           av_ts2timestr(ckpt->input_pts, &st->time_base), ckpt->input_pos);
+    return 0;
+}
+
+/* every segment is done: the final manifest, and nothing left to resume */
+static int finish_checkpoint(TranscodeJob *job)
+{
+    JobCheckpoint *jc = job->checkpoint;
+    int ret;
+
+    if ((ret = checkpoint_write_manifest(job->outputs[0].filename, &jc->ckpt, 1)) < 0)
+        return ret;
+    if (unlink(jc->filename) < 0 && errno != ENOENT)
+        return AVERROR(errno);
+    return 0;
+}
+
+static void transcode_job_uninit(TranscodeJob *job)
+{
+    int nb_streams = job->ifmt_ctx ? job->ifmt_ctx->nb_streams : 0;
+
+    for (int i = 0; job->stream_ctx && i < nb_streams; i++) {
+        avcodec_free_context(&job->stream_ctx[i].dec_ctx);
+        decode_pool_free(&job->stream_ctx[i].dec_pool);
+        frame_dedup_free(&job->stream_ctx[i].packet_dedup);
+        frame_dedup_free(&job->stream_ctx[i].frame_dedup);
+    }
+    for (int i = 0; job->filter_ctx && i < nb_streams; i++) {
+        avfilter_graph_free(&job->filter_ctx[i].filter_graph);
+        av_buffer_pool_uninit(&job->filter_ctx[i].convert_pool);
+    }
+
+    av_freep(&job->filter_ctx);
+    av_freep(&job->stream_ctx);
+    free_checkpoint(&job->checkpoint);
+    avformat_close_input(&job->ifmt_ctx);
+    mmap_input_close(&job->mmap_in);
+    for (int i = 0; i < job->nb_outputs; i++) {
+        OutputFile *of = &job->outputs[i];
+
+        close_output(of);
+        avformat_free_context(of->ofmt_ctx);
+        of->ofmt_ctx = NULL;
+        for (int j = 0; of->enc_ctx && j < nb_streams; j++)
+            avcodec_free_context(&of->enc_ctx[j]);
+        av_freep(&of->enc_ctx);
+        av_dict_free(&of->encoder_opts);
+        av_freep(&of->filename);
+    }
+}
+
+/* <output>.kfix next to a finished local output */
+static int write_keyframe_index(const char *out_filename)
+{
+    char *index_filename;
+    int ret;
+
+    av_strstart(out_filename, "file:", &out_filename);
+    index_filename = av_asprintf("%s.kfix", out_filename);
+    if (!index_filename)
+        return AVERROR(ENOMEM);
+    ret = keyframe_index_write(out_filename, index_filename);
+    if (ret < 0)
+        av_log(NULL, AV_LOG_ERROR, "Could not write the keyframe index %s\n", index_filename);
+    av_free(index_filename);
+    return ret;
+}
+
+/* libvpx hands out the statistics when the first pass encoder is flushed */
+static int collect_pass_stats(TranscodeJob *job)
+{
+    for (int i = 0; i < job->nb_outputs; i++) {
+        for (unsigned j = 0; j < job->ifmt_ctx->nb_streams; j++) {
+            const AVCodecContext *enc_ctx = job->outputs[i].enc_ctx[j];
+
+            if (!enc_ctx || enc_ctx->codec_type != AVMEDIA_TYPE_VIDEO)
+                continue;
+            if (!enc_ctx->stats_out) {
+                av_log(NULL, AV_LOG_ERROR, "%s left no first pass statistics\n", enc_ctx->codec->name);
+                return AVERROR_EXTERNAL;
+            }
+            av_freep(&job->pass_stats[i]);
+            if (!(job->pass_stats[i] = av_strdup(enc_ctx->stats_out)))
+                return AVERROR(ENOMEM);
+        }
+    }
+    return 0;
+}
+
+/* One run over the input. pass_stats is read by the second pass and
+ * written by the first, NULL for a single pass. */
+static int run_job(const TranscodeParams *params, enum RateControlPass pass, char **pass_stats)
 {
+    TranscodeJob job = { 0 };
+    FilteringContext *filter;
     int ret;
-    unsigned int stream_index;
 
-    //    if (argc != 3) {
-    //        av_log(NULL, AV_LOG_ERROR, "Usage: %s <input file> <output file>\n", argv[0]);
-    //        return 1;
-    //    }
-    const char * const in_filename= "input.yuvj422p";
-    const char * const out_filename = "VideoOut.webm";
+    job.params = params;
+    job.nb_cores = params->nb_cores > 0 ? params->nb_cores : av_cpu_count();
+    job.pass = pass;
+    job.pass_stats = pass_stats;
 
-    if ((ret = open_input_file(in_filename)) < 0)
+    if ((ret = open_input_file(&job, params->in_filename)) < 0)
         goto end;
-    if ((ret = open_output_file(out_filename)) < 0)
+    if (params->nb_chunk_encoders > 1 &&
+        (job.ifmt_ctx->nb_streams != 1 || job.stream_ctx[0].mode != STREAM_TRANSCODE ||
+         job.stream_ctx[0].dec_ctx->codec_type != AVMEDIA_TYPE_VIDEO)) {
+        av_log(NULL, AV_LOG_ERROR, "Chunked mode takes a single video stream, "
+               "%s has %u streams\n", params->in_filename, job.ifmt_ctx->nb_streams);
+        ret = AVERROR(EINVAL);
         goto end;
-    if ((ret = init_filters()) < 0)
+    }
+    if (pass != RC_PASS_SINGLE) {
+        int nb_video = 0;
+
+        /* every video encoder of an output would get the same statistics */
+        for (unsigned i = 0; i < job.ifmt_ctx->nb_streams; i++)
+            nb_video += job.stream_ctx[i].mode == STREAM_TRANSCODE &&
+                        job.stream_ctx[i].dec_ctx->codec_type == AVMEDIA_TYPE_VIDEO;
+        if (nb_video != 1) {
+            av_log(NULL, AV_LOG_ERROR, "Two-pass encoding takes one video stream to encode, "
+                   "%s has %d\n", params->in_filename, nb_video);
+            ret = AVERROR(EINVAL);
+            goto end;
+        }
+    }
+    if ((ret = init_outputs(&job)) < 0)
         goto end;
-    if (!(packet = av_packet_alloc()))
+    if (params->checkpoint && (ret = init_checkpoint(&job)) < 0)
         goto end;
+    for (int i = 0; i < job.nb_outputs; i++) {
+        if ((ret = open_output_file(&job, i)) < 0)
+            goto end;
+    }
 
-    stream = &stream_ctx[0];
-
-    /* read all packets */
-    while (1) {
-        ret = av_read_frame(ifmt_ctx, packet);
-        if (ret < 0){
-            break;
+    if (params->nb_chunk_encoders > 1) {
+        ret = run_chunked(&job, params->nb_chunk_encoders, params->chunk_seconds);
+    } else {
+        if ((ret = init_filters(&job)) < 0)
+            goto end;
+        ret = run_pipeline(&job);
+
+        for (unsigned i = 0; i < job.ifmt_ctx->nb_streams; i++) {
+            filter = &job.filter_ctx[i];
+            if (filter->nb_frames)
+                av_log(NULL, AV_LOG_INFO, "Stream #%u decoder to encoder: %"PRId64" frames, "
+                       "%"PRId64" bytes copied (%"PRId64" per frame), %"PRId64" bytes converted\n",
+                       i, filter->nb_frames, filter->copied_bytes,
+                       filter->copied_bytes / filter->nb_frames,
+                       filter->converted_bytes);
+            if (job.stream_ctx[i].frame_dedup)
+                av_log(NULL, AV_LOG_INFO, "Stream #%u: %"PRId64" repeated images not decoded, "
+                       "%"PRId64" static frames not encoded\n", i,
+                       job.stream_ctx[i].packet_dedup ?
+                       frame_dedup_nb_dropped(job.stream_ctx[i].packet_dedup) : 0,
+                       frame_dedup_nb_dropped(job.stream_ctx[i].frame_dedup));
         }
-        av_log(NULL, AV_LOG_DEBUG, "Demuxer gave frame of stream_index %u\n",
-               stream_index);
+    }
+    if (ret < 0)
+        goto end;
+    if (pass == RC_PASS_FIRST && (ret = collect_pass_stats(&job)) < 0)
+        goto end;
 
-        av_log(NULL, AV_LOG_DEBUG, "Going to reencode&filter the frame\n");
+    for (int i = 0; i < job.nb_outputs && ret >= 0; i++) {
+        ret = av_write_trailer(job.outputs[i].ofmt_ctx);
+        /* only now is everything on disk (and synced, as configured) */
+        if (ret >= 0)
+            ret = close_output(&job.outputs[i]);
+        if (ret >= 0 && params->fast_start && pass != RC_PASS_FIRST)
+            ret = write_keyframe_index(job.outputs[i].filename);
+    }
+    if (ret >= 0 && job.checkpoint)
+        ret = finish_checkpoint(&job);
+end:
+    transcode_job_uninit(&job);
+    if (ret < 0)
+        av_log(NULL, AV_LOG_ERROR, "%s %s failed: %s\n",
+               pass == RC_PASS_FIRST ? "First pass of" : "Transcoding",
+               params->in_filename, av_err2str(ret));
+    return ret;
+}
 
-        ret = avcodec_send_packet(stream->dec_ctx, packet);
-        if (ret < 0) {
-            av_log(NULL, AV_LOG_ERROR, "Decoding failed\n");
-            break;
-        }
+/* What the first pass statistics of an output depend on besides the input */
+static char *pass_stats_settings(const TranscodeParams *params, int index)
+{
+    const TranscodeRendition *r = params->nb_renditions ? &params->renditions[index] : NULL;
+    char *options = NULL, *settings;
+
+    if (av_dict_get_string(params->encoder_opts, &options, '=', ':') < 0)
+        return NULL;
+    settings = av_asprintf("output=%dx%d@%"PRId64" segment=%g keep_chroma=%d dedup=%d "
+                           "framerate=%s options=%s", r ? r->width : 0, r ? r->height : 0, r ? r->bit_rate : 0,
+                           params->segment_seconds, params->keep_chroma, params->dedup_threshold,
+                           params->framerate ? params->framerate : "",
+                           options ? options : "");
+    av_free(options);
+    return settings;
+}
 
-        while (ret >= 0) {
-            ret = avcodec_receive_frame(stream->dec_ctx, stream->dec_frame);
-            if (ret == AVERROR_EOF || ret == AVERROR(EAGAIN))
-                break;
-            else if (ret < 0)
-                goto end;
+/* Statistics for every output from params->pass_cache_dir, or from a first
+ * pass, which then goes into the cache. */
+static int first_pass(const TranscodeParams *params, char **pass_stats)
+{
+    char *keys[TRANSCODE_MAX_RENDITIONS] = { NULL };
+    int nb_outputs = FFMAX(params->nb_renditions, 1);
+    int nb_cached = 0;
+    int ret = 0;
 
-            stream->dec_frame->pts = stream->dec_frame->best_effort_timestamp;
-            ret = encode(ofmt_ctx, ifmt_ctx->streams[0], ofmt_ctx->streams[0], stream->dec_ctx, packet->stream_index);
-            //ret = filter_encode_write_frame(stream->dec_frame);
-            if (ret < 0)
-                goto end;
+    for (int i = 0; params->pass_cache_dir && i < nb_outputs; i++) {
+        char *settings = pass_stats_settings(params, i);
+
+        if (!settings) {
+            ret = AVERROR(ENOMEM);
+            goto end;
+        }
+        ret = rate_control_key(params->in_filename, settings, &keys[i]);
+        av_free(settings);
+        if (ret < 0) {
+            av_log(NULL, AV_LOG_ERROR, "Cannot read %s for its statistics key\n", params->in_filename);
+            goto end;
         }
-        av_packet_unref(packet);
+        ret = rate_control_load_stats(params->pass_cache_dir, keys[i], &pass_stats[i]);
+        if (ret >= 0)
+            nb_cached++;
+        else if (ret != AVERROR(ENOENT))
+            av_log(NULL, AV_LOG_WARNING, "Ignoring cached statistics %s: %s\n",
+                   keys[i], av_err2str(ret));
+    }
+    ret = 0;
+    if (nb_cached == nb_outputs) {
+        av_log(NULL, AV_LOG_INFO, "First pass statistics of %s from %s\n",
+               params->in_filename, params->pass_cache_dir);
+        goto end;
     }
 
-    /* flush decoders, filters and encoders */
-    av_log(NULL, AV_LOG_INFO, "Flushing stream %u decoder\n", 0);
-
-    /* flush decoder */
-    ret = avcodec_send_packet(stream->dec_ctx, NULL);
-    if (ret < 0) {
-        av_log(NULL, AV_LOG_ERROR, "Flushing decoding failed\n");
+    /* the renditions share the decode, so the cached ones run again too */
+    av_log(NULL, AV_LOG_INFO, "First pass of %s\n", params->in_filename);
+    if ((ret = run_job(params, RC_PASS_FIRST, pass_stats)) < 0)
         goto end;
+    for (int i = 0; params->pass_cache_dir && i < nb_outputs; i++) {
+        /* only the next run loses, this one has the statistics */
+        if ((ret = rate_control_store_stats(params->pass_cache_dir, keys[i], pass_stats[i])) < 0)
+            av_log(NULL, AV_LOG_WARNING, "Could not cache the statistics in %s: %s\n",
+                   params->pass_cache_dir, av_err2str(ret));
     }
+    ret = 0;
+end:
+    for (int i = 0; i < nb_outputs; i++)
+        av_free(keys[i]);
+    return ret;
+}
 
-    while (ret >= 0) {
-        ret = avcodec_receive_frame(stream->dec_ctx, stream->dec_frame);
-        if (ret == AVERROR_EOF)
-            break;
-        else if (ret < 0)
-            goto end;
+int transcode_run(const TranscodeParams *params)
+{
+    char *pass_stats[TRANSCODE_MAX_RENDITIONS] = { NULL };
+    struct stat st;
+    int ret;
 
-        stream->dec_frame->pts = stream->dec_frame->best_effort_timestamp;
-        ret = filter_encode_write_frame(stream->dec_frame);
-        if (ret < 0)
-            goto end;
+    if (params->live && params->nb_chunk_encoders > 1) {
+        av_log(NULL, AV_LOG_ERROR, "Chunked mode needs the whole input, it cannot run live\n");
+        return AVERROR(EINVAL);
+    }
+    if (params->live && params->fast_start) {
+        av_log(NULL, AV_LOG_ERROR, "Live output cannot be rewritten for fast start\n");
+        return AVERROR(EINVAL);
+    }
+    if (params->segment_seconds > 0 && (params->fast_start || !strcmp(params->out_filename, "-"))) {
+        av_log(NULL, AV_LOG_ERROR, "Segmented output needs a manifest file and has no fast start\n");
+        return AVERROR(EINVAL);
+    }
+    if (params->nb_renditions && (!strcmp(params->out_filename, "-") ||
+                                  (params->nb_renditions > 1 && params->nb_chunk_encoders > 1))) {
+        av_log(NULL, AV_LOG_ERROR, "Renditions are written to files named after the output, "
+               "a ladder is encoded by the pipeline, not in chunks\n");
+        return AVERROR(EINVAL);
     }
 
-//    /* flush filter */
-//    ret = filter_encode_write_frame(NULL);
-//    if (ret < 0) {
-//        av_log(NULL, AV_LOG_ERROR, "Flushing filter failed\n");
-//        goto end;
-//    }
+    if (params->two_pass &&
+        (params->live || params->nb_chunk_encoders > 1 || params->checkpoint ||
+         stat(params->in_filename, &st) < 0 || !S_ISREG(st.st_mode))) {
+        av_log(NULL, AV_LOG_ERROR, "Two-pass encoding reads an input file twice, it cannot "
+               "run live, chunked or resumed from a checkpoint\n");
+        return AVERROR(EINVAL);
+    }
 
-    /* flush encoder */
-    ret = flush_encoder();
-    if (ret < 0) {
-        av_log(NULL, AV_LOG_ERROR, "Flushing encoder failed\n");
+    if (params->two_pass && (ret = first_pass(params, pass_stats)) < 0)
         goto end;
+    ret = run_job(params, params->two_pass ? RC_PASS_SECOND : RC_PASS_SINGLE,
+                  params->two_pass ? pass_stats : NULL);
+end:
+    for (int i = 0; i < TRANSCODE_MAX_RENDITIONS; i++)
+        av_free(pass_stats[i]);
+    return ret;
+}
+
+#ifndef TRANSCODE_NO_MAIN
+static void usage(const char *name)
+{
+    av_log(NULL, AV_LOG_ERROR,
+           "Usage: %s [-p <encoders>] [-d <seconds>] [-x <key=value[:key=value...]>] [-k] [-M]\n"
+           "          [-F <none|close|buffer>] [-C] [-g <seconds> [-K]] [-R <WxH[@bitrate],...>]\n"
+           "          [-2 [-P <cache dir>]] [-Z <luma levels>]\n"
+           "          [-D <spool dir> [-w <jobs>]] [-l [-r <fps>] [-L <ms>]] [-s <sink> [-S <ms>]]\n"
+           "          [<input file> <output file>]\n"
+           "  -p <encoders>  encode the input in chunks on this many VP9 encoders in parallel\n"
+           "  -d <seconds>   duration of one chunk (default %d)\n"
+           "  -x <options>   libvpx-vp9 options, e.g. threads=4:tile-columns=1:cpu-used=5,\n"
+           "                 override the settings picked from resolution and core count\n"
+           "  -k             keep the input's chroma subsampling, 4:2:2 MJPEG becomes\n"
+           "                 4:2:2 VP9 (profile 1) instead of being converted to 4:2:0\n"
+           "  -M             read the input with read() instead of mapping it\n"
+           "  -F <policy>    when output files are synced to disk: none, on close (default)\n"
+           "                 or after every 4 MiB buffer\n"
+           "  -C             fast start: WebM Cues at the front of the file and a\n"
+           "                 <output>.kfix keyframe index (timestamp -> byte offset)\n"
+           "  -g <seconds>   write WebM segments of this duration, <output> is the\n"
+           "                 manifest (.m3u8, .csv, .ffconcat), segments are <output>_NNNNN.webm\n"
+           "  -K             checkpoint to <output>.ckpt after every segment, and resume\n"
+           "                 from it when the same job is run again\n"
+           "  -R <ladder>    decode once and encode every rendition in parallel, e.g.\n"
+           "                 1920x1080,1280x720@2M,854x480@800k, each to <output>_<W>x<H>.<ext>\n"
+           "  -2             two-pass VP9: a fast first pass for libvpx's statistics, then\n"
+           "                 the encode spending the bitrate where they say it is needed\n"
+           "  -P <dir>       cache first pass statistics here, keyed by a hash of the input\n"
+           "                 and the settings, so encoding the input again skips the first pass\n"
+           "  -Z <levels>    drop frames whose 8x8 luma block means all stay within this\n"
+           "                 many levels of the last encoded frame (0 = unchanged only),\n"
+           "                 repeated MJPEG images are dropped before decoding\n"
+           "  -D <dir>       run as a daemon taking *.job files from this spool directory\n"
+           "  -w <jobs>      number of jobs the daemon runs at once (default 2)\n"
+           "  -l             live MJPEG input from a FIFO, '-' (stdin) or tcp://host:port?listen,\n"
+           "                 realtime VP9 and WebM written as it is produced ('-' is stdout)\n"
+           "  -r <fps>       frame rate of raw MJPEG input (default 25)\n"
+           "  -L <ms>        live latency budget, slower frames are reported (default %d)\n"
+           "  -s <sink>      write per-stage stats as JSON lines to '-' (stderr),\n"
+           "                 unix:<socket path> or a file\n"
+           "  -S <ms>        interval of the stats lines (default %d)\n",
+           name, DEFAULT_CHUNK_SECONDS, DEFAULT_LATENCY_BUDGET_MS, DEFAULT_STATS_INTERVAL_MS);
+}
+
+int main(int argc, char **argv)
+{
+    TranscodeParams params;
+    AVDictionary *encoder_opts = NULL;
+    const char *spool_dir = NULL;
+    int nb_daemon_workers = 2;
+    int ret, opt;
+
+    transcode_params_default(&params);
+    while ((opt = getopt(argc, argv, "p:d:x:kMF:Cg:KR:2P:Z:D:w:lr:L:s:S:")) != -1) {
+        switch (opt) {
+        case 'p':
+            params.nb_chunk_encoders = atoi(optarg);
+            break;
+        case 'd':
+            params.chunk_seconds = strtod(optarg, NULL);
+            break;
+        case 'x':
+            if (av_dict_parse_string(&encoder_opts, optarg, "=", ":", 0) < 0) {
+                av_log(NULL, AV_LOG_ERROR, "Invalid encoder options '%s'\n", optarg);
+                return 1;
+            }
+            break;
+        case 'k':
+            params.keep_chroma = 1;
+            break;
+        case 'M':
+            params.mmap_input = 0;
+            break;
+        case 'F':
+            if ((ret = async_writer_parse_sync(optarg)) < 0) {
+                av_log(NULL, AV_LOG_ERROR, "Invalid sync policy '%s'\n", optarg);
+                return 1;
+            }
+            params.output_sync = ret;
+            break;
+        case 'C':
+            params.fast_start = 1;
+            break;
+        case 'g':
+            params.segment_seconds = strtod(optarg, NULL);
+            break;
+        case 'K':
+            params.checkpoint = 1;
+            break;
+        case 'R':
+            if (transcode_parse_renditions(&params, optarg) < 0) {
+                av_dict_free(&encoder_opts);
+                return 1;
+            }
+            break;
+        case '2':
+            params.two_pass = 1;
+            break;
+        case 'P':
+            params.pass_cache_dir = optarg;
+            break;
+        case 'Z':
+            params.dedup_threshold = atoi(optarg);
+            break;
+        case 'D':
+            spool_dir = optarg;
+            break;
+        case 'w':
+            nb_daemon_workers = atoi(optarg);
+            break;
+        case 'l':
+            params.live = 1;
+            break;
+        case 'r':
+            params.framerate = optarg;
+            break;
+        case 'L':
+            params.latency_budget_ms = atoi(optarg);
+            break;
+        case 's':
+            params.stats_sink = optarg;
+            break;
+        case 'S':
+            params.stats_interval_ms = atoi(optarg);
+            break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if (params.chunk_seconds <= 0 || nb_daemon_workers < 1 || params.stats_interval_ms <= 0 ||
+        params.dedup_threshold > 255) {
+        usage(argv[0]);
+        av_dict_free(&encoder_opts);
+        return 1;
     }
+    if (argc - optind == 2 && !spool_dir) {
+        params.in_filename = argv[optind];
+        params.out_filename = argv[optind + 1];
+    } else if (argc != optind) {
+        usage(argv[0]);
+        av_dict_free(&encoder_opts);
+        return 1;
+    }
+    params.encoder_opts = encoder_opts;
+
+    if ((ret = async_log_start()) < 0)
+        goto end;
+    log_simd_report();
+    if ((ret = media_pool_init(MEDIA_POOL_PACKETS, MEDIA_POOL_FRAMES)) < 0)
+        goto end;
+
+    if (spool_dir)
+        ret = spool_daemon_run(spool_dir, nb_daemon_workers, &params);
+    else
+        ret = transcode_run(&params);
 
-    av_write_trailer(ofmt_ctx);
 end:
-    av_packet_free(&packet);
-    avcodec_free_context(&stream_ctx[0].dec_ctx);
-    if (ofmt_ctx && ofmt_ctx->nb_streams > 0 && ofmt_ctx->streams[0] && stream_ctx[0].enc_ctx)
-        avcodec_free_context(&stream_ctx[0].enc_ctx);
-    if (filter_ctx && filter_ctx[0].filter_graph) {
-        avfilter_graph_free(&filter_ctx[0].filter_graph);
-        av_packet_free(&filter_ctx[0].enc_pkt);
-        av_frame_free(&filter_ctx[0].filtered_frame);
-    }
-    av_frame_free(&stream_ctx[0].dec_frame);
-
-    av_free(filter_ctx);
-    av_free(stream_ctx);
-    avformat_close_input(&ifmt_ctx);
-    if (ofmt_ctx && !(ofmt_ctx->oformat->flags & AVFMT_NOFILE))
-        avio_closep(&ofmt_ctx->pb);
-    avformat_free_context(ofmt_ctx);
+    av_dict_free(&encoder_opts);
+    media_pool_log_stats();
+    media_pool_uninit();
+    async_log_stop();
 
     if (ret < 0)
         av_log(NULL, AV_LOG_ERROR, "Error occurred: %s\n", av_err2str(ret));
 
     return ret ? 1 : 0;
 }
+#endif /* TRANSCODE_NO_MAIN */
@@ -0,0 +1,68 @@
+#ifndef TRANSCODE_H
+#define TRANSCODE_H
+
+#include <stdint.h>
+#include <libavutil/dict.h>
+
+#define TRANSCODE_MAX_RENDITIONS 8
+
+/* one output of a ladder, encoded from the same decoded frames */
+typedef struct TranscodeRendition {
+    int width, height;
+    int64_t bit_rate; /* target bitrate, 0 = constant quality (crf) */
+} TranscodeRendition;
+
+/*
+ * One MJPEG -> VP9 transcode (other streams are copied or encoded
+ * to Opus/Vorbis). All state of a running transcode lives in a
+ * job context owned by transcode_run(), so any number of them can run at
+ * once on different threads of the same process. The process-wide
+ * media_pool may be initialized by the caller to recycle packets/frames.
+ */
+typedef struct TranscodeParams {
+    const char *in_filename;
+    const char *out_filename;
+    int nb_chunk_encoders;      /* > 1 selects chunked mode */
+    double chunk_seconds;       /* chunk duration in chunked mode */
+    int nb_cores;               /* cores this job may use, 0 = all */
+    AVDictionary *encoder_opts; /* libvpx-vp9 overrides, not owned */
+    /* encode in the decoder's chroma subsampling (yuv422p -> VP9 profile 1)
+     * instead of converting to 4:2:0 */
+    int keep_chroma;
+    int mmap_input;             /* read regular input files through a mapping */
+    int output_sync;            /* enum AsyncWriterSync for output files */
+    int fast_start;             /* Cues up front and a <output>.kfix keyframe index */
+    double segment_seconds;     /* > 0: keyframe-aligned WebM segments of this
+                                 * duration, out_filename is the manifest */
+    int checkpoint;             /* with segments: <manifest>.ckpt after every segment,
+                                 * a rerun of the job resumes from it */
+    int two_pass;               /* libvpx two-pass rate control, see rate_control.h */
+    const char *pass_cache_dir; /* first pass statistics cache, NULL = none */
+    int dedup_threshold;        /* >= 0: static video frames are not encoded,
+                                 * see frame_dedup.h, -1 = off */
+    /* with any, one output per rendition named <output>_<W>x<H>.<ext>,
+     * otherwise a single output at the input size */
+    TranscodeRendition renditions[TRANSCODE_MAX_RENDITIONS];
+    int nb_renditions;
+
+    /* live MJPEG ingest (FIFO, "-" for stdin, tcp://...) with realtime
+     * VP9 and incrementally written WebM ("-" for stdout) */
+    int live;
+    const char *framerate;      /* of raw MJPEG input, NULL = demuxer default (25) */
+    int latency_budget_ms;      /* live frames slower than this are reported */
+
+    /* per-stage stats JSON lines, see stage_stats_alloc(), NULL = off */
+    const char *stats_sink;
+    int stats_interval_ms;
+    struct StageStats *stats;   /* caller-owned instead of stats_sink, not freed */
+} TranscodeParams;
+
+void transcode_params_default(TranscodeParams *params);
+
+/* "1920x1080,1280x720@2M,854x480@800k" -> params->renditions */
+int transcode_parse_renditions(TranscodeParams *params, const char *spec);
+
+/* returns 0 once the output is complete, a negative AVERROR otherwise */
+int transcode_run(const TranscodeParams *params);
+
+#endif /* TRANSCODE_H */
@@ -0,0 +1,747 @@
+/*
+ * Throughput benchmark for the MJPEG -> VP9 transcoder.
+ *
+ * Generates synthetic MJPEG inputs with testsrc (like the README recipe) for
+ * every combination of resolution, frame rate and chroma subsampling, then
+ * runs the full transcode pipeline and every stage on its own on each of
+ * them. Every run happens in a child process, so peak RSS and CPU time are
+ * those of that run only. The results go to stdout (or -j <file>) as JSON.
+ */
+
+#include <libavcodec/avcodec.h>
+#include <libavformat/avformat.h>
+#include <libavfilter/buffersink.h>
+#include <libavfilter/buffersrc.h>
+#include <libavutil/avstring.h>
+#include <libavutil/bprint.h>
+#include <libavutil/cpu.h>
+#include <libavutil/imgutils.h>
+#include <libavutil/opt.h>
+#include <libavutil/pixdesc.h>
+#include <libavutil/time.h>
+#include <stdlib.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include "transcode.h"
+#include "video_debugging.h"
+#include "vp9_tuning.h"
+#include "yuv_convert.h"
+
+#define DEFAULT_FRAMES 60
+#define DEFAULT_DIR "bench"
+
+typedef struct BenchCase {
+    int width, height, rate;
+    enum AVPixelFormat pix_fmt;
+    char name[32];
+    char input[1024];
+} BenchCase;
+
+static const struct { int width, height; } sizes[] = {
+    { 1280, 720 }, { 1920, 1080 }, { 3840, 2160 },
+};
+static const int rates[] = { 1, 30, 60 };
+static const enum AVPixelFormat pix_fmts[] = { AV_PIX_FMT_YUVJ422P, AV_PIX_FMT_YUVJ420P };
+
+/* what a child runs, the stage modes time only that stage */
+enum BenchMode {
+    MODE_PIPELINE = -1,
+    MODE_DEMUX    = STAGE_DEMUX,
+    MODE_DECODE   = STAGE_DECODE,
+    MODE_FILTER   = STAGE_FILTER,
+    MODE_ENCODE   = STAGE_ENCODE,
+    MODE_MUX      = STAGE_MUX,
+};
+
+static const struct { const char *name; enum BenchMode mode; } modes[] = {
+    { "pipeline", MODE_PIPELINE },
+    { "demux",    MODE_DEMUX },
+    { "decode",   MODE_DECODE },
+    { "filter",   MODE_FILTER },
+    { "encode",   MODE_ENCODE },
+    { "mux",      MODE_MUX },
+};
+
+typedef struct Latencies {
+    int64_t *us;
+    int nb;
+    int64_t total;
+} Latencies;
+
+static int latencies_add(Latencies *l, int64_t us)
+{
+    int64_t *tmp = av_realloc_array(l->us, l->nb + 1, sizeof(*l->us));
+
+    if (!tmp)
+        return AVERROR(ENOMEM);
+    l->us = tmp;
+    l->us[l->nb++] = us;
+    l->total += us;
+    return 0;
+}
+
+static int cmp_int64(const void *a, const void *b)
+{
+    int64_t x = *(const int64_t *)a, y = *(const int64_t *)b;
+    return (x > y) - (x < y);
+}
+
+static void print_latencies(AVBPrint *bp, Latencies *l)
+{
+    if (!l->nb) {
+        av_bprintf(bp, "\"frames\":0");
+        return;
+    }
+    qsort(l->us, l->nb, sizeof(*l->us), cmp_int64);
+    av_bprintf(bp, "\"frames\":%d,\"stage_s\":%.3f,\"fps\":%.2f,"
+               "\"latency_us\":{\"avg\":%"PRId64",\"p50\":%"PRId64",\"p90\":%"PRId64
+               ",\"p99\":%"PRId64",\"max\":%"PRId64"}",
+               l->nb, l->total / 1000000.0, l->nb * 1000000.0 / FFMAX(l->total, 1),
+               l->total / l->nb, l->us[l->nb / 2], l->us[l->nb * 9 / 10],
+               l->us[l->nb * 99 / 100], l->us[l->nb - 1]);
+}
+
+/* Graph running spec, fed from a buffer source with the decoder's frames
+ * if dec_ctx is given (spec must be a source filter otherwise). */
+static int open_graph(const char *spec, const AVCodecContext *dec_ctx,
+                      enum AVPixelFormat out_fmt, AVFilterGraph **pgraph,
+                      AVFilterContext **psrc, AVFilterContext **psink)
+{
+    AVFilterGraph *graph = avfilter_graph_alloc();
+    AVFilterInOut *outputs = NULL;
+    AVFilterInOut *inputs = avfilter_inout_alloc();
+    char args[512];
+    int ret;
+
+    if (!graph || !inputs) {
+        ret = AVERROR(ENOMEM);
+        goto end;
+    }
+
+    if (dec_ctx) {
+        snprintf(args, sizeof(args),
+                 "video_size=%dx%d:pix_fmt=%d:time_base=%d/%d:pixel_aspect=%d/%d",
+                 dec_ctx->width, dec_ctx->height, dec_ctx->pix_fmt,
+                 dec_ctx->pkt_timebase.num, dec_ctx->pkt_timebase.den,
+                 FFMAX(dec_ctx->sample_aspect_ratio.num, 1),
+                 FFMAX(dec_ctx->sample_aspect_ratio.den, 1));
+        ret = avfilter_graph_create_filter(psrc, avfilter_get_by_name("buffer"), "in",
+                                           args, NULL, graph);
+        if (ret < 0)
+            goto end;
+        if (!(outputs = avfilter_inout_alloc())) {
+            ret = AVERROR(ENOMEM);
+            goto end;
+        }
+        outputs->name = av_strdup("in");
+        outputs->filter_ctx = *psrc;
+        if (!outputs->name) {
+            ret = AVERROR(ENOMEM);
+            goto end;
+        }
+    }
+
+    ret = avfilter_graph_create_filter(psink, avfilter_get_by_name("buffersink"), "out",
+                                       NULL, NULL, graph);
+    if (ret < 0)
+        goto end;
+    ret = av_opt_set_bin(*psink, "pix_fmts", (uint8_t *)&out_fmt, sizeof(out_fmt),
+                         AV_OPT_SEARCH_CHILDREN);
+    if (ret < 0)
+        goto end;
+    inputs->name = av_strdup("out");
+    inputs->filter_ctx = *psink;
+    if (!inputs->name) {
+        ret = AVERROR(ENOMEM);
+        goto end;
+    }
+
+    if ((ret = avfilter_graph_parse_ptr(graph, spec, &inputs, &outputs, NULL)) < 0 ||
+        (ret = avfilter_graph_config(graph, NULL)) < 0)
+        goto end;
+
+    *pgraph = graph;
+    graph = NULL;
+end:
+    avfilter_inout_free(&inputs);
+    avfilter_inout_free(&outputs);
+    avfilter_graph_free(&graph);
+    return ret;
+}
+
+/* nb_frames of testsrc as concatenated JPEGs, the same as
+ * ffmpeg -f lavfi -i testsrc -vcodec mjpeg -f mjpeg */
+static int generate_input(const BenchCase *c, int nb_frames)
+{
+    const AVCodec *codec = avcodec_find_encoder(AV_CODEC_ID_MJPEG);
+    AVCodecContext *enc = NULL;
+    AVFilterGraph *graph = NULL;
+    AVFilterContext *src = NULL, *sink = NULL;
+    AVFrame *frame = av_frame_alloc();
+    AVPacket *pkt = av_packet_alloc();
+    char spec[256], *tmp_path = av_asprintf("%s.tmp", c->input);
+    FILE *f = NULL;
+    int ret;
+
+    if (!frame || !pkt || !tmp_path) {
+        ret = AVERROR(ENOMEM);
+        goto end;
+    }
+    if (!codec) {
+        av_log(NULL, AV_LOG_ERROR, "MJPEG encoder not found\n");
+        ret = AVERROR_ENCODER_NOT_FOUND;
+        goto end;
+    }
+    snprintf(spec, sizeof(spec), "testsrc=size=%dx%d:rate=%d", c->width, c->height, c->rate);
+    if ((ret = open_graph(spec, NULL, c->pix_fmt, &graph, &src, &sink)) < 0)
+        goto end;
+
+    if (!(enc = avcodec_alloc_context3(codec))) {
+        ret = AVERROR(ENOMEM);
+        goto end;
+    }
+    enc->width = c->width;
+    enc->height = c->height;
+    enc->pix_fmt = c->pix_fmt;
+    enc->time_base = (AVRational){ 1, c->rate };
+    if ((ret = avcodec_open2(enc, codec, NULL)) < 0)
+        goto end;
+
+    if (!(f = fopen(tmp_path, "wb"))) {
+        ret = AVERROR(errno);
+        goto end;
+    }
+    for (int i = 0; i <= nb_frames; i++) {
+        if (i < nb_frames) {
+            if ((ret = av_buffersink_get_frame(sink, frame)) < 0)
+                goto end;
+            ret = avcodec_send_frame(enc, frame);
+            av_frame_unref(frame);
+        } else {
+            ret = avcodec_send_frame(enc, NULL);
+        }
+        if (ret < 0)
+            goto end;
+        while ((ret = avcodec_receive_packet(enc, pkt)) >= 0) {
+            if (fwrite(pkt->data, 1, pkt->size, f) != pkt->size) {
+                ret = AVERROR(EIO);
+                goto end;
+            }
+            av_packet_unref(pkt);
+        }
+        if (ret != AVERROR(EAGAIN) && ret != AVERROR_EOF)
+            goto end;
+    }
+    ret = fclose(f) ? AVERROR(errno) : 0;
+    f = NULL;
+    /* only complete inputs get the final name and are reused */
+    if (ret >= 0 && rename(tmp_path, c->input) < 0)
+        ret = AVERROR(errno);
+end:
+    if (f)
+        fclose(f);
+    if (ret < 0)
+        unlink(tmp_path);
+    av_free(tmp_path);
+    av_packet_free(&pkt);
+    av_frame_free(&frame);
+    avcodec_free_context(&enc);
+    avfilter_graph_free(&graph);
+    return ret;
+}
+
+static int open_vp9_encoder(const AVCodecContext *dec, enum AVPixelFormat pix_fmt,
+                            AVCodecContext **penc)
+{
+    const AVCodec *codec = avcodec_find_encoder(AV_CODEC_ID_VP9);
+    AVDictionary *opts = NULL;
+    AVCodecContext *enc;
+    int ret;
+
+    if (!codec)
+        return AVERROR_ENCODER_NOT_FOUND;
+    if (!(enc = *penc = avcodec_alloc_context3(codec)))
+        return AVERROR(ENOMEM);
+    enc->width = dec->width;
+    enc->height = dec->height;
+    enc->pix_fmt = pix_fmt;
+    enc->sample_aspect_ratio = dec->sample_aspect_ratio;
+    enc->time_base = av_inv_q(dec->framerate);
+
+    /* the settings transcode would pick */
+    ret = av_dict_set(&opts, "crf", "20", 0);
+    if (ret >= 0)
+        ret = vp9_tuning_set_defaults(&opts, enc->width, enc->height, 0, 0);
+    if (ret >= 0)
+        ret = avcodec_open2(enc, codec, &opts);
+    av_dict_free(&opts);
+    return ret;
+}
+
+static int keep_packet(AVPacket ***pkts, int *nb_pkts, const AVPacket *pkt)
+{
+    AVPacket *copy = av_packet_clone(pkt);
+
+    if (!copy || av_dynarray_add_nofree(pkts, nb_pkts, copy) < 0) {
+        av_packet_free(&copy);
+        return AVERROR(ENOMEM);
+    }
+    return 0;
+}
+
+static int mux_packets(const BenchCase *c, const AVCodecContext *enc, AVPacket **pkts,
+                       int nb_pkts, Latencies *lat)
+{
+    AVFormatContext *ofmt = NULL;
+    AVStream *st;
+    char path[1100];
+    int ret;
+
+    snprintf(path, sizeof(path), "%s.mux.webm", c->input);
+    if ((ret = avformat_alloc_output_context2(&ofmt, NULL, NULL, path)) < 0)
+        return ret;
+    if (!(st = avformat_new_stream(ofmt, NULL))) {
+        ret = AVERROR(ENOMEM);
+        goto end;
+    }
+    if ((ret = avcodec_parameters_from_context(st->codecpar, enc)) < 0)
+        goto end;
+    st->time_base = enc->time_base;
+    if ((ret = avio_open(&ofmt->pb, path, AVIO_FLAG_WRITE)) < 0 ||
+        (ret = avformat_write_header(ofmt, NULL)) < 0)
+        goto end;
+
+    for (int i = 0; i < nb_pkts; i++) {
+        int64_t start = stage_stats_now();
+
+        av_packet_rescale_ts(pkts[i], enc->time_base, st->time_base);
+        if ((ret = av_interleaved_write_frame(ofmt, pkts[i])) < 0 ||
+            (ret = latencies_add(lat, stage_stats_now() - start)) < 0)
+            goto end;
+    }
+    ret = av_write_trailer(ofmt);
+end:
+    if (ofmt)
+        avio_closep(&ofmt->pb);
+    avformat_free_context(ofmt);
+    unlink(path);
+    return ret;
+}
+
+/* The filter stage's conversion as filter_frame() does it: in place when
+ * the decoded frame is writable, otherwise into a pooled yuv420p buffer.
+ * frame is unreferenced, out gets the converted frame. */
+static int convert_frame(AVBufferPool **pool, AVFrame *frame, AVFrame *out)
+{
+    int size, ret;
+
+    if (av_frame_is_writable(frame)) {
+        if ((ret = yuv_convert_frame(frame)) < 0)
+            return ret;
+        av_frame_move_ref(out, frame);
+        return 0;
+    }
+
+    size = av_image_get_buffer_size(AV_PIX_FMT_YUV420P, frame->width, frame->height, 32);
+    if (size < 0)
+        return size;
+    /* the bench inputs keep their size */
+    if (!*pool && !(*pool = av_buffer_pool_init(size, NULL)))
+        return AVERROR(ENOMEM);
+    out->format = AV_PIX_FMT_YUV420P;
+    out->width = frame->width;
+    out->height = frame->height;
+    if (!(out->buf[0] = av_buffer_pool_get(*pool)))
+        ret = AVERROR(ENOMEM);
+    else
+        ret = av_image_fill_arrays(out->data, out->linesize, out->buf[0]->data,
+                                   AV_PIX_FMT_YUV420P, frame->width, frame->height, 32);
+    if (ret >= 0)
+        ret = yuv_convert_frame_to(out, frame);
+    av_frame_unref(frame);
+    return ret;
+}
+
+/* Run demux -> ... -> mode on the input, timing only the mode stage. */
+static int bench_stage(const BenchCase *c, enum BenchMode mode, AVBPrint *bp)
+{
+    AVFormatContext *ifmt = NULL;
+    AVCodecContext *dec = NULL, *enc = NULL;
+    AVFilterGraph *graph = NULL;
+    AVFilterContext *src = NULL, *sink = NULL;
+    AVBufferPool *convert_pool = NULL;
+    AVRational filt_tb;
+    AVPacket *pkt = av_packet_alloc(), *out_pkt = av_packet_alloc();
+    AVFrame *frame = av_frame_alloc(), *filt = av_frame_alloc();
+    AVPacket **encoded = NULL;
+    int nb_encoded = 0;
+    AVDictionary *opts = NULL;
+    Latencies lat = { 0 };
+    const AVCodec *codec;
+    int eof = 0, ret;
+
+    if (!pkt || !out_pkt || !frame || !filt) {
+        ret = AVERROR(ENOMEM);
+        goto end;
+    }
+    av_dict_set_int(&opts, "framerate", c->rate, 0);
+    ret = avformat_open_input(&ifmt, c->input, NULL, &opts);
+    av_dict_free(&opts);
+    if (ret < 0 || (ret = avformat_find_stream_info(ifmt, NULL)) < 0)
+        goto end;
+
+    if (mode >= MODE_DECODE) {
+        AVStream *st = ifmt->streams[0];
+
+        codec = avcodec_find_decoder(st->codecpar->codec_id);
+        if (!codec || !(dec = avcodec_alloc_context3(codec))) {
+            ret = AVERROR_DECODER_NOT_FOUND;
+            goto end;
+        }
+        if ((ret = avcodec_parameters_to_context(dec, st->codecpar)) < 0)
+            goto end;
+        dec->pkt_timebase = st->time_base;
+        dec->framerate = av_guess_frame_rate(ifmt, st, NULL);
+        /* a lone decoder with lavc's own threading, auto thread count */
+        dec->thread_count = 0;
+        if ((ret = avcodec_open2(dec, codec, NULL)) < 0)
+            goto end;
+    }
+
+    while (!eof) {
+        int64_t start = stage_stats_now(), elapsed;
+
+        ret = av_read_frame(ifmt, pkt);
+        if (ret == AVERROR_EOF)
+            eof = 1;
+        else if (ret < 0)
+            goto end;
+        if (mode == MODE_DEMUX) {
+            if (!eof && (ret = latencies_add(&lat, stage_stats_now() - start)) < 0)
+                goto end;
+            av_packet_unref(pkt);
+            continue;
+        }
+
+        /* decode, the flush at EOF is timed too */
+        start = stage_stats_now();
+        ret = avcodec_send_packet(dec, eof ? NULL : pkt);
+        av_packet_unref(pkt);
+        if (ret < 0)
+            goto end;
+        while (1) {
+            ret = avcodec_receive_frame(dec, frame);
+            elapsed = stage_stats_now() - start;
+            if (ret == AVERROR(EAGAIN) || ret == AVERROR_EOF)
+                break;
+            if (ret < 0)
+                goto end;
+            if (mode == MODE_DECODE) {
+                if ((ret = latencies_add(&lat, elapsed)) < 0)
+                    goto end;
+                av_frame_unref(frame);
+                start = stage_stats_now();
+                continue;
+            }
+
+            /* filter: the conversion to the encoder's yuv420p, with the
+             * yuv_convert kernels where the pipeline uses them */
+            if (yuv_convert_supported(frame->format, AV_PIX_FMT_YUV420P)) {
+                start = stage_stats_now();
+                if ((ret = convert_frame(&convert_pool, frame, filt)) < 0)
+                    goto end;
+                elapsed = stage_stats_now() - start;
+                filt_tb = dec->pkt_timebase;
+            } else {
+                if (!graph &&
+                    (ret = open_graph("null", dec, AV_PIX_FMT_YUV420P, &graph, &src, &sink)) < 0)
+                    goto end;
+                start = stage_stats_now();
+                if ((ret = av_buffersrc_add_frame_flags(src, frame, 0)) < 0 ||
+                    (ret = av_buffersink_get_frame(sink, filt)) < 0)
+                    goto end;
+                elapsed = stage_stats_now() - start;
+                filt_tb = av_buffersink_get_time_base(sink);
+            }
+            if (mode == MODE_FILTER) {
+                if ((ret = latencies_add(&lat, elapsed)) < 0)
+                    goto end;
+                av_frame_unref(filt);
+                start = stage_stats_now();
+                continue;
+            }
+
+            /* encode */
+            if (!enc && (ret = open_vp9_encoder(dec, filt->format, &enc)) < 0)
+                goto end;
+            filt->pts = av_rescale_q(filt->pts, filt_tb, enc->time_base);
+            start = stage_stats_now();
+            ret = avcodec_send_frame(enc, filt);
+            av_frame_unref(filt);
+            if (ret < 0)
+                goto end;
+            while ((ret = avcodec_receive_packet(enc, out_pkt)) >= 0) {
+                if (mode == MODE_MUX && (ret = keep_packet(&encoded, &nb_encoded, out_pkt)) < 0)
+                    goto end;
+                av_packet_unref(out_pkt);
+            }
+            if (ret != AVERROR(EAGAIN))
+                goto end;
+            if (mode == MODE_ENCODE &&
+                (ret = latencies_add(&lat, stage_stats_now() - start)) < 0)
+                goto end;
+            start = stage_stats_now();
+        }
+    }
+
+    /* drain the encoder, these packets are muxed but the drain is not a frame */
+    if (enc) {
+        if ((ret = avcodec_send_frame(enc, NULL)) < 0)
+            goto end;
+        while ((ret = avcodec_receive_packet(enc, out_pkt)) >= 0) {
+            if (mode == MODE_MUX && (ret = keep_packet(&encoded, &nb_encoded, out_pkt)) < 0)
+                goto end;
+            av_packet_unref(out_pkt);
+        }
+        if (ret != AVERROR_EOF)
+            goto end;
+    }
+    if (mode == MODE_MUX && (ret = mux_packets(c, enc, encoded, nb_encoded, &lat)) < 0)
+        goto end;
+
+    print_latencies(bp, &lat);
+    ret = 0;
+end:
+    for (int i = 0; i < nb_encoded; i++)
+        av_packet_free(&encoded[i]);
+    av_free(encoded);
+    av_free(lat.us);
+    av_frame_free(&filt);
+    av_frame_free(&frame);
+    av_packet_free(&out_pkt);
+    av_packet_free(&pkt);
+    av_buffer_pool_uninit(&convert_pool);
+    avfilter_graph_free(&graph);
+    avcodec_free_context(&enc);
+    avcodec_free_context(&dec);
+    avformat_close_input(&ifmt);
+    return ret;
+}
+
+static int bench_pipeline(const BenchCase *c, AVBPrint *bp)
+{
+    TranscodeParams params;
+    StageStats *stats = NULL;
+    StageSummary sum;
+    char rate[16], *out = av_asprintf("%s.pipeline.webm", c->input);
+    int64_t start;
+    double wall;
+    int ret;
+
+    if (!out)
+        return AVERROR(ENOMEM);
+    if ((ret = stage_stats_alloc(&stats, NULL, 0, NULL, NULL)) < 0)
+        goto end;
+
+    transcode_params_default(&params);
+    snprintf(rate, sizeof(rate), "%d", c->rate);
+    params.in_filename = c->input;
+    params.out_filename = out;
+    params.framerate = rate;
+    params.stats = stats;
+
+    start = stage_stats_now();
+    if ((ret = transcode_run(&params)) < 0)
+        goto end;
+    wall = (stage_stats_now() - start) / 1000000.0;
+
+    stage_stats_summary(stats, STAGE_PIPELINE, &sum);
+    av_bprintf(bp, "\"frames\":%"PRIu64",\"wall_s\":%.3f,\"fps\":%.2f,"
+               "\"latency_us\":{\"avg\":%"PRIu64",\"p50\":%"PRIu64",\"p90\":%"PRIu64
+               ",\"p99\":%"PRIu64",\"max\":%"PRIu64"},\"stages\":{",
+               sum.frames, wall, sum.frames / wall,
+               sum.avg_us, sum.p50_us, sum.p90_us, sum.p99_us, sum.max_us);
+    for (int s = STAGE_DEMUX; s <= STAGE_MUX; s++) {
+        stage_stats_summary(stats, s, &sum);
+        av_bprintf(bp, "%s\"%s\":{\"frames\":%"PRIu64",\"avg_us\":%"PRIu64",\"p50_us\":%"PRIu64
+                   ",\"p90_us\":%"PRIu64",\"p99_us\":%"PRIu64",\"max_us\":%"PRIu64"}",
+                   s ? "," : "", stage_stats_name(s), sum.frames, sum.avg_us,
+                   sum.p50_us, sum.p90_us, sum.p99_us, sum.max_us);
+    }
+    av_bprintf(bp, "}");
+end:
+    unlink(out);
+    av_free(out);
+    stage_stats_free(&stats);
+    return ret;
+}
+
+/* Runs one benchmark in a child and appends its JSON object to bp. */
+static int run_child(const BenchCase *c, int m, AVBPrint *bp)
+{
+    struct rusage ru;
+    char buf[4096];
+    AVBPrint result;
+    int64_t start = stage_stats_now();
+    double wall, cpu;
+    int fds[2], status;
+    ssize_t len;
+    pid_t pid;
+
+    if (pipe(fds) < 0)
+        return AVERROR(errno);
+    fflush(NULL);
+    pid = fork();
+    if (pid < 0) {
+        close(fds[0]);
+        close(fds[1]);
+        return AVERROR(errno);
+    }
+    if (!pid) {
+        AVBPrint out;
+        int ret;
+
+        close(fds[0]);
+        av_bprint_init(&out, 0, AV_BPRINT_SIZE_UNLIMITED);
+        ret = modes[m].mode == MODE_PIPELINE ? bench_pipeline(c, &out)
+                                             : bench_stage(c, modes[m].mode, &out);
+        if (ret < 0) {
+            av_bprint_finalize(&out, NULL);
+            av_bprint_init(&out, 0, AV_BPRINT_SIZE_UNLIMITED);
+            av_bprintf(&out, "\"error\":\"%s\"", av_err2str(ret));
+        }
+        if (write(fds[1], out.str, out.len) != out.len)
+            ret = AVERROR(EIO);
+        av_bprint_finalize(&out, NULL);
+        _exit(ret < 0);
+    }
+
+    close(fds[1]);
+    av_bprint_init(&result, 0, AV_BPRINT_SIZE_UNLIMITED);
+    while ((len = read(fds[0], buf, sizeof(buf))) > 0)
+        av_bprintf(&result, "%.*s", (int)len, buf);
+    close(fds[0]);
+    if (wait4(pid, &status, 0, &ru) < 0) {
+        av_bprint_finalize(&result, NULL);
+        return AVERROR(errno);
+    }
+    wall = (stage_stats_now() - start) / 1000000.0;
+    cpu = ru.ru_utime.tv_sec + ru.ru_utime.tv_usec / 1000000.0 +
+          ru.ru_stime.tv_sec + ru.ru_stime.tv_usec / 1000000.0;
+
+    if (!result.len)
+        av_bprintf(&result, "\"error\":\"exit status %d\"", status);
+    /* cpu_util is in cores, e.g. 6.5 means six and a half cores were busy */
+    av_bprintf(bp, "{\"case\":\"%s\",\"width\":%d,\"height\":%d,\"rate\":%d,\"pix_fmt\":\"%s\","
+               "\"mode\":\"%s\",%s,\"process_wall_s\":%.3f,\"cpu_s\":%.3f,\"cpu_util\":%.2f,"
+               "\"peak_rss_kb\":%ld}",
+               c->name, c->width, c->height, c->rate, av_get_pix_fmt_name(c->pix_fmt),
+               modes[m].name, result.str, wall, cpu, cpu / FFMAX(wall, 1e-6), ru.ru_maxrss);
+    av_bprint_finalize(&result, NULL);
+    return 0;
+}
+
+static void usage(const char *name)
+{
+    av_log(NULL, AV_LOG_ERROR,
+           "Usage: %s [-n <frames>] [-o <dir>] [-c <case>] [-m <mode,...>] [-j <file>] [-v]\n"
+           "  -n <frames>  frames per generated input (default %d)\n"
+           "  -o <dir>     where the inputs are generated and kept (default %s)\n"
+           "  -c <case>    only cases whose name contains this, e.g. 1080p30 or _420\n"
+           "  -m <modes>   pipeline,demux,decode,filter,encode,mux (default all)\n"
+           "  -j <file>    write the JSON there instead of stdout\n"
+           "  -v           keep the transcoder's log output\n",
+           name, DEFAULT_FRAMES, DEFAULT_DIR);
+}
+
+int main(int argc, char **argv)
+{
+    const char *dir = DEFAULT_DIR, *filter = NULL, *mode_list = NULL, *json_path = NULL;
+    int nb_frames = DEFAULT_FRAMES, verbose = 0, first = 1;
+    char simd[256];
+    AVBPrint json;
+    FILE *out = stdout;
+    int opt, ret = 0;
+
+    while ((opt = getopt(argc, argv, "n:o:c:m:j:v")) != -1) {
+        switch (opt) {
+        case 'n': nb_frames = atoi(optarg); break;
+        case 'o': dir = optarg;             break;
+        case 'c': filter = optarg;          break;
+        case 'm': mode_list = optarg;       break;
+        case 'j': json_path = optarg;       break;
+        case 'v': verbose = 1;              break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if (optind != argc || nb_frames < 1) {
+        usage(argv[0]);
+        return 1;
+    }
+    if (!verbose)
+        av_log_set_level(AV_LOG_WARNING);
+    if (mkdir(dir, 0755) < 0 && errno != EEXIST) {
+        av_log(NULL, AV_LOG_ERROR, "Cannot create %s\n", dir);
+        return 1;
+    }
+
+    log_simd_report();
+    simd_flags_to_string(simd, sizeof(simd));
+
+    av_bprint_init(&json, 0, AV_BPRINT_SIZE_UNLIMITED);
+    av_bprintf(&json, "{\"ffmpeg\":\"%s\",\"cores\":%d,\"simd\":\"%s\",\"frames\":%d,"
+               "\"results\":[", av_version_info(), av_cpu_count(), simd, nb_frames);
+
+    for (int s = 0; s < FF_ARRAY_ELEMS(sizes); s++)
+    for (int r = 0; r < FF_ARRAY_ELEMS(rates); r++)
+    for (int f = 0; f < FF_ARRAY_ELEMS(pix_fmts); f++) {
+        BenchCase c = {
+            .width = sizes[s].width, .height = sizes[s].height,
+            .rate = rates[r], .pix_fmt = pix_fmts[f],
+        };
+        struct stat st;
+
+        snprintf(c.name, sizeof(c.name), "%dp%d_%s", c.height, c.rate,
+                 c.pix_fmt == AV_PIX_FMT_YUVJ422P ? "422" : "420");
+        if (filter && !strstr(c.name, filter))
+            continue;
+        snprintf(c.input, sizeof(c.input), "%s/%s_%d.mjpeg", dir, c.name, nb_frames);
+
+        if (stat(c.input, &st) < 0) {
+            av_log(NULL, AV_LOG_WARNING, "Generating %s\n", c.input);
+            if ((ret = generate_input(&c, nb_frames)) < 0) {
+                av_log(NULL, AV_LOG_ERROR, "Cannot generate %s: %s\n", c.input, av_err2str(ret));
+                goto end;
+            }
+        }
+
+        for (int m = 0; m < FF_ARRAY_ELEMS(modes); m++) {
+            if (mode_list && !av_match_name(modes[m].name, mode_list))
+                continue;
+            av_log(NULL, AV_LOG_WARNING, "Running %s %s\n", c.name, modes[m].name);
+            if (!first)
+                av_bprintf(&json, ",");
+            first = 0;
+            if ((ret = run_child(&c, m, &json)) < 0)
+                goto end;
+        }
+    }
+    av_bprintf(&json, "]}\n");
+
+    if (json_path && !(out = fopen(json_path, "w"))) {
+        ret = AVERROR(errno);
+        goto end;
+    }
+    fputs(json.str, out);
+    if (out != stdout)
+        fclose(out);
+end:
+    av_bprint_finalize(&json, NULL);
+    if (ret < 0)
+        av_log(NULL, AV_LOG_ERROR, "Error occurred: %s\n", av_err2str(ret));
+    return ret < 0;
+}
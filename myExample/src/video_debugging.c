@@ -7,16 +7,32 @@
 #include <libavutil/opt.h>
 #include <string.h>
 #include <inttypes.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <libavutil/bprint.h>
+#include <libavutil/cpu.h>
+#include <libavutil/time.h>
+#include "async_log.h"
 #include "video_debugging.h"
 
 void logging(const char *fmt, ...)
 {
+  /* the whole line fits one slot of the async logger's ring */
+  char line[ASYNC_LOG_LINE_SIZE];
   va_list args;
-  fprintf( stderr, "LOG: " );
+  int len = snprintf( line, sizeof(line), "LOG: " );
   va_start( args, fmt );
-  vfprintf( stderr, fmt, args );
+  len += vsnprintf( line + len, sizeof(line) - len, fmt, args );
   va_end( args );
-  fprintf( stderr, "\n" );
+  /* cut lines still end in a newline */
+  len = FFMIN( len, (int)sizeof(line) - 2 );
+  line[len] = '\n';
+  line[len + 1] = '\0';
+  /* stderr via av_log, from the async logger's thread once it runs */
+  async_log( AV_LOG_INFO, "%s", line );
 }
 
 void log_packet(const AVFormatContext *fmt_ctx, const AVPacket *pkt)
@@ -65,3 +81,330 @@ void print_timing(char *name, AVFormatContext *avf, AVCodecContext *avc, AVStrea
 
   logging("=================================================");
 }
+
+static const struct { int flag; const char *name; } simd_flags[] = {
+#if defined(__x86_64__) || defined(__i386__)
+    { AV_CPU_FLAG_SSE2,      "sse2" },
+    { AV_CPU_FLAG_SSE3,      "sse3" },
+    { AV_CPU_FLAG_SSSE3,     "ssse3" },
+    { AV_CPU_FLAG_SSE4,      "sse4.1" },
+    { AV_CPU_FLAG_SSE42,     "sse4.2" },
+    { AV_CPU_FLAG_AVX,       "avx" },
+    { AV_CPU_FLAG_AVX2,      "avx2" },
+    { AV_CPU_FLAG_FMA3,      "fma3" },
+    { AV_CPU_FLAG_BMI2,      "bmi2" },
+    { AV_CPU_FLAG_AVX512,    "avx512" },
+    { AV_CPU_FLAG_AVX512ICL, "avx512icl" },
+#elif defined(__aarch64__) || defined(__arm__)
+    { AV_CPU_FLAG_VFP,       "vfp" },
+    { AV_CPU_FLAG_NEON,      "neon" },
+    { AV_CPU_FLAG_ARMV8,     "armv8" },
+#endif
+};
+
+void simd_flags_to_string(char *buf, size_t size)
+{
+    int flags = av_get_cpu_flags();
+    size_t len = 0;
+
+    buf[0] = '\0';
+    for (int i = 0; i < FF_ARRAY_ELEMS(simd_flags) && len < size; i++) {
+        if (flags & simd_flags[i].flag)
+            len += snprintf(buf + len, size - len, "%s%s", len ? " " : "", simd_flags[i].name);
+    }
+}
+
+void log_simd_report(void)
+{
+    char names[256];
+
+    simd_flags_to_string(names, sizeof(names));
+#if defined(__x86_64__) || defined(__i386__)
+    if (strstr(avcodec_configuration(), "--disable-x86asm") ||
+        strstr(avcodec_configuration(), "--disable-asm")) {
+        av_log(NULL, AV_LOG_WARNING, "FFmpeg was built without x86 asm, the SIMD paths "
+               "(%s) are unused. Rebuild it with FFMpeg_themself/build_FFMpeg.sh release\n",
+               names[0] ? names : "none");
+        return;
+    }
+#endif
+    av_log(NULL, AV_LOG_INFO, "SIMD in use: %s\n", names[0] ? names : "none");
+}
+
+/* bucket i counts latencies below 2^i microseconds (and >= 2^(i-1)) */
+#define STATS_BUCKETS 32
+
+static const char *const stage_names[STAGE_NB] = {
+    [STAGE_DEMUX]    = "demux",
+    [STAGE_DECODE]   = "decode",
+    [STAGE_FILTER]   = "filter",
+    [STAGE_ENCODE]   = "encode",
+    [STAGE_MUX]      = "mux",
+    [STAGE_PIPELINE] = "pipeline",
+};
+
+typedef struct StageCounters {
+    atomic_uint_least64_t frames;
+    atomic_uint_least64_t time_sum;
+    atomic_uint_least64_t time_max; /* since the last report */
+    atomic_uint_least64_t time_max_total;
+    atomic_uint_least64_t hist[STATS_BUCKETS];
+} StageCounters;
+
+struct StageStats {
+    StageCounters stages[STAGE_NB];
+
+    StageQueueDepth queue_depth;
+    void *opaque;
+
+    FILE *file;
+    int sock;
+    struct sockaddr_un addr;
+
+    /* reporter thread */
+    int interval_ms;
+    int reporting; /* the thread is running */
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    int stop;
+    int64_t start_time;
+    int64_t last_time;
+    /* counters at the last report, only used by the reporter */
+    uint64_t last_frames[STAGE_NB];
+    uint64_t last_time_sum[STAGE_NB];
+    uint64_t last_hist[STAGE_NB][STATS_BUCKETS];
+};
+
+int64_t stage_stats_now(void)
+{
+    return av_gettime_relative();
+}
+
+void stage_stats_record(StageStats *stats, enum StatsStage stage, int64_t start)
+{
+    StageCounters *c;
+    uint64_t us, max;
+    int bucket;
+
+    if (!stats)
+        return;
+    c = &stats->stages[stage];
+    us = FFMAX(stage_stats_now() - start, 0);
+    bucket = us ? FFMIN(64 - __builtin_clzll(us), STATS_BUCKETS - 1) : 0;
+
+    atomic_fetch_add_explicit(&c->frames, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&c->time_sum, us, memory_order_relaxed);
+    atomic_fetch_add_explicit(&c->hist[bucket], 1, memory_order_relaxed);
+    max = atomic_load_explicit(&c->time_max, memory_order_relaxed);
+    while (us > max &&
+           !atomic_compare_exchange_weak_explicit(&c->time_max, &max, us,
+                                                  memory_order_relaxed,
+                                                  memory_order_relaxed))
+        ;
+    max = atomic_load_explicit(&c->time_max_total, memory_order_relaxed);
+    while (us > max &&
+           !atomic_compare_exchange_weak_explicit(&c->time_max_total, &max, us,
+                                                  memory_order_relaxed,
+                                                  memory_order_relaxed))
+        ;
+}
+
+const char *stage_stats_name(enum StatsStage stage)
+{
+    return stage_names[stage];
+}
+
+/* upper bound of the bucket holding the given fraction of the frames */
+static uint64_t hist_percentile(const uint64_t *hist, uint64_t total, double fraction)
+{
+    uint64_t seen = 0, rank = total * fraction;
+
+    for (int i = 0; i < STATS_BUCKETS; i++) {
+        seen += hist[i];
+        if (seen > rank)
+            return (uint64_t)1 << i;
+    }
+    return (uint64_t)1 << (STATS_BUCKETS - 1);
+}
+
+void stage_stats_summary(StageStats *stats, enum StatsStage stage, StageSummary *sum)
+{
+    StageCounters *c = &stats->stages[stage];
+    uint64_t hist[STATS_BUCKETS];
+
+    memset(sum, 0, sizeof(*sum));
+    sum->frames = atomic_load(&c->frames);
+    if (!sum->frames)
+        return;
+    for (int i = 0; i < STATS_BUCKETS; i++)
+        hist[i] = atomic_load(&c->hist[i]);
+    sum->avg_us = atomic_load(&c->time_sum) / sum->frames;
+    sum->p50_us = hist_percentile(hist, sum->frames, 0.50);
+    sum->p90_us = hist_percentile(hist, sum->frames, 0.90);
+    sum->p99_us = hist_percentile(hist, sum->frames, 0.99);
+    sum->max_us = atomic_load(&c->time_max_total);
+}
+
+static void stats_report(StageStats *stats)
+{
+    int64_t now = stage_stats_now();
+    double elapsed = FFMAX(now - stats->last_time, 1) / 1000000.0;
+    AVBPrint line;
+
+    av_bprint_init(&line, 0, AV_BPRINT_SIZE_UNLIMITED);
+    av_bprintf(&line, "{\"time\":%.3f,\"stages\":{", (now - stats->start_time) / 1000000.0);
+    for (int s = 0; s < STAGE_NB; s++) {
+        StageCounters *c = &stats->stages[s];
+        uint64_t hist[STATS_BUCKETS];
+        uint64_t frames, time_sum, max;
+
+        frames = atomic_load_explicit(&c->frames, memory_order_relaxed);
+        time_sum = atomic_load_explicit(&c->time_sum, memory_order_relaxed);
+        max = atomic_exchange_explicit(&c->time_max, 0, memory_order_relaxed);
+        for (int i = 0; i < STATS_BUCKETS; i++) {
+            uint64_t count = atomic_load_explicit(&c->hist[i], memory_order_relaxed);
+            hist[i] = count - stats->last_hist[s][i];
+            stats->last_hist[s][i] = count;
+        }
+
+        /* everything below is for this interval only */
+        frames -= stats->last_frames[s];
+        time_sum -= stats->last_time_sum[s];
+        stats->last_frames[s] += frames;
+        stats->last_time_sum[s] += time_sum;
+
+        av_bprintf(&line, "%s\"%s\":{\"frames\":%"PRIu64",\"fps\":%.1f", s ? "," : "",
+                   stage_names[s], frames, frames / elapsed);
+        if (frames)
+            av_bprintf(&line, ",\"avg_us\":%"PRIu64",\"p50_us\":%"PRIu64",\"p90_us\":%"PRIu64
+                       ",\"p99_us\":%"PRIu64",\"max_us\":%"PRIu64, time_sum / frames,
+                       hist_percentile(hist, frames, 0.50), hist_percentile(hist, frames, 0.90),
+                       hist_percentile(hist, frames, 0.99), max);
+        av_bprintf(&line, ",\"queue\":%d}",
+                   stats->queue_depth ? stats->queue_depth(stats->opaque, s) : -1);
+    }
+    av_bprintf(&line, "}}\n");
+    stats->last_time = now;
+
+    if (!av_bprint_is_complete(&line)) {
+        av_bprint_finalize(&line, NULL);
+        return;
+    }
+    if (stats->file) {
+        fputs(line.str, stats->file);
+        fflush(stats->file);
+    } else {
+        /* nobody listening is not an error, the line is just dropped */
+        sendto(stats->sock, line.str, line.len, MSG_DONTWAIT,
+               (const struct sockaddr *)&stats->addr, sizeof(stats->addr));
+    }
+    av_bprint_finalize(&line, NULL);
+}
+
+static void *stats_reporter_thread(void *arg)
+{
+    StageStats *stats = arg;
+    struct timespec deadline;
+
+    pthread_mutex_lock(&stats->lock);
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    while (!stats->stop) {
+        deadline.tv_sec += stats->interval_ms / 1000;
+        deadline.tv_nsec += (stats->interval_ms % 1000) * 1000000L;
+        if (deadline.tv_nsec >= 1000000000L) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000L;
+        }
+        while (!stats->stop &&
+               pthread_cond_timedwait(&stats->cond, &stats->lock, &deadline) == 0)
+            ;
+        pthread_mutex_unlock(&stats->lock);
+        stats_report(stats);
+        pthread_mutex_lock(&stats->lock);
+    }
+    pthread_mutex_unlock(&stats->lock);
+    return NULL;
+}
+
+int stage_stats_alloc(StageStats **pstats, const char *sink, int interval_ms,
+                      StageQueueDepth queue_depth, void *opaque)
+{
+    StageStats *stats;
+    int ret;
+
+    *pstats = NULL;
+    if (sink && interval_ms <= 0)
+        return AVERROR(EINVAL);
+    stats = av_mallocz(sizeof(*stats));
+    if (!stats)
+        return AVERROR(ENOMEM);
+    stats->sock = -1;
+    stats->queue_depth = queue_depth;
+    stats->opaque = opaque;
+    stats->start_time = stats->last_time = stage_stats_now();
+    pthread_mutex_init(&stats->lock, NULL);
+    pthread_cond_init(&stats->cond, NULL);
+
+    if (!sink) {
+        *pstats = stats;
+        return 0;
+    } else if (!strcmp(sink, "-")) {
+        stats->file = stderr;
+    } else if (!strncmp(sink, "unix:", 5)) {
+        stats->addr.sun_family = AF_UNIX;
+        if (strlen(sink + 5) >= sizeof(stats->addr.sun_path)) {
+            stage_stats_free(&stats);
+            return AVERROR(ENAMETOOLONG);
+        }
+        strcpy(stats->addr.sun_path, sink + 5);
+        stats->sock = socket(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+        if (stats->sock < 0) {
+            ret = AVERROR(errno);
+            stage_stats_free(&stats);
+            return ret;
+        }
+    } else {
+        stats->file = fopen(sink, "a");
+        if (!stats->file) {
+            ret = AVERROR(errno);
+            av_log(NULL, AV_LOG_ERROR, "Cannot open stats file %s\n", sink);
+            stage_stats_free(&stats);
+            return ret;
+        }
+    }
+
+    stats->interval_ms = interval_ms;
+    if ((ret = pthread_create(&stats->thread, NULL, stats_reporter_thread, stats))) {
+        stage_stats_free(&stats);
+        return AVERROR(ret);
+    }
+    stats->reporting = 1;
+
+    *pstats = stats;
+    return 0;
+}
+
+void stage_stats_free(StageStats **pstats)
+{
+    StageStats *stats = *pstats;
+
+    if (!stats)
+        return;
+    if (stats->reporting) {
+        pthread_mutex_lock(&stats->lock);
+        stats->stop = 1;
+        pthread_cond_signal(&stats->cond);
+        pthread_mutex_unlock(&stats->lock);
+        /* the reporter writes a last line for the frames since its last report */
+        pthread_join(stats->thread, NULL);
+    }
+    pthread_cond_destroy(&stats->cond);
+    pthread_mutex_destroy(&stats->lock);
+
+    if (stats->file && stats->file != stderr)
+        fclose(stats->file);
+    if (stats->sock >= 0)
+        close(stats->sock);
+    av_freep(pstats);
+}
@@ -1,3 +1,6 @@
+#ifndef VIDEO_DEBUGGING_H
+#define VIDEO_DEBUGGING_H
+
 #include <libavcodec/avcodec.h>
 #include <libavformat/avformat.h>
 #include <libavutil/timestamp.h>
@@ -8,6 +11,70 @@
 #include <string.h>
 #include <inttypes.h>
 
+/* One "LOG: " line at AV_LOG_INFO, so av_log_set_level() below that hides
+ * it. Lines are cut to ASYNC_LOG_LINE_SIZE. */
 void logging(const char *fmt, ...);
 void log_packet(const AVFormatContext *fmt_ctx, const AVPacket *pkt);
 void print_timing(char *name, AVFormatContext *avf, AVCodecContext *avc, AVStream *avs);
+
+/* SIMD extensions FFmpeg's runtime CPU detection found, e.g. "sse2 ... avx2" */
+void simd_flags_to_string(char *buf, size_t size);
+/* Log them at startup, and warn when libavcodec was configured without the
+ * x86 asm, in which case none of them is actually used. */
+void log_simd_report(void);
+
+/*
+ * Per-stage instrumentation for the transcode pipeline. Every stage reports
+ * how long it spent on each packet/frame, STAGE_PIPELINE gets the time from
+ * demux to mux of a frame. A reporter thread writes one JSON line per
+ * interval with frames, fps, latency percentiles (from log2 histograms) and
+ * the depth of the queue feeding each stage, e.g.
+ *   {"time":2.000,"stages":{"demux":{"frames":60,"fps":30.0,"avg_us":410,
+ *    "p50_us":512,"p90_us":1024,"p99_us":1024,"max_us":790,"queue":-1},...}}
+ * stage_stats_record() is lock-free and may be called from any thread.
+ */
+enum StatsStage {
+    STAGE_DEMUX,
+    STAGE_DECODE,
+    STAGE_FILTER,
+    STAGE_ENCODE,
+    STAGE_MUX,
+    STAGE_PIPELINE,
+    STAGE_NB
+};
+
+typedef struct StageStats StageStats;
+
+/* returns the depth of the queue in front of stage, or -1 if it has none */
+typedef int (*StageQueueDepth)(void *opaque, enum StatsStage stage);
+
+/*
+ * sink: "-" for stderr, "unix:<path>" for a local datagram socket (one line
+ * per datagram) or a file name. A line is written every interval_ms and a
+ * last one on stage_stats_free(). With a NULL sink nothing is written, the
+ * totals can be read with stage_stats_summary().
+ */
+int stage_stats_alloc(StageStats **pstats, const char *sink, int interval_ms,
+                      StageQueueDepth queue_depth, void *opaque);
+void stage_stats_free(StageStats **pstats);
+
+/* monotonic clock in microseconds, for the start argument below */
+int64_t stage_stats_now(void);
+/* one packet/frame went through stage, which started on it at start;
+ * a NULL stats is allowed and does nothing */
+void stage_stats_record(StageStats *stats, enum StatsStage stage, int64_t start);
+
+/* totals since stage_stats_alloc(), percentiles are histogram bucket bounds */
+typedef struct StageSummary {
+    uint64_t frames;
+    uint64_t avg_us;
+    uint64_t p50_us;
+    uint64_t p90_us;
+    uint64_t p99_us;
+    uint64_t max_us;
+} StageSummary;
+
+void stage_stats_summary(StageStats *stats, enum StatsStage stage, StageSummary *sum);
+const char *stage_stats_name(enum StatsStage stage);
+
+#endif /* VIDEO_DEBUGGING_H */
@@ -0,0 +1,106 @@
+#include <libavutil/avutil.h>
+#include <libavutil/cpu.h>
+#include <libavutil/dict.h>
+#include "vp9_tuning.h"
+
+/* libvpx refuses tiles narrower than 256 pixels */
+#define VP9_MIN_TILE_WIDTH 256
+/* libvpx-vp9 gains little from more threads than this for one stream */
+#define VP9_MAX_THREADS 16
+
+static int log2_floor(int v)
+{
+    int n = 0;
+
+    while (v > 1) {
+        v >>= 1;
+        n++;
+    }
+    return n;
+}
+
+void vp9_tuning_auto(Vp9Tuning *t, int width, int height, int nb_cores)
+{
+    int max_tile_columns;
+
+    if (nb_cores <= 0)
+        nb_cores = av_cpu_count();
+
+    t->threads = FFMIN(FFMAX(nb_cores, 1), VP9_MAX_THREADS);
+
+    /* one tile column per thread as far as the picture width allows,
+     * tile columns are what libvpx parallelises over */
+    max_tile_columns = log2_floor(FFMAX(width / VP9_MIN_TILE_WIDTH, 1));
+    t->tile_columns = FFMIN(log2_floor(t->threads), max_tile_columns);
+    t->tile_rows = height >= 2160 && t->threads > (1 << t->tile_columns) ? 1 : 0;
+
+    /* row based multithreading lets the threads left over after the
+     * tiles are handed out work inside the tiles */
+    t->row_mt = t->threads > 1;
+    t->frame_parallel = 0;
+
+    if (width * height >= 3840 * 2160)
+        t->cpu_used = 4;
+    else if (width * height >= 1920 * 1080)
+        t->cpu_used = 3;
+    else
+        t->cpu_used = 2;
+    t->deadline = "good";
+    t->lag_in_frames = 25;
+}
+
+void vp9_tuning_realtime(Vp9Tuning *t, int width, int height)
+{
+    /* libvpx only honours cpu-used 5..9 in realtime mode */
+    if (width * height >= 3840 * 2160)
+        t->cpu_used = 9;
+    else if (width * height >= 1920 * 1080)
+        t->cpu_used = 8;
+    else
+        t->cpu_used = 7;
+    t->deadline = "realtime";
+    /* every frame leaves the encoder as soon as it is encoded */
+    t->lag_in_frames = 0;
+}
+
+int vp9_tuning_to_dict(const Vp9Tuning *t, AVDictionary **opts)
+{
+    int ret;
+
+    if ((ret = av_dict_set_int(opts, "threads", t->threads, AV_DICT_DONT_OVERWRITE)) < 0 ||
+        (ret = av_dict_set_int(opts, "tile-columns", t->tile_columns, AV_DICT_DONT_OVERWRITE)) < 0 ||
+        (ret = av_dict_set_int(opts, "tile-rows", t->tile_rows, AV_DICT_DONT_OVERWRITE)) < 0 ||
+        (ret = av_dict_set_int(opts, "row-mt", t->row_mt, AV_DICT_DONT_OVERWRITE)) < 0 ||
+        (ret = av_dict_set_int(opts, "frame-parallel", t->frame_parallel, AV_DICT_DONT_OVERWRITE)) < 0 ||
+        (ret = av_dict_set_int(opts, "cpu-used", t->cpu_used, AV_DICT_DONT_OVERWRITE)) < 0 ||
+        (ret = av_dict_set(opts, "deadline", t->deadline, AV_DICT_DONT_OVERWRITE)) < 0 ||
+        (ret = av_dict_set_int(opts, "lag-in-frames", t->lag_in_frames, AV_DICT_DONT_OVERWRITE)) < 0)
+        return ret;
+    return 0;
+}
+
+int vp9_tuning_set_defaults(AVDictionary **opts, int width, int height, int nb_cores,
+                            int realtime)
+{
+    static const char *const keys[] = {
+        "threads", "tile-columns", "tile-rows", "row-mt",
+        "frame-parallel", "cpu-used", "deadline", "lag-in-frames",
+    };
+    Vp9Tuning t;
+    char line[256] = "";
+    int ret;
+
+    vp9_tuning_auto(&t, width, height, nb_cores);
+    if (realtime)
+        vp9_tuning_realtime(&t, width, height);
+    if ((ret = vp9_tuning_to_dict(&t, opts)) < 0)
+        return ret;
+
+    for (int i = 0; i < FF_ARRAY_ELEMS(keys); i++) {
+        const AVDictionaryEntry *e = av_dict_get(*opts, keys[i], NULL, 0);
+        size_t len = strlen(line);
+        snprintf(line + len, sizeof(line) - len, " %s=%s", keys[i], e ? e->value : "?");
+    }
+    av_log(NULL, AV_LOG_INFO, "libvpx-vp9 %dx%d:%s\n", width, height, line);
+    return 0;
+}
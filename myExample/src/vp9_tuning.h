@@ -0,0 +1,38 @@
+#ifndef VP9_TUNING_H
+#define VP9_TUNING_H
+
+#include <libavutil/dict.h>
+
+/*
+ * libvpx-vp9 speed/threading settings. The names follow the libvpx-vp9
+ * private options of the same name, tile_columns/tile_rows are log2 values.
+ */
+typedef struct Vp9Tuning {
+    int threads;
+    int tile_columns;
+    int tile_rows;
+    int row_mt;
+    int frame_parallel;
+    int cpu_used;
+    const char *deadline; /* "best", "good" or "realtime" */
+    int lag_in_frames;
+} Vp9Tuning;
+
+/* Pick settings for a width x height encode that may use nb_cores cores,
+ * nb_cores <= 0 means all cores of the host. */
+void vp9_tuning_auto(Vp9Tuning *t, int width, int height, int nb_cores);
+
+/* Switch settings picked by vp9_tuning_auto() to live encoding: realtime
+ * deadline, no lookahead and a speed that keeps up with the input. */
+void vp9_tuning_realtime(Vp9Tuning *t, int width, int height);
+
+/* Add the settings to an encoder options dictionary. Keys already present
+ * in *opts are per-job overrides and are kept. */
+int vp9_tuning_to_dict(const Vp9Tuning *t, AVDictionary **opts);
+
+/* vp9_tuning_auto() (+ vp9_tuning_realtime() if realtime) +
+ * vp9_tuning_to_dict(), logs the resulting settings */
+int vp9_tuning_set_defaults(AVDictionary **opts, int width, int height, int nb_cores,
+                            int realtime);
+
+#endif /* VP9_TUNING_H */
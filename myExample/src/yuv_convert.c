@@ -0,0 +1,227 @@
+#include <pthread.h>
+#include <string.h>
+#include <libavutil/common.h>
+#include <libavutil/cpu.h>
+#include <libavutil/error.h>
+#include "yuv_convert.h"
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#define HAVE_X86_KERNELS 1
+#include <immintrin.h>
+#else
+#define HAVE_X86_KERNELS 0
+#endif
+
+/* 219/255 and 224/255 in Q15, the multipliers of pmulhrsw */
+#define Y_MUL 28142
+#define C_MUL 28784
+
+/* luma: full -> limited range */
+typedef void (*LumaRowFunc)(uint8_t *dst, const uint8_t *src, int w);
+/* chroma: average two rows, optionally full -> limited range */
+typedef void (*ChromaRowFunc)(uint8_t *dst, const uint8_t *src0, const uint8_t *src1,
+                              int w, int full_range);
+
+/* (a * b + 2^14) >> 15, what pmulhrsw computes per lane */
+static inline int mulhrs(int a, int b)
+{
+    return (a * b + (1 << 14)) >> 15;
+}
+
+static void luma_row_c(uint8_t *dst, const uint8_t *src, int w)
+{
+    for (int x = 0; x < w; x++)
+        dst[x] = mulhrs(src[x], Y_MUL) + 16;
+}
+
+static void chroma_row_c(uint8_t *dst, const uint8_t *src0, const uint8_t *src1,
+                         int w, int full_range)
+{
+    for (int x = 0; x < w; x++) {
+        int c = (src0[x] + src1[x] + 1) >> 1;
+        dst[x] = full_range ? mulhrs(c - 128, C_MUL) + 128 : c;
+    }
+}
+
+#if HAVE_X86_KERNELS
+/* Both SIMD kernels widen with unpack{lo,hi} and narrow with packus, which
+ * work per 128-bit lane alike, so the byte order survives the round trip. */
+__attribute__((target("sse4.1")))
+static void luma_row_sse4(uint8_t *dst, const uint8_t *src, int w)
+{
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i mul = _mm_set1_epi16(Y_MUL), off = _mm_set1_epi16(16);
+    int x = 0;
+
+    for (; x + 16 <= w; x += 16) {
+        __m128i v  = _mm_loadu_si128((const __m128i *)(src + x));
+        __m128i lo = _mm_add_epi16(_mm_mulhrs_epi16(_mm_unpacklo_epi8(v, zero), mul), off);
+        __m128i hi = _mm_add_epi16(_mm_mulhrs_epi16(_mm_unpackhi_epi8(v, zero), mul), off);
+        _mm_storeu_si128((__m128i *)(dst + x), _mm_packus_epi16(lo, hi));
+    }
+    luma_row_c(dst + x, src + x, w - x);
+}
+
+__attribute__((target("sse4.1")))
+static void chroma_row_sse4(uint8_t *dst, const uint8_t *src0, const uint8_t *src1,
+                            int w, int full_range)
+{
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i mul = _mm_set1_epi16(C_MUL), off = _mm_set1_epi16(128);
+    int x = 0;
+
+    for (; x + 16 <= w; x += 16) {
+        __m128i v = _mm_avg_epu8(_mm_loadu_si128((const __m128i *)(src0 + x)),
+                                 _mm_loadu_si128((const __m128i *)(src1 + x)));
+        if (full_range) {
+            __m128i lo = _mm_sub_epi16(_mm_unpacklo_epi8(v, zero), off);
+            __m128i hi = _mm_sub_epi16(_mm_unpackhi_epi8(v, zero), off);
+            lo = _mm_add_epi16(_mm_mulhrs_epi16(lo, mul), off);
+            hi = _mm_add_epi16(_mm_mulhrs_epi16(hi, mul), off);
+            v  = _mm_packus_epi16(lo, hi);
+        }
+        _mm_storeu_si128((__m128i *)(dst + x), v);
+    }
+    chroma_row_c(dst + x, src0 + x, src1 + x, w - x, full_range);
+}
+
+__attribute__((target("avx2")))
+static void luma_row_avx2(uint8_t *dst, const uint8_t *src, int w)
+{
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i mul = _mm256_set1_epi16(Y_MUL), off = _mm256_set1_epi16(16);
+    int x = 0;
+
+    for (; x + 32 <= w; x += 32) {
+        __m256i v  = _mm256_loadu_si256((const __m256i *)(src + x));
+        __m256i lo = _mm256_add_epi16(_mm256_mulhrs_epi16(_mm256_unpacklo_epi8(v, zero), mul), off);
+        __m256i hi = _mm256_add_epi16(_mm256_mulhrs_epi16(_mm256_unpackhi_epi8(v, zero), mul), off);
+        _mm256_storeu_si256((__m256i *)(dst + x), _mm256_packus_epi16(lo, hi));
+    }
+    luma_row_sse4(dst + x, src + x, w - x);
+}
+
+__attribute__((target("avx2")))
+static void chroma_row_avx2(uint8_t *dst, const uint8_t *src0, const uint8_t *src1,
+                            int w, int full_range)
+{
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i mul = _mm256_set1_epi16(C_MUL), off = _mm256_set1_epi16(128);
+    int x = 0;
+
+    for (; x + 32 <= w; x += 32) {
+        __m256i v = _mm256_avg_epu8(_mm256_loadu_si256((const __m256i *)(src0 + x)),
+                                    _mm256_loadu_si256((const __m256i *)(src1 + x)));
+        if (full_range) {
+            __m256i lo = _mm256_sub_epi16(_mm256_unpacklo_epi8(v, zero), off);
+            __m256i hi = _mm256_sub_epi16(_mm256_unpackhi_epi8(v, zero), off);
+            lo = _mm256_add_epi16(_mm256_mulhrs_epi16(lo, mul), off);
+            hi = _mm256_add_epi16(_mm256_mulhrs_epi16(hi, mul), off);
+            v  = _mm256_packus_epi16(lo, hi);
+        }
+        _mm256_storeu_si256((__m256i *)(dst + x), v);
+    }
+    chroma_row_sse4(dst + x, src0 + x, src1 + x, w - x, full_range);
+}
+#endif
+
+static pthread_once_t kernels_once = PTHREAD_ONCE_INIT;
+static LumaRowFunc luma_row = luma_row_c;
+static ChromaRowFunc chroma_row = chroma_row_c;
+static const char *kernel_name = "c";
+
+/* av_get_cpu_flags() rather than cpuid, so av_force_cpu_flags() applies */
+static void init_kernels(void)
+{
+#if HAVE_X86_KERNELS
+    int flags = av_get_cpu_flags();
+
+    if (flags & AV_CPU_FLAG_AVX2) {
+        luma_row   = luma_row_avx2;
+        chroma_row = chroma_row_avx2;
+        kernel_name = "avx2";
+    } else if (flags & AV_CPU_FLAG_SSE4) {
+        luma_row   = luma_row_sse4;
+        chroma_row = chroma_row_sse4;
+        kernel_name = "sse4.1";
+    }
+#endif
+}
+
+int yuv_convert_supported(enum AVPixelFormat src_fmt, enum AVPixelFormat dst_fmt)
+{
+    return (src_fmt == AV_PIX_FMT_YUVJ422P || src_fmt == AV_PIX_FMT_YUV422P) &&
+           dst_fmt == AV_PIX_FMT_YUV420P;
+}
+
+/* dst may be src's own planes, see yuv_convert_frame() */
+static void convert_planes(uint8_t *const dst[3], const int dst_linesize[3], const AVFrame *src)
+{
+    int chroma_w = AV_CEIL_RSHIFT(src->width, 1);
+    int chroma_h = AV_CEIL_RSHIFT(src->height, 1);
+    int full_range = src->format == AV_PIX_FMT_YUVJ422P ||
+                     src->color_range == AVCOL_RANGE_JPEG;
+
+    pthread_once(&kernels_once, init_kernels);
+    for (int y = 0; y < src->height; y++) {
+        uint8_t *dst_row = dst[0] + y * dst_linesize[0];
+        const uint8_t *src_row = src->data[0] + y * src->linesize[0];
+
+        if (full_range)
+            luma_row(dst_row, src_row, src->width);
+        else if (dst_row != src_row)
+            memcpy(dst_row, src_row, src->width);
+    }
+
+    /* output row y only reads input rows 2y and 2y+1, which are never
+     * above it, so the rows can be written top to bottom in place */
+    for (int p = 1; p <= 2; p++) {
+        for (int y = 0; y < chroma_h; y++) {
+            const uint8_t *src0 = src->data[p] + 2 * y * src->linesize[p];
+            const uint8_t *src1 = 2 * y + 1 < src->height ? src0 + src->linesize[p] : src0;
+            chroma_row(dst[p] + y * dst_linesize[p], src0, src1, chroma_w, full_range);
+        }
+    }
+}
+
+static void set_converted_props(AVFrame *frame)
+{
+    frame->format      = AV_PIX_FMT_YUV420P;
+    frame->color_range = AVCOL_RANGE_MPEG;
+    /* vertically the samples now sit between the averaged rows */
+    if (frame->chroma_location != AVCHROMA_LOC_LEFT)
+        frame->chroma_location = AVCHROMA_LOC_CENTER;
+}
+
+int yuv_convert_frame(AVFrame *frame)
+{
+    if (!yuv_convert_supported(frame->format, AV_PIX_FMT_YUV420P) ||
+        !av_frame_is_writable(frame))
+        return AVERROR(EINVAL);
+
+    convert_planes(frame->data, frame->linesize, frame);
+    set_converted_props(frame);
+    return 0;
+}
+
+int yuv_convert_frame_to(AVFrame *dst, const AVFrame *src)
+{
+    int ret;
+
+    if (!yuv_convert_supported(src->format, AV_PIX_FMT_YUV420P) ||
+        dst->format != AV_PIX_FMT_YUV420P || dst->width != src->width ||
+        dst->height != src->height)
+        return AVERROR(EINVAL);
+    if ((ret = av_frame_copy_props(dst, src)) < 0)
+        return ret;
+
+    convert_planes(dst->data, dst->linesize, src);
+    set_converted_props(dst);
+    return 0;
+}
+
+const char *yuv_convert_kernel_name(void)
+{
+    pthread_once(&kernels_once, init_kernels);
+    return kernel_name;
+}
@@ -0,0 +1,38 @@
+#ifndef YUV_CONVERT_H
+#define YUV_CONVERT_H
+
+#include <libavutil/frame.h>
+#include <libavutil/pixfmt.h>
+
+/*
+ * 4:2:2 -> 4:2:0 conversion for the MJPEG -> VP9 path, done in place on
+ * the decoder's frame instead of through swscale. MJPEG cameras deliver
+ * full range yuvj422p while the encoder takes limited range yuv420p, so
+ * every frame needs a vertical chroma downsample and, for full range input,
+ * a range compression:
+ *
+ *   Y' = Y * 219/255 + 16
+ *   C' = (C - 128) * 224/255 + 128
+ *
+ * Chroma rows are averaged in pairs before the range compression. The math
+ * is 15-bit fixed point so the scalar, SSE4.1 and AVX2 kernels produce the
+ * same bytes.
+ */
+
+/* whether frames of src_fmt can be converted to dst_fmt by yuv_convert_frame() */
+int yuv_convert_supported(enum AVPixelFormat src_fmt, enum AVPixelFormat dst_fmt);
+
+/* Convert a yuvj422p/yuv422p frame to limited range yuv420p. The 4:2:0
+ * chroma planes fit into the 4:2:2 ones, so the frame's buffers are reused.
+ * The frame must be writable (av_frame_is_writable()), AVERROR(EINVAL)
+ * otherwise: a decoder that still references it needs yuv_convert_frame_to(). */
+int yuv_convert_frame(AVFrame *frame);
+
+/* The same conversion out of place, into dst: a yuv420p frame of src's size
+ * with buffers allocated by the caller. Frame properties are copied. */
+int yuv_convert_frame_to(AVFrame *dst, const AVFrame *src);
+
+/* name of the kernel picked for this CPU ("avx2", "sse4.1" or "c") */
+const char *yuv_convert_kernel_name(void);
+
+#endif /* YUV_CONVERT_H */